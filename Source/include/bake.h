@@ -0,0 +1,52 @@
+#ifndef BAKE_H
+#define BAKE_H
+
+#include "mesh.h"
+
+/* Largest number of directional lights baked into a mesh */
+#define BAKE_MAX_LIGHTS 4
+
+/**
+ * @brief Directional light baked into a mesh.
+ */
+typedef struct
+{
+    Vector3D direction;     /* Unit direction the light travels in, in mesh space */
+    float intensity;        /* Intensity added to points fully facing the light */
+} BakeLight;
+
+/**
+ * @brief Lighting baked by bakeMeshLighting.
+ */
+typedef struct
+{
+    float ambient;              /* Intensity of unoccluded points facing no light */
+    BakeLight lights[BAKE_MAX_LIGHTS];
+    int lightCount;
+    int castShadows;            /* Non-zero to cast a ray towards each light and drop it when blocked */
+    int occlusionRays;          /* Rays cast over the hemisphere of each point for ambient occlusion, 0 to disable */
+    float occlusionDistance;    /* Reach of the occlusion rays, as a fraction of the bounds radius */
+} BakeSettings;
+
+/**
+ * @brief Gets the settings used when none are given, a key and a fill light with ambient occlusion.
+ *
+ * @param settings The settings to fill.
+ */
+void bakeDefaultSettings(BakeSettings* settings);
+
+/**
+ * @brief Bakes static lighting into a mesh, casting rays against its own faces.
+ *
+ * The pattern of each face is replaced by the light at its centroid and
+ * bakedLevels receives the light at each vertex, so rendering the mesh takes
+ * no light math at all. Both are stored by the binary and compressed formats.
+ * buildMeshBSP interpolates the baked light of the vertices it adds.
+ *
+ * @param mesh The mesh to bake, with growable arrays, quantized or not.
+ * @param settings The lights, NULL for bakeDefaultSettings.
+ * @return int 0 on success, non-zero on failure.
+ */
+int bakeMeshLighting(Mesh* mesh, const BakeSettings* settings);
+
+#endif /* BAKE_H */
@@ -0,0 +1,54 @@
+#ifndef BSP_H
+#define BSP_H
+
+#include "vector.h"
+#include "triangle.h"
+
+/**
+ * @brief Represents a node of a BSP tree built over the faces of a mesh.
+ *
+ * Each node owns a splitting plane and the contiguous range of mesh faces
+ * lying on it. Children are indices into the mesh node array, -1 when empty.
+ * The root of a tree is always node 0.
+ */
+typedef struct
+{
+    Vector3D normal;    /* Normal of the splitting plane */
+    float distance;     /* Plane offset, points p on the plane satisfy dot(normal, p) == distance */
+    int firstFace;      /* Index of the first face on this plane in the mesh face array */
+    int faceCount;      /* Number of faces on this plane */
+    int front;          /* Index of the child node in front of the plane, or -1 */
+    int back;           /* Index of the child node behind the plane, or -1 */
+} BSPNode;
+
+struct Mesh;
+
+/**
+ * @brief Builds a BSP tree over the faces of a static mesh.
+ *
+ * Faces straddling a splitting plane are split, which appends new vertices
+ * and faces to the mesh. The face array is rewritten so that the faces of
+ * every node are contiguous. The resulting nodes are stored in mesh->bspNodes,
+ * children always after their parent. Convex meshes get no tree, none of
+ * their faces can hide another.
+ *
+ * @param mesh The mesh to build the tree for.
+ * @return int 0 on success, non-zero on failure.
+ */
+int buildMeshBSP(struct Mesh* mesh);
+
+/**
+ * @brief Walks the BSP tree of a mesh in back-to-front order.
+ *
+ * The walk needs no stack of its own, pending nodes are kept in the unused
+ * end of faceOrder.
+ *
+ * @param mesh The mesh whose tree is traversed.
+ * @param eye The viewer position in the mesh's local space.
+ * @param faceOrder Output array, receives the face indices in back-to-front order.
+ *                  Must hold at least arrlen(mesh->faces) entries.
+ * @return int The number of face indices written.
+ */
+int traverseMeshBSP(const struct Mesh* mesh, Vector3D eye, int* faceOrder);
+
+#endif /* BSP_H */
@@ -19,6 +19,40 @@ enum renderMode
 	kRenderSolidWireframe
 } renderMode;
 
+enum depthMode
+{
+	kDepthSort,
+	kDepthZBuffer,
+	kDepthFrontToBack,
+	kDepthScanline
+} depthMode;
+
+/**
+ * @brief Shade of the pixels of a span on one row.
+ *
+ * Flat spans repeat one pattern row. Smooth spans step a dither level in 16.16
+ * fixed point and take the precomputed row mask of the level reached in the
+ * middle of each framebuffer byte, so 8 pixels are shaded with one lookup.
+ * Textured spans interpolate u/z, v/z and 1/z, which are linear in screen space.
+ */
+typedef struct
+{
+    uint8_t patternRow;     /* Pattern row of a flat span */
+    uint8_t smooth;         /* Non-zero to dither the level instead of using patternRow */
+    uint8_t ditherRow;      /* Row of the dither matrix, y & 7 */
+    uint8_t intensity;      /* 4-bit intensity of a flat span, set by the triangle fills for deferred shading */
+    int xStart;             /* First pixel of the span */
+    int xEnd;               /* Last pixel of a textured span */
+    int32_t level;          /* Dither level at xStart, 16.16 fixed point */
+    int32_t levelStep;      /* Change of the dither level per pixel */
+    const Texture* texture; /* Texture of a textured span, NULL otherwise */
+    float uvw[3];           /* u/z, v/z in texels and 1/z at the left edge of the row */
+    float uvwDx[3];         /* Change of uvw per pixel */
+} SpanShade;
+
+/* Pixels lit by each dither level on each row of the 8x8 Bayer matrix, built by initDisplay */
+extern uint8_t ditherRowMasks[DITHER_LEVELS][8];
+
 /**
  * @brief Initializes the display system.
  *
@@ -62,6 +96,258 @@ void drawTriangle(int x0, int y0, int x1, int y1, int x2, int y2, LCDSolidColor
  */
 void drawFilledTriangle(int x0, int y0, int x1, int y1, int x2, int y2, LCDSolidColor color);
 
+/**
+ * @brief Draws a filled triangle with its pattern.
+ *
+ * Pixels are sampled at their centers, like the depth and coverage fills,
+ * and written a framebuffer byte at a time.
+ *
+ * @param triangle The triangle to draw.
+ * @param color Color used if the triangle has no pattern (kColorBlack or kColorWhite).
+ */
+void drawFilledTrianglePattern(const Triangle2D* triangle, LCDSolidColor color);
+
+/**
+ * @brief Draws a filled triangle and its outline in a single pass.
+ *
+ * Each row of the fill is written together with the runs of pixels drawLine
+ * sets on it for the three edges, so the result is the same as drawing the
+ * fill then drawTriangle, with every pixel written once.
+ *
+ * @param triangle The triangle to draw.
+ * @param color Color used if the triangle has no pattern (kColorBlack or kColorWhite).
+ * @param outlineColor Color of the outline (kColorBlack or kColorWhite).
+ */
+void drawFilledTriangleOutline(const Triangle2D* triangle, LCDSolidColor color, LCDSolidColor outlineColor);
+
+/**
+ * @brief Allocates the edge flag buffer of drawFilledPolygonEdgeFlag on first use.
+ *
+ * Call it outside the frame so that the first edge flag fill does not allocate.
+ *
+ * @return int 0 on success, non-zero on failure.
+ */
+int prepareEdgeFlagBuffer(void);
+
+/**
+ * @brief Fills a polygon with a pattern by edge flagging.
+ *
+ * Each edge toggles one flag per row whose pixel center it crosses, then a
+ * single XOR-prefix pass per row turns the flags between the edges into
+ * pixels, a byte at a time. There is no per-polygon span setup, so quads and
+ * n-gons cost the same as triangles, and concave or self-intersecting
+ * polygons are filled with the even-odd rule. Pixels are sampled at their
+ * centers like drawFilledTrianglePattern. Needs prepareEdgeFlagBuffer.
+ *
+ * @param points Screen-space points of the polygon, in order around it.
+ * @param count Number of points.
+ * @param pattern Pattern of the fill, NULL to fill with color.
+ * @param color Color used if there is no pattern (kColorBlack or kColorWhite).
+ */
+void drawFilledPolygonEdgeFlag(const Vector2D* points, int count, const LCDPattern* pattern, LCDSolidColor color);
+
+/**
+ * @brief Draws a filled triangle with drawFilledPolygonEdgeFlag.
+ *
+ * Smooth and textured triangles vary along their spans, they are drawn by
+ * drawFilledTrianglePattern instead.
+ *
+ * @param triangle The triangle to draw.
+ * @param color Color used if the triangle has no pattern (kColorBlack or kColorWhite).
+ */
+void drawFilledTriangleEdgeFlag(const Triangle2D* triangle, LCDSolidColor color);
+
+/**
+ * @brief Draws a filled triangle, testing and writing the depth buffer.
+ *
+ * Depth is interpolated per span in fixed point. Spans and whole triangles
+ * hidden behind the coarse per-tile depth are rejected before any per-pixel test.
+ *
+ * @param triangle The triangle to draw, with the view-space depth of each point.
+ * @param color Color used if the triangle has no pattern (kColorBlack or kColorWhite).
+ */
+void drawFilledTriangleDepth(const Triangle2D* triangle, LCDSolidColor color);
+
+/**
+ * @brief Draws the outline of a triangle, hiding the pixels behind the depth buffer.
+ *
+ * @param triangle The triangle to draw, with the view-space depth of each point.
+ * @param color Color of the outline (kColorBlack or kColorWhite).
+ */
+void drawTriangleDepth(const Triangle2D* triangle, LCDSolidColor color);
+
+/**
+ * @brief Allocates the depth buffer if it is not yet, without clearing it.
+ *
+ * Lets the buffer be allocated outside the frame before the Z-buffer mode first renders.
+ *
+ * @return int 0 on success, non-zero on failure.
+ */
+int prepareDepthBuffer(void);
+
+/**
+ * @brief Clears the depth buffer, allocating it on first use.
+ *
+ * @return int 0 on success, non-zero on failure.
+ */
+int clearDepthBuffer(void);
+
+/**
+ * @brief Allocates the intensity buffer of deferred shading if it is not yet.
+ *
+ * @return int 0 on success, non-zero on failure.
+ */
+int prepareIntensityBuffer(void);
+
+/**
+ * @brief Starts deferred shading of the filled triangles.
+ *
+ * Until resolveDeferredShading, drawFilledTrianglePattern,
+ * drawFilledTriangleOutline, drawFilledPolygonEdgeFlag and
+ * drawFilledTriangleDepth store a 4-bit intensity per covered pixel instead
+ * of dithered pixels. Hidden pixels are overwritten, by painter's order or by
+ * the depth test, before any dithering is done. The intensity buffer is
+ * allocated on first use.
+ *
+ * @return int 0 on success, non-zero on failure, the fills then keep writing the framebuffer.
+ */
+int beginDeferredShading(void);
+
+/**
+ * @brief Dithers the intensities stored since beginDeferredShading into the framebuffer.
+ *
+ * A single pass over the screen with the 8x8 Bayer matrix, 8 pixels per
+ * framebuffer byte. Pixels no triangle covered are left untouched.
+ */
+void resolveDeferredShading(void);
+
+/**
+ * @brief Draws a filled triangle over the pixels not yet covered.
+ *
+ * Meant for front-to-back rendering: covered pixels are left untouched and
+ * the written pixels become covered. Triangles whose bounding box is fully
+ * covered are rejected before scan conversion.
+ *
+ * @param triangle The triangle to draw.
+ * @param color Color used if the triangle has no pattern (kColorBlack or kColorWhite).
+ */
+void drawFilledTriangleCoverage(const Triangle2D* triangle, LCDSolidColor color);
+
+/**
+ * @brief Draws the outline of a triangle over the pixels not yet covered.
+ *
+ * Call before drawFilledTriangleCoverage so the outline is kept by the fill.
+ *
+ * @param triangle The triangle to draw.
+ * @param color Color of the outline (kColorBlack or kColorWhite).
+ */
+void drawTriangleCoverage(const Triangle2D* triangle, LCDSolidColor color);
+
+/**
+ * @brief Checks whether every pixel of the frame is covered.
+ *
+ * @return int 1 if no further triangle can be visible, 0 otherwise.
+ */
+int isFrameCovered(void);
+
+/**
+ * @brief Allocates the coverage mask if it is not yet, without clearing it.
+ *
+ * @return int 0 on success, non-zero on failure.
+ */
+int prepareCoverageBuffer(void);
+
+/**
+ * @brief Clears the coverage mask, allocating it on first use.
+ *
+ * @return int 0 on success, non-zero on failure.
+ */
+int clearCoverageBuffer(void);
+
+/**
+ * @brief Writes a row of packed pixels to the framebuffer through a mask.
+ *
+ * Only the bytes with a non-zero mask are touched.
+ *
+ * @param y Row to write.
+ * @param data Packed pixels of the row, one bit per pixel, LCD_ROWSIZE bytes.
+ * @param mask Bits set for the pixels to write, LCD_ROWSIZE bytes.
+ */
+void drawRowMasked(int y, const uint8_t* data, const uint8_t* mask);
+
+/**
+ * @brief Shades a span with one pattern row.
+ *
+ * @param shade The shade to set up.
+ * @param patternRow The row of the pattern for the row of the span.
+ */
+void spanShadeFlat(SpanShade* shade, uint8_t patternRow);
+
+/**
+ * @brief Shades a span with a dither level interpolated between its ends.
+ *
+ * The levels are clamped to the valid range, so extrapolating a triangle's
+ * plane up to the pixel centers of its span is safe.
+ *
+ * @param shade The shade to set up.
+ * @param y Row of the span.
+ * @param xStart First pixel of the span.
+ * @param xEnd Last pixel of the span.
+ * @param levelStart Dither level at the center of the first pixel.
+ * @param levelEnd Dither level at the center of the last pixel.
+ */
+void spanShadeSmooth(SpanShade* shade, int y, int xStart, int xEnd, float levelStart, float levelEnd);
+
+/**
+ * @brief Maps a texture on a span.
+ *
+ * @param shade The shade to set up.
+ * @param texture The texture to sample.
+ * @param y Row of the span.
+ * @param xStart First pixel of the span.
+ * @param xEnd Last pixel of the span.
+ * @param uvw u/z, v/z in texels and 1/z at the left edge of the row, x = 0.
+ * @param uvwDx Change of each of uvw per pixel.
+ */
+void spanShadeTextured(SpanShade* shade, const Texture* texture, int y, int xStart, int xEnd,
+    const float uvw[3], const float uvwDx[3]);
+
+/**
+ * @brief Gets the pixels of a framebuffer byte covered by a textured span.
+ *
+ * Texture coordinates are divided by 1/z only at the first and last pixel of
+ * the span in the byte and stepped linearly in between, so perspective costs
+ * two divisions per 8 pixels. 4-bit texels are dithered at their screen position.
+ *
+ * @param shade The shade of the span, set up by spanShadeTextured.
+ * @param byteIndex Index of the byte in the row, overlapping the span.
+ * @return uint8_t The packed pixels, to be masked by the span coverage.
+ */
+uint8_t spanShadeTextureByte(const SpanShade* shade, int byteIndex);
+
+/**
+ * @brief Gets the pixels of a framebuffer byte lit by the shade of a span.
+ *
+ * @param shade The shade of the span.
+ * @param byteIndex Index of the byte in the row.
+ * @return uint8_t The packed pixels, to be masked by the span coverage.
+ */
+static inline uint8_t spanShadeByte(const SpanShade* shade, int byteIndex)
+{
+    if (shade->texture)
+    {
+        return spanShadeTextureByte(shade, byteIndex);
+    }
+    if (!shade->smooth)
+    {
+        return shade->patternRow;
+    }
+
+    int32_t level = (shade->level + shade->levelStep * ((byteIndex << 3) + 4 - shade->xStart)) >> 16;
+    level = level < 0 ? 0 : level > DITHER_LEVELS - 1 ? DITHER_LEVELS - 1 : level;
+    return ditherRowMasks[level][shade->ditherRow];
+}
+
 /**
  * @brief Draws a rectangle.
  *
@@ -0,0 +1,144 @@
+#ifndef LIGHTING_H
+#define LIGHTING_H
+
+#include <stdint.h>
+#include "vector.h"
+#include "matrix.h"
+#include "triangle.h"
+
+/* Number of intensity levels, one per entry of ditheringPatterns from black to white */
+#define LIGHT_LEVELS 17
+
+/* Width and height of a matcap table */
+#define MATCAP_SIZE 32
+
+/**
+ * @brief How the pattern of each face is chosen.
+ */
+typedef enum
+{
+    kShadingNone,   /* Faces keep the pattern they were authored with */
+    kShadingFlat,   /* One light intensity per face */
+    kShadingGouraud /* One light intensity per vertex, interpolated and dithered per pixel */
+} ShadingMode;
+
+/**
+ * @brief Directional light plus an ambient term.
+ */
+typedef struct
+{
+    Vector3D direction;     /* Unit direction the light travels in, in view space */
+    float ambient;          /* Intensity of faces turned away from the light */
+    float diffuse;          /* Intensity added to faces facing the light */
+} DirectionalLight;
+
+/**
+ * @brief Material capture, the shade of a lit sphere looked up by view-space normal.
+ *
+ * Cell (u, v) holds the pattern index of the sphere point whose normal has
+ * x and y mapped from -1..1 to 0..MATCAP_SIZE - 1, so shading a face only
+ * takes rotating its normal into view space and a table read.
+ */
+typedef struct
+{
+    uint8_t patterns[MATCAP_SIZE][MATCAP_SIZE];  /* Index into ditheringPatterns, by row v and column u */
+} Matcap;
+
+extern ShadingMode shadingMode;
+extern DirectionalLight sceneLight;
+
+/**
+ * @brief Sets the direction of the scene light.
+ *
+ * @param direction Direction the light travels in, in view space, need not be normalized.
+ */
+void setLightDirection(Vector3D direction);
+
+/**
+ * @brief Brings the light into the local space of a mesh instance.
+ *
+ * Done once per instance so that shading a face only takes a dot product
+ * with its precomputed normal.
+ *
+ * @param modelToView Rigid model-to-view transformation of the instance.
+ * @return Vector3D Unit vector pointing towards the light, in mesh space.
+ */
+Vector3D lightToMeshSpace(const Matrix3x4* modelToView);
+
+/**
+ * @brief Computes the light intensity of a face or of a vertex.
+ *
+ * @param normal Unit normal of the face or vertex in mesh space.
+ * @param towardLight Result of lightToMeshSpace for the instance.
+ * @return float The intensity, between 0 and 1 when ambient + diffuse <= 1.
+ */
+static inline float lightIntensity(Vector3D normal, Vector3D towardLight)
+{
+    float lambert = vector3DDot(normal, towardLight);
+    return sceneLight.ambient + (lambert > 0.0f ? sceneLight.diffuse * lambert : 0.0f);
+}
+
+/**
+ * @brief Quantizes a light intensity to an index into ditheringPatterns.
+ *
+ * @param intensity The intensity, clamped to 0..1.
+ * @return uint8_t The index of the pattern, 0 for black up to LIGHT_LEVELS - 1 for white.
+ */
+static inline uint8_t lightPatternIndex(float intensity)
+{
+    int level = (int)(intensity * (LIGHT_LEVELS - 1) + 0.5f);
+    return (uint8_t)(level < 0 ? 0 : level > LIGHT_LEVELS - 1 ? LIGHT_LEVELS - 1 : level);
+}
+
+/**
+ * @brief Bakes a matcap from a directional light with a specular highlight.
+ *
+ * The matcap is in view space, it has to be built again if the light moves.
+ *
+ * @param matcap The matcap to fill.
+ * @param light The light, its direction in view space.
+ * @param specular Intensity of the highlight.
+ * @param shininess Exponent of the highlight, larger values give a smaller spot.
+ */
+void buildMatcap(Matcap* matcap, const DirectionalLight* light, float specular, float shininess);
+
+/**
+ * @brief Looks up the pattern of a normal in a matcap.
+ *
+ * @param matcap The matcap.
+ * @param viewNormal Unit normal in view space.
+ * @return uint8_t The index of the pattern in ditheringPatterns.
+ */
+static inline uint8_t matcapPatternIndex(const Matcap* matcap, Vector3D viewNormal)
+{
+    int u = (int)((viewNormal.x * 0.5f + 0.5f) * (MATCAP_SIZE - 1) + 0.5f);
+    int v = (int)((viewNormal.y * 0.5f + 0.5f) * (MATCAP_SIZE - 1) + 0.5f);
+    u = u < 0 ? 0 : u > MATCAP_SIZE - 1 ? MATCAP_SIZE - 1 : u;
+    v = v < 0 ? 0 : v > MATCAP_SIZE - 1 ? MATCAP_SIZE - 1 : v;
+    return matcap->patterns[v][u];
+}
+
+/**
+ * @brief Quantizes a light intensity to an ordered dither level.
+ *
+ * @param intensity The intensity, clamped to 0..1.
+ * @return uint8_t The dither level, 0 for black up to DITHER_LEVELS - 1 for white.
+ */
+static inline uint8_t lightDitherLevel(float intensity)
+{
+    int level = (int)(intensity * (DITHER_LEVELS - 1) + 0.5f);
+    return (uint8_t)(level < 0 ? 0 : level > DITHER_LEVELS - 1 ? DITHER_LEVELS - 1 : level);
+}
+
+/**
+ * @brief Converts the index of a pattern to the dither level of the same intensity.
+ *
+ * @param patternIndex Index into ditheringPatterns.
+ * @return uint8_t The dither level.
+ */
+static inline uint8_t patternDitherLevel(uint8_t patternIndex)
+{
+    return (uint8_t)(patternIndex * (DITHER_LEVELS - 1) / (LIGHT_LEVELS - 1));
+}
+
+#endif /* LIGHTING_H */
@@ -0,0 +1,37 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stdint.h>
+
+/* Shortest match worth encoding, shorter runs are stored as literals */
+#define LZ_MIN_MATCH 4
+
+/* Farthest back a match can reach */
+#define LZ_MAX_OFFSET 65535
+
+/**
+ * @brief Compresses a block of bytes.
+ *
+ * The output is a sequence of literal runs and back references within the
+ * block, each introduced by a token byte holding both lengths.
+ *
+ * @param src The bytes to compress.
+ * @param srcSize The number of bytes to compress.
+ * @param dst Receives the compressed bytes.
+ * @param dstCapacity The size of dst.
+ * @return int The compressed size, or 0 if it would not fit in dst.
+ */
+int lzCompress(const uint8_t* src, int srcSize, uint8_t* dst, int dstCapacity);
+
+/**
+ * @brief Decompresses a block produced by lzCompress.
+ *
+ * @param src The compressed bytes.
+ * @param srcSize The number of compressed bytes.
+ * @param dst Receives the decompressed bytes.
+ * @param dstSize The exact decompressed size of the block.
+ * @return int 0 on success, non-zero if the block is malformed.
+ */
+int lzDecompress(const uint8_t* src, int srcSize, uint8_t* dst, int dstSize);
+
+#endif /* LZ_H */
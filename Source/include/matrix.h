@@ -0,0 +1,169 @@
+#ifndef MATRIX_H
+#define MATRIX_H
+
+#include <math.h>
+#include "vector.h"
+
+/* Type Definitions */
+
+/**
+ * @brief Affine transformation, a 3x3 linear part in the first three columns and a translation in the fourth.
+ */
+typedef struct
+{
+    float m[3][4];
+} Matrix3x4;
+
+/* Matrix construction */
+
+/**
+ * @brief Creates an identity matrix.
+ * @return The identity Matrix3x4.
+ */
+static inline Matrix3x4 matrixIdentity(void)
+{
+    return (Matrix3x4)
+    {
+        {
+            { 1.0f, 0.0f, 0.0f, 0.0f },
+            { 0.0f, 1.0f, 0.0f, 0.0f },
+            { 0.0f, 0.0f, 1.0f, 0.0f }
+        }
+    };
+}
+
+/**
+ * @brief Creates a rotation around the X-axis, matching vector3DRotateX.
+ * @param angle The angle of rotation in radians.
+ * @return The rotation Matrix3x4.
+ */
+static inline Matrix3x4 matrixRotationX(float angle)
+{
+    float cosA = cosf(angle);
+    float sinA = sinf(angle);
+    return (Matrix3x4)
+    {
+        {
+            { 1.0f, 0.0f, 0.0f, 0.0f },
+            { 0.0f, cosA, -sinA, 0.0f },
+            { 0.0f, sinA, cosA, 0.0f }
+        }
+    };
+}
+
+/**
+ * @brief Creates a rotation around the Y-axis, matching vector3DRotateY.
+ * @param angle The angle of rotation in radians.
+ * @return The rotation Matrix3x4.
+ */
+static inline Matrix3x4 matrixRotationY(float angle)
+{
+    float cosA = cosf(angle);
+    float sinA = sinf(angle);
+    return (Matrix3x4)
+    {
+        {
+            { cosA, 0.0f, sinA, 0.0f },
+            { 0.0f, 1.0f, 0.0f, 0.0f },
+            { -sinA, 0.0f, cosA, 0.0f }
+        }
+    };
+}
+
+/**
+ * @brief Creates a rotation around the Z-axis, matching vector3DRotateZ.
+ * @param angle The angle of rotation in radians.
+ * @return The rotation Matrix3x4.
+ */
+static inline Matrix3x4 matrixRotationZ(float angle)
+{
+    float cosA = cosf(angle);
+    float sinA = sinf(angle);
+    return (Matrix3x4)
+    {
+        {
+            { cosA, -sinA, 0.0f, 0.0f },
+            { sinA, cosA, 0.0f, 0.0f },
+            { 0.0f, 0.0f, 1.0f, 0.0f }
+        }
+    };
+}
+
+/**
+ * @brief Creates a per-axis scale followed by a translation.
+ * @param scale The scale along each axis.
+ * @param translation The translation applied after the scale.
+ * @return The Matrix3x4.
+ */
+static inline Matrix3x4 matrixScaleTranslation(Vector3D scale, Vector3D translation)
+{
+    return (Matrix3x4)
+    {
+        {
+            { scale.x, 0.0f, 0.0f, translation.x },
+            { 0.0f, scale.y, 0.0f, translation.y },
+            { 0.0f, 0.0f, scale.z, translation.z }
+        }
+    };
+}
+
+/* Matrix operations */
+
+/**
+ * @brief Multiplies two matrices, the result applies b first and then a.
+ * @param a The outer transformation.
+ * @param b The inner transformation.
+ * @return The resulting Matrix3x4.
+ */
+static inline Matrix3x4 matrixMul(const Matrix3x4* a, const Matrix3x4* b)
+{
+    Matrix3x4 result;
+    for (int row = 0; row < 3; row++)
+    {
+        for (int column = 0; column < 4; column++)
+        {
+            result.m[row][column] =
+                a->m[row][0] * b->m[0][column] +
+                a->m[row][1] * b->m[1][column] +
+                a->m[row][2] * b->m[2][column];
+        }
+        result.m[row][3] += a->m[row][3];
+    }
+    return result;
+}
+
+/**
+ * @brief Transforms a point, applying the linear part and the translation.
+ * @param matrix The transformation.
+ * @param x The x coordinate of the point.
+ * @param y The y coordinate of the point.
+ * @param z The z coordinate of the point.
+ * @return The transformed Vector3D.
+ */
+static inline Vector3D matrixTransformPoint(const Matrix3x4* matrix, float x, float y, float z)
+{
+    return (Vector3D)
+    {
+        matrix->m[0][0] * x + matrix->m[0][1] * y + matrix->m[0][2] * z + matrix->m[0][3],
+        matrix->m[1][0] * x + matrix->m[1][1] * y + matrix->m[1][2] * z + matrix->m[1][3],
+        matrix->m[2][0] * x + matrix->m[2][1] * y + matrix->m[2][2] * z + matrix->m[2][3]
+    };
+}
+
+/**
+ * @brief Transforms a direction, applying only the linear part.
+ * @param matrix The transformation.
+ * @param v The direction.
+ * @return The transformed Vector3D.
+ */
+static inline Vector3D matrixTransformDirection(const Matrix3x4* matrix, Vector3D v)
+{
+    return (Vector3D)
+    {
+        matrix->m[0][0] * v.x + matrix->m[0][1] * v.y + matrix->m[0][2] * v.z,
+        matrix->m[1][0] * v.x + matrix->m[1][1] * v.y + matrix->m[1][2] * v.z,
+        matrix->m[2][0] * v.x + matrix->m[2][1] * v.y + matrix->m[2][2] * v.z
+    };
+}
+
+#endif /* MATRIX_H */
@@ -5,8 +5,173 @@
 #include "logging.h" 
 #include "global.h"
 
+/* Alignment of the blocks handed out by a memory arena */
+#define MEMORY_ARENA_ALIGNMENT 8
+
+/* Set to 1 to account every heap block allocated through the pd* wrappers */
+#ifndef MEMORY_TRACKING
+#define MEMORY_TRACKING 0
+#endif
+
+/* Set to 1 to stop with an error, rather than log, on a heap allocation in a steady state frame */
+#ifndef MEMORY_ASSERT_STEADY_STATE
+#define MEMORY_ASSERT_STEADY_STATE 0
+#endif
+
+/* Number of frames after which update() is expected to stop allocating from the heap */
+#define MEMORY_WARMUP_FRAMES 30
+
+/**
+ * @brief Category a heap allocation is accounted to.
+ */
+typedef enum
+{
+    kMemoryTagGeneral,
+    kMemoryTagMesh,
+    kMemoryTagFrame,
+    kMemoryTagAsset,
+    kMemoryTagCount
+} MemoryTag;
+
+/**
+ * @brief Heap usage of one allocation tag.
+ */
+typedef struct
+{
+    size_t liveBytes;   /* Bytes currently allocated */
+    size_t peakBytes;   /* Highest value reached by liveBytes */
+    int allocCount;     /* Number of blocks allocated or grown */
+    int freeCount;      /* Number of blocks freed or shrunk */
+} MemoryTagStats;
+
+/**
+ * @brief Heap usage of the whole program.
+ */
+typedef struct
+{
+    MemoryTagStats tags[kMemoryTagCount];
+    size_t liveBytes;       /* Bytes currently allocated over all tags */
+    size_t peakBytes;       /* Highest value reached by liveBytes */
+    int frameAllocCount;    /* Allocations made during the current or last frame */
+    size_t frameAllocBytes; /* Bytes allocated during the current or last frame */
+} MemoryStats;
+
+/**
+ * @brief Linear allocator for data that lives for a single frame.
+ *
+ * One block is reserved up front, allocations bump a pointer through it and
+ * everything is released at once by resetting the arena.
+ */
+typedef struct
+{
+    uint8_t* base;      /* Start of the reserved block */
+    size_t capacity;    /* Size of the reserved block in bytes */
+    size_t used;        /* Bytes handed out since the last reset */
+    size_t peak;        /* Highest number of bytes used between two resets */
+} MemoryArena;
+
+/* Arena for the transient render data, reset at the start of every frame */
+extern MemoryArena frameArena;
+
+/**
+ * @brief Fixed-capacity allocator for objects of a single type.
+ *
+ * The slots live in one preallocated slab, free slots are chained through
+ * their own storage so allocation and release are O(1) and never touch the
+ * heap. Each slot has a generation, odd while the slot is in use, so stale
+ * handles to a released object can be detected.
+ */
+typedef struct
+{
+    uint8_t* slab;          /* Storage of the slots */
+    uint16_t* generations;  /* Generation of each slot, odd when allocated */
+    size_t slotSize;        /* Size of a slot, the element size rounded up to the alignment */
+    int capacity;           /* Number of slots */
+    int count;              /* Number of allocated slots */
+    int freeHead;           /* Index of the first free slot, -1 if the pool is full */
+} MemoryPool;
+
+/* Handle to an object of a pool, slot index in the low 16 bits and generation in the high 16 */
+typedef uint32_t PoolHandle;
+
+/* Handle that never refers to an object */
+#define POOL_INVALID_HANDLE 0u
+
+/* Largest capacity of a pool, slot indices must fit the 16 bits of a handle */
+#define POOL_MAX_CAPACITY 0xFFFF
+
+/* Allocates an object of the given type from a pool */
+#define poolAllocType(pool, type) ((type*)poolAlloc(pool))
+
 /* Function Declarations */
 
+/**
+ * @brief Marks the start of update(), allocations until memoryEndFrame are counted for the frame.
+ */
+void memoryBeginFrame(void);
+
+/**
+ * @brief Marks the end of update().
+ */
+void memoryEndFrame(void);
+
+/**
+ * @brief Copies the current heap usage.
+ * @param out Receives the statistics, zeroed when tracking is disabled.
+ * @return 0 on success, non-zero if tracking is disabled.
+ */
+int memoryGetStats(MemoryStats* out);
+
+/**
+ * @brief Logs the live and peak heap usage of every tag to the console.
+ */
+void memoryLogStats(void);
+
+#if MEMORY_TRACKING
+
+/**
+ * @brief Header stored in front of every tracked block.
+ */
+typedef struct
+{
+    size_t size;    /* Size requested by the caller */
+    size_t tag;     /* MemoryTag the block is accounted to */
+} MemoryBlockHeader;
+
+/**
+ * @brief Accounts the allocations made until the matching memoryPopTag to a tag.
+ * @param tag The tag to apply.
+ */
+void memoryPushTag(MemoryTag tag);
+
+/**
+ * @brief Restores the tag that was active before the last memoryPushTag.
+ */
+void memoryPopTag(void);
+
+/**
+ * @brief Gets the tag applied to new allocations.
+ * @return The tag on top of the tag stack, kMemoryTagGeneral if it is empty.
+ */
+MemoryTag memoryCurrentTag(void);
+
+/**
+ * @brief Adds a block to the heap accounting.
+ */
+void memoryTrackAlloc(size_t size, MemoryTag tag);
+
+/**
+ * @brief Removes a block from the heap accounting.
+ */
+void memoryTrackFree(size_t size, MemoryTag tag);
+
+#else
+
+static inline void memoryPushTag(MemoryTag tag) { (void)tag; }
+static inline void memoryPopTag(void) {}
+
+#endif /* MEMORY_TRACKING */
+
 /**
  * @brief Changes the size of the memory block pointed to by ptr.
  * @param ptr Pointer to the memory block to resize.
@@ -15,12 +180,42 @@
  */
 static inline void* pdRealloc(void* ptr, size_t size)
 {
+#if MEMORY_TRACKING
+    // Blocks carry their size and tag in a header so frees can be accounted
+    MemoryBlockHeader* header = ptr ? (MemoryBlockHeader*)ptr - 1 : NULL;
+    MemoryTag tag = header ? (MemoryTag)header->tag : memoryCurrentTag();
+    if (size == 0)
+    {
+        if (header)
+        {
+            memoryTrackFree(header->size, tag);
+            pd->system->realloc(header, 0);
+        }
+        return NULL;
+    }
+
+    MemoryBlockHeader* newHeader = (MemoryBlockHeader*)pd->system->realloc(header, sizeof(MemoryBlockHeader) + size);
+    if (newHeader == NULL)
+    {
+        LOG_ERROR("pdRealloc: Memory reallocation failed for size %zu", size);
+        return NULL;
+    }
+    if (header)
+    {
+        memoryTrackFree(newHeader->size, tag);
+    }
+    newHeader->size = size;
+    newHeader->tag = tag;
+    memoryTrackAlloc(size, tag);
+    return newHeader + 1;
+#else
     void* new_ptr = pd->system->realloc(ptr, size);
     if (new_ptr == NULL && size != 0)
     {
         LOG_ERROR("pdRealloc: Memory reallocation failed for size %zu", size);
     }
     return new_ptr;
+#endif
 }
 
 /**
@@ -64,7 +259,275 @@ static inline void* pdCalloc(size_t count, size_t size)
  */
 static inline void pdFree(void* ptr)
 {
+#if MEMORY_TRACKING
+    pdRealloc(ptr, 0);
+#else
     pd->system->realloc(ptr, 0);
+#endif
+}
+
+/* Route stb_ds arrays through the wrappers above, in every file that includes stb_ds.h after this header */
+#define STBDS_REALLOC(c,p,s) pdRealloc(p,s)
+#define STBDS_FREE(c,p)      pdFree(p)
+
+/**
+ * @brief Reserves the block of a memory arena.
+ * @param arena The arena to initialize.
+ * @param capacity The size of the block in bytes.
+ * @return 0 on success, non-zero if the block could not be allocated.
+ */
+static inline int arenaInit(MemoryArena* arena, size_t capacity)
+{
+    arena->base = (uint8_t*)pdMalloc(capacity);
+    arena->capacity = arena->base ? capacity : 0;
+    arena->used = 0;
+    arena->peak = 0;
+    return arena->base == NULL;
+}
+
+/**
+ * @brief Grows the block of an empty arena.
+ *
+ * Meant to be called while loading, so that frames only ever allocate from
+ * the arena. The current block is kept if the larger one cannot be allocated.
+ *
+ * @param arena The arena to grow, with nothing allocated from it.
+ * @param capacity The size the block needs, smaller sizes leave it unchanged.
+ * @return 0 on success, non-zero if the block could not be grown.
+ */
+static inline int arenaReserve(MemoryArena* arena, size_t capacity)
+{
+    if (capacity <= arena->capacity)
+    {
+        return 0;
+    }
+    if (arena->used != 0)
+    {
+        LOG_ERROR("arenaReserve: Arena in use, %zu bytes allocated", arena->used);
+        return 1;
+    }
+
+    uint8_t* base = (uint8_t*)pdRealloc(arena->base, capacity);
+    if (base == NULL)
+    {
+        return 1;
+    }
+    arena->base = base;
+    arena->capacity = capacity;
+    return 0;
+}
+
+/**
+ * @brief Allocates memory from an arena.
+ * @param arena The arena to allocate from.
+ * @param size The number of bytes to allocate.
+ * @return A pointer to the allocated memory, or NULL if the arena is exhausted.
+ */
+static inline void* arenaAlloc(MemoryArena* arena, size_t size)
+{
+    size_t offset = (arena->used + MEMORY_ARENA_ALIGNMENT - 1) & ~(size_t)(MEMORY_ARENA_ALIGNMENT - 1);
+    if (offset + size > arena->capacity)
+    {
+        LOG_ERROR("arenaAlloc: Arena exhausted, %zu of %zu bytes used, %zu requested", arena->used, arena->capacity, size);
+        return NULL;
+    }
+
+    arena->used = offset + size;
+    if (arena->used > arena->peak)
+    {
+        arena->peak = arena->used;
+    }
+    return arena->base + offset;
+}
+
+/**
+ * @brief Releases every allocation made from an arena.
+ * @param arena The arena to reset.
+ */
+static inline void arenaReset(MemoryArena* arena)
+{
+    arena->used = 0;
+}
+
+/**
+ * @brief Frees the block of a memory arena.
+ * @param arena The arena to free.
+ */
+static inline void arenaFree(MemoryArena* arena)
+{
+    pdFree(arena->base);
+    arena->base = NULL;
+    arena->capacity = 0;
+    arena->used = 0;
+}
+
+/**
+ * @brief Reserves the slab of a pool and chains all its slots into the free list.
+ * @param pool The pool to initialize.
+ * @param elementSize The size of the objects stored in the pool.
+ * @param capacity The number of objects the pool can hold, from 1 to POOL_MAX_CAPACITY.
+ * @return 0 on success, non-zero if the capacity is out of range or the slab could not be allocated.
+ */
+static inline int poolInit(MemoryPool* pool, size_t elementSize, int capacity)
+{
+    if (capacity <= 0 || capacity > POOL_MAX_CAPACITY)
+    {
+        LOG_ERROR("poolInit: Capacity %d out of range, handles hold at most %d slots", capacity, POOL_MAX_CAPACITY);
+        pool->slab = NULL;
+        pool->generations = NULL;
+        pool->capacity = 0;
+        pool->count = 0;
+        pool->freeHead = -1;
+        return 1;
+    }
+    if (elementSize < sizeof(int))
+    {
+        elementSize = sizeof(int);
+    }
+    pool->slotSize = (elementSize + MEMORY_ARENA_ALIGNMENT - 1) & ~(size_t)(MEMORY_ARENA_ALIGNMENT - 1);
+    pool->capacity = capacity;
+    pool->count = 0;
+
+    // Slots and generations share one block, the slots first to keep them aligned
+    pool->slab = (uint8_t*)pdMalloc(pool->slotSize * capacity + sizeof(uint16_t) * capacity);
+    if (pool->slab == NULL)
+    {
+        pool->capacity = 0;
+        pool->freeHead = -1;
+        return 1;
+    }
+    pool->generations = (uint16_t*)(pool->slab + pool->slotSize * capacity);
+
+    for (int i = 0; i < capacity; i++)
+    {
+        *(int*)(pool->slab + pool->slotSize * i) = i + 1 < capacity ? i + 1 : -1;
+        pool->generations[i] = 0;
+    }
+    pool->freeHead = 0;
+    return 0;
+}
+
+/**
+ * @brief Allocates a zeroed object from a pool.
+ * @param pool The pool to allocate from.
+ * @return A pointer to the object, or NULL if the pool is full.
+ */
+static inline void* poolAlloc(MemoryPool* pool)
+{
+    if (pool->freeHead < 0)
+    {
+        LOG_ERROR("poolAlloc: Pool full, %d objects allocated", pool->count);
+        return NULL;
+    }
+
+    int index = pool->freeHead;
+    uint8_t* slot = pool->slab + pool->slotSize * index;
+    pool->freeHead = *(int*)slot;
+    pool->generations[index]++;
+    pool->count++;
+
+    memset(slot, 0, pool->slotSize);
+    return slot;
+}
+
+/**
+ * @brief Gets the slot index of an object of a pool.
+ * @param pool The pool the object was allocated from.
+ * @param object The object.
+ * @return The slot index, or -1 if the object does not belong to the pool.
+ */
+static inline int poolIndexOf(const MemoryPool* pool, const void* object)
+{
+    const uint8_t* slot = (const uint8_t*)object;
+    if (slot < pool->slab || slot >= pool->slab + pool->slotSize * pool->capacity)
+    {
+        return -1;
+    }
+    return (int)((size_t)(slot - pool->slab) / pool->slotSize);
+}
+
+/**
+ * @brief Returns an object to its pool.
+ * @param pool The pool the object was allocated from.
+ * @param object The object to release, may be NULL.
+ */
+static inline void poolFree(MemoryPool* pool, void* object)
+{
+    int index = poolIndexOf(pool, object);
+    if (index < 0 || (pool->generations[index] & 1) == 0)
+    {
+        if (object)
+        {
+            LOG_ERROR("poolFree: Object is not allocated from this pool");
+        }
+        return;
+    }
+
+    pool->generations[index]++;
+    pool->count--;
+    *(int*)object = pool->freeHead;
+    pool->freeHead = index;
+}
+
+/**
+ * @brief Gets the object stored in a slot.
+ * @param pool The pool to look in.
+ * @param index The slot index.
+ * @return The object, or NULL if the slot is free.
+ */
+static inline void* poolAt(const MemoryPool* pool, int index)
+{
+    if (index < 0 || index >= pool->capacity || (pool->generations[index] & 1) == 0)
+    {
+        return NULL;
+    }
+    return pool->slab + pool->slotSize * index;
+}
+
+/**
+ * @brief Creates a handle to an object of a pool.
+ * @param pool The pool the object was allocated from.
+ * @param object The object.
+ * @return The handle, or POOL_INVALID_HANDLE if the object is not allocated from the pool.
+ */
+static inline PoolHandle poolHandleOf(const MemoryPool* pool, const void* object)
+{
+    int index = poolIndexOf(pool, object);
+    if (index < 0 || (pool->generations[index] & 1) == 0)
+    {
+        return POOL_INVALID_HANDLE;
+    }
+    return ((PoolHandle)pool->generations[index] << 16) | (PoolHandle)index;
+}
+
+/**
+ * @brief Resolves a handle to its object.
+ * @param pool The pool the handle was created from.
+ * @param handle The handle.
+ * @return The object, or NULL if it has been released since the handle was created.
+ */
+static inline void* poolGet(const MemoryPool* pool, PoolHandle handle)
+{
+    int index = (int)(handle & 0xFFFF);
+    if (index >= pool->capacity || pool->generations[index] != (uint16_t)(handle >> 16))
+    {
+        return NULL;
+    }
+    return poolAt(pool, index);
+}
+
+/**
+ * @brief Frees the slab of a pool, every object of the pool is released.
+ * @param pool The pool to free.
+ */
+static inline void poolDestroy(MemoryPool* pool)
+{
+    pdFree(pool->slab);
+    pool->slab = NULL;
+    pool->generations = NULL;
+    pool->capacity = 0;
+    pool->count = 0;
+    pool->freeHead = -1;
 }
 
 #endif /* MEMORY_H */
\ No newline at end of file
@@ -3,16 +3,152 @@
 
 #include "vector.h"
 #include "triangle.h"
+#include "bsp.h"
+#include "lighting.h"
+#include "memory.h"
+#include "stb_ds.h"
+
+/* Maximum number of meshes loaded at the same time */
+#define MAX_MESHES 32
+
+/* Largest vertex count a quantized mesh can index with 16 bits */
+#define MESH_QUANTIZED_MAX_VERTICES 65535
+
+/**
+ * @brief Optional processing applied by loadOBJ.
+ */
+typedef enum
+{
+    kMeshLoadDefault = 0,
+    kMeshLoadWeld = 1 << 0,
+    kMeshLoadOptimize = 1 << 1,
+    kMeshLoadBake = 1 << 2
+} MeshLoadFlags;
+
+/**
+ * @brief Stage of an incremental mesh load, ordered so that any stage below kMeshLoaderDone is still running.
+ */
+typedef enum
+{
+    kMeshLoaderParsing,
+    kMeshLoaderProcessing,
+    kMeshLoaderDone,
+    kMeshLoaderFailed
+} MeshLoaderState;
+
+/**
+ * @brief Incremental OBJ loader, advanced a bounded amount of work at a time by meshLoaderStep.
+ */
+typedef struct MeshLoader MeshLoader;
+
+/**
+ * @brief Vertex position quantized to 16 bits per axis over the mesh bounding box.
+ */
+typedef struct
+{
+    int16_t x, y, z;
+} QuantizedVertex;
+
+/**
+ * @brief Face of a quantized mesh, 16-bit vertex indices and a pattern index.
+ */
+typedef struct
+{
+    uint16_t a, b, c;   /* Vertex indices */
+    uint8_t pattern;    /* Index of the pattern of this face in ditheringPatterns */
+} QuantizedFace;
 
 /**
  * @brief Represents a 3D mesh.
  */
-typedef struct {
+typedef struct Mesh {
     Vector3D* vertices;  /* Dynamic array of vertices */
     Face* faces;         /* Dynamic array of faces */
-    Vector3D rotation;   /* Rotation of the mesh */
+    Vector2D* uvs;       /* Dynamic array of texture coordinates, NULL if the mesh has none */
+    Vector3D* normals;   /* Dynamic array of vertex normals, NULL if the mesh has none */
+    BSPNode* bspNodes;   /* Dynamic array of BSP nodes over the faces, NULL if not built */
+    Vector3D boundsCenter; /* Center of the bounding sphere in local space */
+    float boundsRadius;  /* Radius of the bounding sphere */
+    int isConvex;        /* Non-zero if no face can occlude another face of the mesh */
+    void* block;         /* Single block holding the arrays of a binary mesh, NULL if they are growable */
+    QuantizedVertex* quantizedVertices; /* Replace vertices once the mesh is quantized, NULL otherwise */
+    QuantizedFace* quantizedFaces;      /* Replace faces once the mesh is quantized, NULL otherwise */
+    Vector3D quantizationScale;  /* Position of a quantized vertex is quantized * scale + offset */
+    Vector3D quantizationOffset;
+    Vector3D* faceNormals;       /* Unit normal of each face in mesh space, computed at load or read from a binary mesh */
+    Vector3D* vertexNormals;     /* Area-weighted unit normal of each vertex, computed with faceNormals */
+    const Matcap* matcap;        /* Shades the mesh by view-space normal instead of the scene light, NULL if unused */
+    uint8_t* bakedLevels;        /* Baked dither level of each vertex, NULL unless the lighting is baked */
+    const Texture* texture;      /* Mapped with the texture coordinates of the faces instead of shading, NULL if unused */
 } Mesh;
 
+/**
+ * @brief Represents an instance of a mesh placed in the scene.
+ */
+typedef struct {
+    const Mesh* mesh;    /* Mesh drawn by this instance, may be shared with other instances */
+    Vector3D rotation;   /* Rotation of the instance */
+    Vector3D position;   /* Position of the instance relative to the camera */
+} MeshInstance;
+
+/**
+ * @brief Gets the number of vertices of a mesh, quantized or not.
+ */
+static inline int meshVertexCount(const Mesh* mesh)
+{
+    return mesh->quantizedVertices ? (int)stbds_header(mesh->quantizedVertices)->length :
+        mesh->vertices ? (int)stbds_header(mesh->vertices)->length : 0;
+}
+
+/**
+ * @brief Gets the number of faces of a mesh, quantized or not.
+ */
+static inline int meshFaceCount(const Mesh* mesh)
+{
+    return mesh->quantizedFaces ? (int)stbds_header(mesh->quantizedFaces)->length :
+        mesh->faces ? (int)stbds_header(mesh->faces)->length : 0;
+}
+
+/**
+ * @brief Gets a face of a mesh, quantized or not.
+ *
+ * Quantized faces carry no texture coordinate or normal indices.
+ */
+static inline Face meshGetFace(const Mesh* mesh, int index)
+{
+    if (mesh->quantizedFaces)
+    {
+        QuantizedFace quantized = mesh->quantizedFaces[index];
+        Face face = { quantized.a, quantized.b, quantized.c, -1, -1, -1, -1, -1, -1, quantized.pattern };
+        return face;
+    }
+    return mesh->faces[index];
+}
+
+/**
+ * @brief Gets the position of a vertex of a mesh, dequantized if needed.
+ */
+static inline Vector3D meshGetVertex(const Mesh* mesh, int index)
+{
+    if (mesh->quantizedVertices)
+    {
+        QuantizedVertex v = mesh->quantizedVertices[index];
+        return (Vector3D){
+            v.x * mesh->quantizationScale.x + mesh->quantizationOffset.x,
+            v.y * mesh->quantizationScale.y + mesh->quantizationOffset.y,
+            v.z * mesh->quantizationScale.z + mesh->quantizationOffset.z
+        };
+    }
+    return mesh->vertices[index];
+}
+
+/**
+ * @brief Allocates an empty mesh from the mesh pool.
+ *
+ * @return Mesh* The zeroed mesh, to be released with freeMesh, or NULL if the pool is full.
+ */
+Mesh* allocMesh(void);
+
 /**
  * @brief Loads mesh data for a cube.
  * 
@@ -23,13 +159,142 @@ Mesh* loadCubeMeshData(void);
 /**
  * @brief Loads mesh data from an OBJ file.
  *
+ * Faces may use any of the v, v/vt, v//vn and v/vt/vn index forms, with
+ * negative indices counted back from the last attribute read. Polygons are
+ * fan-triangulated. Each o, g or usemtl name gives its faces a pattern.
+ *
+ * With kMeshLoadWeld, vertices sharing a position are merged. With
+ * kMeshLoadOptimize, faces are reordered for the vertex cache and vertices are
+ * renumbered in first-use order, the ACMR before and after is logged. With
+ * kMeshLoadBake, the default lighting of bakeMeshLighting is baked into the mesh.
+ *
  * @param filename The name of the OBJ file to load.
+ * @param flags A combination of MeshLoadFlags.
+ * @return Mesh* Pointer to the loaded mesh, or NULL if loading failed.
+ */
+Mesh* loadOBJ(const char* filename, int flags);
+
+/**
+ * @brief Starts loading an OBJ file incrementally.
+ *
+ * Files are parsed as by loadOBJ, over as many calls to meshLoaderStep as the
+ * time budget requires, so a large file can be loaded while frames keep being drawn.
+ * Baking cannot be split over steps, kMeshLoadBake is rejected: bake with
+ * loadOBJ or meshconv on the host instead.
+ *
+ * @param filename The name of the OBJ file to load, which must stay valid until meshLoaderFinish.
+ * @param flags A combination of MeshLoadFlags, without kMeshLoadBake.
+ * @return MeshLoader* The loader, or NULL if the file could not be opened or the flags are not supported.
+ */
+MeshLoader* meshLoaderOpen(const char* filename, int flags);
+
+/**
+ * @brief Advances an incremental load.
+ *
+ * Parsing stops once the budget is spent, measured with pd->system->getElapsedTime.
+ * After the last line, welding, face reordering, vertex renumbering, bounds
+ * and normals each run as a pass over the whole mesh. A step runs at least
+ * one pass and starts the next ones only while the budget is not spent.
+ *
+ * @param loader The loader.
+ * @param budget The time to spend in seconds, 0 to run the current stage to completion.
+ * @return MeshLoaderState The stage of the load after the step.
+ */
+MeshLoaderState meshLoaderStep(MeshLoader* loader, float budget);
+
+/**
+ * @brief Gets the fraction of the file parsed so far.
+ *
+ * @param loader The loader.
+ * @return float The progress between 0 and 1, 1 once the load is done.
+ */
+float meshLoaderProgress(const MeshLoader* loader);
+
+/**
+ * @brief Gets the stage of an incremental load.
+ *
+ * @param loader The loader.
+ * @return MeshLoaderState The current stage.
+ */
+MeshLoaderState meshLoaderState(const MeshLoader* loader);
+
+/**
+ * @brief Ends an incremental load and frees the loader.
+ *
+ * Finishing a load that is not done cancels it.
+ *
+ * @param loader The loader to free.
+ * @return Mesh* The loaded mesh, or NULL if the load failed or was cancelled.
+ */
+Mesh* meshLoaderFinish(MeshLoader* loader);
+
+/**
+ * @brief Loads a mesh saved by saveMeshBinary.
+ *
+ * The file is read with a single allocation and a single read, the arrays are
+ * used in place. Such a mesh is read-only: its arrays cannot grow, so its BSP
+ * tree has to be built before it is saved. Face and vertex normals are read
+ * from the file rather than computed.
+ *
+ * @param filename The name of the binary mesh file to load.
  * @return Mesh* Pointer to the loaded mesh, or NULL if loading failed.
  */
-Mesh* loadOBJ(const char* filename);
+Mesh* loadMeshBinary(const char* filename);
+
+/**
+ * @brief Saves a mesh in the binary format read by loadMeshBinary.
+ *
+ * The arrays are written in their in-memory layout, so the file must be
+ * produced on a little-endian platform with the same type sizes as the device.
+ *
+ * @param mesh The mesh to save.
+ * @param filename The name of the file to write.
+ * @return int 0 on success, non-zero on failure.
+ */
+int saveMeshBinary(const Mesh* mesh, const char* filename);
+
+/**
+ * @brief Replaces the float vertices and faces of a mesh by their quantized form.
+ *
+ * Positions are stored as int16 over the axis-aligned bounding box, indices as
+ * uint16. Texture coordinate and normal indices are dropped. The BSP tree, if
+ * any, must be built before, as it needs the float positions.
+ *
+ * @param mesh The mesh to quantize, with at most MESH_QUANTIZED_MAX_VERTICES vertices.
+ * @return int 0 on success, non-zero if the mesh cannot be quantized.
+ */
+int quantizeMesh(Mesh* mesh);
+
+/**
+ * @brief Computes the bounding sphere and convexity of a mesh.
+ *
+ * Called by the loaders, must be called again if the vertices are modified.
+ *
+ * @param mesh Pointer to the mesh to update.
+ */
+void computeMeshBounds(Mesh* mesh);
+
+/**
+ * @brief Computes the unit normal of each face and of each vertex of a mesh.
+ *
+ * Vertex normals average the normals of the faces around the vertex, weighted
+ * by their area. Called by the loaders and by buildMeshBSP, must be called again
+ * if the faces or vertices are modified. Degenerate faces get a zero normal.
+ *
+ * @param mesh Pointer to the mesh to update.
+ */
+void computeMeshNormals(Mesh* mesh);
+
+/**
+ * @brief Computes the number of bytes used by the arrays of a mesh.
+ *
+ * @param mesh Pointer to the mesh.
+ * @return size_t The size of the vertex, face, attribute and BSP arrays.
+ */
+size_t meshMemorySize(const Mesh* mesh);
 
 /**
- * @brief Frees the memory allocated for a mesh.
+ * @brief Frees the memory allocated for a mesh and returns it to the mesh pool.
  *
  * @param mesh Pointer to the mesh to be freed.
  */
@@ -0,0 +1,51 @@
+#ifndef MESHCACHE_H
+#define MESHCACHE_H
+
+#include <stddef.h>
+#include "mesh.h"
+
+/**
+ * @brief Gets a mesh from the cache, loading it on first use.
+ *
+ * Files ending in .pdm are read with loadMeshBinary, .pdz with loadMeshCompressed
+ * and any other with loadOBJ.
+ * The mesh is shared by every caller with the same path and must not be
+ * modified. Each acquire must be matched by a meshCacheRelease.
+ *
+ * @param path The path of the mesh file.
+ * @param flags MeshLoadFlags passed to loadOBJ on first use.
+ * @return const Mesh* The shared mesh, or NULL if loading failed.
+ */
+const Mesh* meshCacheAcquire(const char* path, int flags);
+
+/**
+ * @brief Releases a mesh acquired from the cache.
+ *
+ * Without a budget the mesh is freed as soon as it is no longer referenced.
+ * With a budget it stays cached until it is evicted.
+ *
+ * @param mesh The mesh returned by meshCacheAcquire.
+ */
+void meshCacheRelease(const Mesh* mesh);
+
+/**
+ * @brief Sets how many bytes of unreferenced meshes the cache may keep.
+ *
+ * Beyond the budget, unreferenced meshes are evicted least recently used first.
+ * Referenced meshes are never evicted and count against the budget.
+ *
+ * @param bytes The budget in bytes, 0 to free meshes once they are released.
+ */
+void meshCacheSetBudget(size_t bytes);
+
+/**
+ * @brief Frees every unreferenced mesh of the cache.
+ */
+void meshCacheClear(void);
+
+/**
+ * @brief Logs the meshes of the cache with their reference counts and sizes.
+ */
+void meshCacheLogStats(void);
+
+#endif /* MESHCACHE_H */
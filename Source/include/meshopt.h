@@ -0,0 +1,46 @@
+#ifndef MESHOPT_H
+#define MESHOPT_H
+
+#include "mesh.h"
+
+/* Number of entries of the FIFO vertex cache modelled by the face reordering and the ACMR */
+#define MESHOPT_CACHE_SIZE 16
+
+/**
+ * @brief Merges vertices with bit-identical positions and remaps the faces.
+ *
+ * @param mesh The mesh to weld, with growable float arrays.
+ * @return int The number of vertices removed.
+ */
+int weldMeshVertices(Mesh* mesh);
+
+/**
+ * @brief Reorders the faces of a mesh for the vertex cache (Tipsify).
+ *
+ * Faces are emitted fanning around recently used vertices, so consecutive
+ * faces share vertices that are still in a cache of MESHOPT_CACHE_SIZE entries.
+ * The faces keep their order if the new one does not lower the ACMR.
+ *
+ * @param mesh The mesh whose faces are reordered.
+ */
+void optimizeMeshFaceOrder(Mesh* mesh);
+
+/**
+ * @brief Renumbers the vertices of a mesh in the order the faces first use them.
+ *
+ * Vertices referenced by no face are moved to the end.
+ *
+ * @param mesh The mesh whose vertices are reordered.
+ */
+void reorderMeshVertices(Mesh* mesh);
+
+/**
+ * @brief Computes the average cache miss ratio of the faces of a mesh.
+ *
+ * @param mesh The mesh.
+ * @param cacheSize The number of entries of the simulated FIFO vertex cache.
+ * @return float The number of vertex cache misses per face, between 0.5 and 3.
+ */
+float computeMeshACMR(const Mesh* mesh, int cacheSize);
+
+#endif /* MESHOPT_H */
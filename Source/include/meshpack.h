@@ -0,0 +1,35 @@
+#ifndef MESHPACK_H
+#define MESHPACK_H
+
+#include "mesh.h"
+
+/* Size of the blocks a compressed mesh is split into, and of each decode buffer */
+#define MESH_PACK_BLOCK_SIZE 4096
+
+/**
+ * @brief Saves a quantized mesh in the compressed mesh format.
+ *
+ * Positions are stored as deltas from the previous vertex and face indices as
+ * deltas from the previous index, both as zigzag varints, so meshes whose
+ * vertices are numbered in first-use order compress best. BSP nodes keep their
+ * planes, with face ranges and children as varints. The stream is then split
+ * into blocks compressed with lzCompress.
+ *
+ * @param mesh The mesh to save, quantized with quantizeMesh.
+ * @param filename The name of the file to write.
+ * @return int 0 on success, non-zero on failure.
+ */
+int saveMeshCompressed(const Mesh* mesh, const char* filename);
+
+/**
+ * @brief Loads a mesh saved by saveMeshCompressed.
+ *
+ * Blocks are read and decoded one at a time through buffers of
+ * MESH_PACK_BLOCK_SIZE bytes, straight into the arrays of the mesh.
+ *
+ * @param filename The name of the compressed mesh file to load.
+ * @return Mesh* Pointer to the loaded quantized mesh, or NULL if loading failed.
+ */
+Mesh* loadMeshCompressed(const char* filename);
+
+#endif /* MESHPACK_H */
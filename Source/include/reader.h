@@ -0,0 +1,63 @@
+#ifndef READER_H
+#define READER_H
+
+#include "pd_api.h"
+
+/* Size of the chunks read from the file system */
+#define READER_BUFFER_SIZE (8 * 1024)
+
+/**
+ * @brief Reads a file in large chunks and hands out lines or bytes from the buffer.
+ *
+ * Each call to the SDK file API fills the whole buffer, so the cost of a load is
+ * bound by the storage bandwidth rather than by the number of file calls.
+ */
+typedef struct
+{
+    SDFile* file;       /* File being read, NULL once closed */
+    char* buffer;       /* Chunk buffer, one byte larger than READER_BUFFER_SIZE for a terminator */
+    int position;       /* Offset of the next unread byte in the buffer */
+    int length;         /* Number of valid bytes in the buffer */
+    int endOfFile;      /* Non-zero once the file system reported the end of the file */
+    int totalRead;      /* Number of bytes read from the file so far */
+} BufferedReader;
+
+/**
+ * @brief Opens a file for buffered reading.
+ *
+ * @param reader The reader to initialize.
+ * @param filename The path of the file to open.
+ * @return int 0 on success, non-zero if the file could not be opened.
+ */
+int readerOpen(BufferedReader* reader, const char* filename);
+
+/**
+ * @brief Gets the next line of the file.
+ *
+ * The line is terminated in place, without its end-of-line characters, and stays
+ * valid until the next call on the reader. Lines longer than the buffer are split.
+ *
+ * @param reader The reader.
+ * @param length Receives the length of the line, may be NULL.
+ * @return char* The line, or NULL at the end of the file.
+ */
+char* readerNextLine(BufferedReader* reader, int* length);
+
+/**
+ * @brief Copies bytes from the file.
+ *
+ * @param reader The reader.
+ * @param data Destination of the bytes.
+ * @param size The number of bytes to copy.
+ * @return int The number of bytes copied, less than size at the end of the file.
+ */
+int readerRead(BufferedReader* reader, void* data, int size);
+
+/**
+ * @brief Closes the file and frees the buffer of a reader.
+ *
+ * @param reader The reader to close.
+ */
+void readerClose(BufferedReader* reader);
+
+#endif /* READER_H */
@@ -0,0 +1,27 @@
+#ifndef SCANLINE_H
+#define SCANLINE_H
+
+#include "triangle.h"
+
+/**
+ * @brief Renders a whole set of triangles with a scanline active edge table.
+ *
+ * Visibility is resolved per span by depth, so the triangles do not need to be
+ * sorted and every covered pixel of the framebuffer is written exactly once.
+ * Adjacent visible spans sharing a pattern are merged before being written.
+ *
+ * @param triangles The triangles to render, with the view-space depth of each point.
+ * @param count The number of triangles.
+ * @param outline Non-zero to draw the visible edges of the triangles in black.
+ */
+void drawScanlineTriangles(const Triangle2D* triangles, int count, int outline);
+
+/**
+ * @brief Gets the frame arena bytes drawScanlineTriangles allocates for a number of triangles.
+ *
+ * @param count The number of triangles.
+ * @return size_t The bytes of its tables, alignment included.
+ */
+size_t scanlineFrameBytes(int count);
+
+#endif /* SCANLINE_H */
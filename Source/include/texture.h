@@ -0,0 +1,129 @@
+#ifndef TEXTURE_H
+#define TEXTURE_H
+
+#include <stdint.h>
+
+/* Textures are stored in square tiles of 1 << TEXTURE_TILE_SHIFT texels */
+#define TEXTURE_TILE_SHIFT 3
+
+/* Largest width or height of a texture, keeps texel coordinates in 16.16 fixed point */
+#define TEXTURE_MAX_SIZE 1024
+
+/* Number of values of a 4-bit texel, 0 is black and TEXTURE_4BIT_LEVELS - 1 is white */
+#define TEXTURE_4BIT_LEVELS 16
+
+/* Texel area per pixel area above which a triangle samples the next mip level, lod 0.5 */
+#define TEXTURE_MIP_THRESHOLD 2.0f
+
+/**
+ * @brief Number of bits of each texel.
+ */
+typedef enum
+{
+    kTextureFormat1Bit,     /* Set texels are white, like the framebuffer */
+    kTextureFormat4Bit      /* Intensity, ordered dithered at the screen position of each pixel */
+} TextureFormat;
+
+/**
+ * @brief Texture whose width and height are powers of two, so coordinates wrap with a mask.
+ *
+ * Texels are stored in 8x8 tiles, the tiles row by row and the texels of a
+ * tile row by row. A tile is 8 bytes in 1-bit and 32 bytes in 4-bit, so the
+ * texels sampled by a small screen-space neighbourhood share a few bytes
+ * whatever the orientation of the texture on screen.
+ * Each mip level is a texture of its own, half the size of the previous one.
+ */
+typedef struct Texture
+{
+    uint8_t* data;          /* Tiled texels, high bits first */
+    int width, height;      /* Powers of two, from 8 to TEXTURE_MAX_SIZE */
+    int tileColumnShift;    /* Number of tiles per row of tiles, as a power of two */
+    TextureFormat format;
+    struct Texture* next;   /* Next mip level, NULL for the last one */
+} Texture;
+
+/**
+ * @brief Creates a black texture.
+ *
+ * @param width Width in texels, a power of two from 8 to TEXTURE_MAX_SIZE.
+ * @param height Height in texels, a power of two from 8 to TEXTURE_MAX_SIZE.
+ * @param format Number of bits of each texel.
+ * @return Texture* The texture, or NULL on failure.
+ */
+Texture* createTexture(int width, int height, TextureFormat format);
+
+/**
+ * @brief Loads a 1-bit texture from a Playdate image and builds its mip levels.
+ *
+ * Transparent pixels are read as black.
+ *
+ * @param path Path of the image, as given to loadBitmap.
+ * @return Texture* The texture, or NULL on failure.
+ */
+Texture* loadTexture(const char* path);
+
+/**
+ * @brief Builds the mip levels of a texture down to 8 texels on the shortest side.
+ *
+ * Each texel of a level is the mean of 2x2 texels of the previous one. Levels
+ * are 4-bit whatever the format of the texture, so a minified 1-bit texture
+ * is dithered to its mean intensity instead of aliasing. Existing levels are
+ * rebuilt, call it again after changing the texels.
+ *
+ * @param texture The texture, its texels already set.
+ * @return int 0 on success, non-zero on failure.
+ */
+int buildTextureMipmaps(Texture* texture);
+
+/**
+ * @brief Picks the mip level of a texture for a triangle.
+ *
+ * The level is chosen from the ratio of the areas the triangle covers in the
+ * texture and on screen, the determinant of its screen-space UV derivatives,
+ * so one level is sampled by the whole triangle.
+ *
+ * @param texture The texture, with or without mip levels.
+ * @param texelArea Area of the triangle in texels of the texture.
+ * @param pixelArea Area of the triangle in pixels.
+ * @return const Texture* The level whose texels are nearest in size to a pixel.
+ */
+const Texture* textureMipLevel(const Texture* texture, float texelArea, float pixelArea);
+
+/**
+ * @brief Frees a texture, its mip levels and their texels.
+ *
+ * @param texture The texture to free, may be NULL.
+ */
+void freeTexture(Texture* texture);
+
+/**
+ * @brief Sets a texel.
+ *
+ * @param texture The texture.
+ * @param x Column of the texel, wrapped to the texture width.
+ * @param y Row of the texel, wrapped to the texture height.
+ * @param value 0 or 1 in 1-bit, 0 to TEXTURE_4BIT_LEVELS - 1 in 4-bit.
+ */
+void textureSetTexel(Texture* texture, int x, int y, uint8_t value);
+
+/**
+ * @brief Gets a texel.
+ *
+ * @param texture The texture.
+ * @param x Column of the texel, wrapped to the texture width.
+ * @param y Row of the texel, wrapped to the texture height.
+ * @return uint8_t 0 or 1 in 1-bit, 0 to TEXTURE_4BIT_LEVELS - 1 in 4-bit.
+ */
+static inline uint8_t textureGetTexel(const Texture* texture, int x, int y)
+{
+    x &= texture->width - 1;
+    y &= texture->height - 1;
+    int tile = ((y >> TEXTURE_TILE_SHIFT) << texture->tileColumnShift) + (x >> TEXTURE_TILE_SHIFT);
+    if (texture->format == kTextureFormat1Bit)
+    {
+        return (texture->data[(tile << 3) + (y & 7)] >> (7 - (x & 7))) & 1;
+    }
+    return (texture->data[(tile << 5) + ((y & 7) << 2) + ((x & 7) >> 1)] >> ((x & 1) ? 0 : 4)) & 0x0F;
+}
+
+#endif /* TEXTURE_H */
@@ -4,19 +4,25 @@
 #include "vector.h"
 #include "utils.h"
 #include "logging.h"
+#include "texture.h"
+
+/* Number of ordered dither levels, one per threshold of the 8x8 Bayer matrix plus black */
+#define DITHER_LEVELS 65
 
 /* Triangle structures */
 
 /**
  * @brief Represents a face in a mesh.
  *
- * A face is defined by three vertex indices and three texture coordinate indices.
+ * A face is defined by three 0-based vertex indices, with optional texture
+ * coordinate and normal indices into the attribute arrays of its mesh.
  */
 typedef struct
 {
     int a, b, c;        /* Vertex indices */
-	LCDPattern* pattern;  /* Pattern to use for this face */
-    //int uva, uvb, uvc;  /* Texture coordinate indices */
+    int uva, uvb, uvc;  /* Texture coordinate indices, -1 if the face has none */
+    int na, nb, nc;     /* Normal indices, -1 if the face has none */
+    uint8_t pattern;    /* Index of the pattern of this face in ditheringPatterns */
 } Face;
 
 /**
@@ -27,8 +33,13 @@ typedef struct
 typedef struct
 {
     Vector2D points[3];  /* The three points of the triangle */
+    float depths[3];     /* View-space depth of each point */
 	LCDPattern* pattern;  /* Pattern to use for this triangle */
 	float avgDepth;      /* Average depth of the triangle */
+    uint8_t levels[3];   /* Dither level of each point, 0 to DITHER_LEVELS - 1, used if smooth */
+    uint8_t smooth;      /* Non-zero to dither the interpolated levels instead of using the pattern */
+    const Texture* texture; /* Texture mapped on the triangle instead of its shade, NULL if untextured */
+    Vector2D uvs[3];     /* Texture coordinates of each point in texels, used if textured */
 } Triangle2D;
 
 #endif /* TRIANGLE_H */
\ No newline at end of file
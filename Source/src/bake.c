@@ -0,0 +1,325 @@
+#include "global.h"
+#include "bake.h"
+#include "logging.h"
+#include "memory.h"
+#include "stb_ds.h"
+
+/* Largest number of faces in a leaf of the ray casting hierarchy */
+#define BAKE_LEAF_FACES 4
+
+/* Depth of the traversal stack, enough for any tree built from 32-bit face counts */
+#define BAKE_STACK_SIZE 64
+
+/* Offset of the ray origins along the normal, as a fraction of the bounds radius */
+#define BAKE_RAY_BIAS 1e-3f
+
+#define BAKE_PI 3.14159265f
+
+/* Node of the bounding volume hierarchy over the faces of the mesh being baked */
+typedef struct
+{
+    Vector3D min, max;  /* Bounds of the faces below the node */
+    int right;          /* Second child, the first one follows the node, -1 for a leaf */
+    int first;          /* First face of a leaf in the face order */
+    int count;          /* Number of faces of a leaf */
+} BakeNode;
+
+/* Triangles of the mesh and the hierarchy used to cast rays against them */
+typedef struct
+{
+    Vector3D* corners;  /* Three positions per face */
+    Vector3D* centroids;
+    int* order;         /* Faces sorted so that each node covers a contiguous range */
+    BakeNode* nodes;
+} BakeScene;
+
+/* Axis the faces are sorted along while building the hierarchy */
+static const BakeScene* sortScene = NULL;
+static int sortAxis = 0;
+
+static inline float vectorAxis(Vector3D v, int axis)
+{
+    return axis == 0 ? v.x : axis == 1 ? v.y : v.z;
+}
+
+static int centroidCompare(const void* a, const void* b)
+{
+    float ca = vectorAxis(sortScene->centroids[*(const int*)a], sortAxis);
+    float cb = vectorAxis(sortScene->centroids[*(const int*)b], sortAxis);
+    return ca < cb ? -1 : ca > cb ? 1 : 0;
+}
+
+/* Builds the node covering a range of the face order, splitting it at the median of its longest axis */
+static int buildNode(BakeScene* scene, int first, int count)
+{
+    BakeNode node;
+    node.min = node.max = scene->corners[scene->order[first] * 3];
+    Vector3D centroidMin = scene->centroids[scene->order[first]];
+    Vector3D centroidMax = centroidMin;
+    for (int i = first; i < first + count; i++)
+    {
+        int face = scene->order[i];
+        for (int j = 0; j < 3; j++)
+        {
+            Vector3D p = scene->corners[face * 3 + j];
+            node.min = (Vector3D){ fminf(node.min.x, p.x), fminf(node.min.y, p.y), fminf(node.min.z, p.z) };
+            node.max = (Vector3D){ fmaxf(node.max.x, p.x), fmaxf(node.max.y, p.y), fmaxf(node.max.z, p.z) };
+        }
+        Vector3D c = scene->centroids[face];
+        centroidMin = (Vector3D){ fminf(centroidMin.x, c.x), fminf(centroidMin.y, c.y), fminf(centroidMin.z, c.z) };
+        centroidMax = (Vector3D){ fmaxf(centroidMax.x, c.x), fmaxf(centroidMax.y, c.y), fmaxf(centroidMax.z, c.z) };
+    }
+    node.right = -1;
+    node.first = first;
+    node.count = count;
+
+    int index = (int)arrlen(scene->nodes);
+    arrput(scene->nodes, node);
+    if (count <= BAKE_LEAF_FACES)
+    {
+        return index;
+    }
+
+    Vector3D extent = vector3DSub(centroidMax, centroidMin);
+    sortAxis = extent.x > extent.y && extent.x > extent.z ? 0 : extent.y > extent.z ? 1 : 2;
+    sortScene = scene;
+    qsort(scene->order + first, count, sizeof(int), centroidCompare);
+
+    // Nodes are stored depth first, the array may move while the children are built
+    int half = count / 2;
+    buildNode(scene, first, half);
+    int right = buildNode(scene, first + half, count - half);
+    scene->nodes[index].right = right;
+    return index;
+}
+
+/* Ray against a node's box, returns 1 if it enters the box before maxT */
+static int rayHitsBox(const BakeNode* node, Vector3D origin, Vector3D inverse, float maxT)
+{
+    float t0 = 0.0f, t1 = maxT;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        float o = vectorAxis(origin, axis);
+        float d = vectorAxis(inverse, axis);
+        float near = (vectorAxis(node->min, axis) - o) * d;
+        float far = (vectorAxis(node->max, axis) - o) * d;
+        if (near > far)
+        {
+            float temp = near;
+            near = far;
+            far = temp;
+        }
+        t0 = near > t0 ? near : t0;
+        t1 = far < t1 ? far : t1;
+        if (t0 > t1)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Ray against a triangle from both sides (Moller-Trumbore), returns 1 on a hit before maxT */
+static int rayHitsTriangle(const Vector3D* corners, Vector3D origin, Vector3D direction, float maxT)
+{
+    Vector3D edge1 = vector3DSub(corners[1], corners[0]);
+    Vector3D edge2 = vector3DSub(corners[2], corners[0]);
+    Vector3D p = vector3DCross(direction, edge2);
+    float determinant = vector3DDot(edge1, p);
+    if (fabsf(determinant) < 1e-12f)
+    {
+        return 0;
+    }
+
+    float inverse = 1.0f / determinant;
+    Vector3D s = vector3DSub(origin, corners[0]);
+    float u = vector3DDot(s, p) * inverse;
+    if (u < 0.0f || u > 1.0f)
+    {
+        return 0;
+    }
+    Vector3D q = vector3DCross(s, edge1);
+    float v = vector3DDot(direction, q) * inverse;
+    if (v < 0.0f || u + v > 1.0f)
+    {
+        return 0;
+    }
+    float t = vector3DDot(edge2, q) * inverse;
+    return t > 0.0f && t < maxT;
+}
+
+/* Checks whether anything blocks a ray within maxT */
+static int isRayBlocked(const BakeScene* scene, Vector3D origin, Vector3D direction, float maxT)
+{
+    Vector3D inverse = {
+        direction.x != 0.0f ? 1.0f / direction.x : FLT_MAX,
+        direction.y != 0.0f ? 1.0f / direction.y : FLT_MAX,
+        direction.z != 0.0f ? 1.0f / direction.z : FLT_MAX
+    };
+
+    int stack[BAKE_STACK_SIZE];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0)
+    {
+        const BakeNode* node = &scene->nodes[stack[--top]];
+        if (!rayHitsBox(node, origin, inverse, maxT))
+        {
+            continue;
+        }
+        if (node->right < 0)
+        {
+            for (int i = node->first; i < node->first + node->count; i++)
+            {
+                if (rayHitsTriangle(&scene->corners[scene->order[i] * 3], origin, direction, maxT))
+                {
+                    return 1;
+                }
+            }
+        }
+        else if (top + 2 <= BAKE_STACK_SIZE)
+        {
+            stack[top++] = node->right;
+            stack[top++] = (int)(node - scene->nodes) + 1;
+        }
+    }
+    return 0;
+}
+
+/* Computes the light reaching a point of the surface */
+static float bakePoint(const BakeScene* scene, const BakeSettings* settings, Vector3D point, Vector3D normal,
+    float radius)
+{
+    if (vector3DLength(normal) == 0.0f)
+    {
+        return settings->ambient;
+    }
+    Vector3D origin = vector3DAdd(point, vector3DMul(normal, radius * BAKE_RAY_BIAS));
+
+    // Cosine-weighted directions spread over the hemisphere, the same for every point
+    float ambient = settings->ambient;
+    if (settings->occlusionRays > 0)
+    {
+        Vector3D tangent = fabsf(normal.x) < 0.9f ? (Vector3D){ 1.0f, 0.0f, 0.0f } : (Vector3D){ 0.0f, 1.0f, 0.0f };
+        tangent = vector3DNormalize(vector3DCross(normal, tangent));
+        Vector3D bitangent = vector3DCross(normal, tangent);
+        float reach = settings->occlusionDistance * radius;
+
+        int open = 0;
+        for (int i = 0; i < settings->occlusionRays; i++)
+        {
+            float u = (i + 0.5f) / settings->occlusionRays;
+            float angle = 2.0f * BAKE_PI * (i * 0.61803399f - floorf(i * 0.61803399f));
+            float r = sqrtf(u);
+            Vector3D direction = vector3DAdd(vector3DAdd(
+                vector3DMul(tangent, r * cosf(angle)),
+                vector3DMul(bitangent, r * sinf(angle))),
+                vector3DMul(normal, sqrtf(1.0f - u)));
+            open += !isRayBlocked(scene, origin, direction, reach);
+        }
+        ambient *= (float)open / settings->occlusionRays;
+    }
+
+    float intensity = ambient;
+    for (int i = 0; i < settings->lightCount; i++)
+    {
+        Vector3D toward = vector3DMul(settings->lights[i].direction, -1.0f);
+        float lambert = vector3DDot(normal, toward);
+        if (lambert > 0.0f && !(settings->castShadows && isRayBlocked(scene, origin, toward, FLT_MAX)))
+        {
+            intensity += settings->lights[i].intensity * lambert;
+        }
+    }
+    return intensity;
+}
+
+void bakeDefaultSettings(BakeSettings* settings)
+{
+    memset(settings, 0, sizeof(*settings));
+    settings->ambient = 0.35f;
+    settings->lights[0] = (BakeLight){ vector3DNormalize((Vector3D){ 1.0f, 1.0f, 1.0f }), 0.6f };
+    settings->lights[1] = (BakeLight){ vector3DNormalize((Vector3D){ -1.0f, -0.2f, -0.6f }), 0.2f };
+    settings->lightCount = 2;
+    settings->castShadows = 1;
+    settings->occlusionRays = 16;
+    settings->occlusionDistance = 0.5f;
+}
+
+int bakeMeshLighting(Mesh* mesh, const BakeSettings* settings)
+{
+    int vertexCount = meshVertexCount(mesh);
+    int faceCount = meshFaceCount(mesh);
+    if (faceCount == 0 || mesh->block || !mesh->faceNormals || !mesh->vertexNormals)
+    {
+        LOG_ERROR("Cannot bake a mesh without faces, normals or growable arrays");
+        return 1;
+    }
+
+    BakeSettings defaults;
+    if (settings == NULL)
+    {
+        bakeDefaultSettings(&defaults);
+        settings = &defaults;
+    }
+
+    unsigned int startTime = pd->system->getCurrentTimeMilliseconds();
+
+    BakeScene scene;
+    memset(&scene, 0, sizeof(scene));
+    scene.corners = (Vector3D*)pdMalloc(faceCount * 3 * sizeof(Vector3D));
+    scene.centroids = (Vector3D*)pdMalloc(faceCount * sizeof(Vector3D));
+    scene.order = (int*)pdMalloc(faceCount * sizeof(int));
+    if (!scene.corners || !scene.centroids || !scene.order)
+    {
+        pdFree(scene.corners);
+        pdFree(scene.centroids);
+        pdFree(scene.order);
+        return 1;
+    }
+    for (int i = 0; i < faceCount; i++)
+    {
+        Face face = meshGetFace(mesh, i);
+        scene.corners[i * 3] = meshGetVertex(mesh, face.a);
+        scene.corners[i * 3 + 1] = meshGetVertex(mesh, face.b);
+        scene.corners[i * 3 + 2] = meshGetVertex(mesh, face.c);
+        scene.centroids[i] = vector3DDiv(
+            vector3DAdd(vector3DAdd(scene.corners[i * 3], scene.corners[i * 3 + 1]), scene.corners[i * 3 + 2]), 3.0f);
+        scene.order[i] = i;
+    }
+    arrsetcap(scene.nodes, 4 * faceCount / BAKE_LEAF_FACES + 1);
+    buildNode(&scene, 0, faceCount);
+
+    // Faces take the light at their centroid, vertices the light along their averaged normal
+    float radius = mesh->boundsRadius > 0.0f ? mesh->boundsRadius : 1.0f;
+    for (int i = 0; i < faceCount; i++)
+    {
+        float intensity = bakePoint(&scene, settings, scene.centroids[i], mesh->faceNormals[i], radius);
+        uint8_t pattern = lightPatternIndex(intensity);
+        if (mesh->quantizedFaces)
+        {
+            mesh->quantizedFaces[i].pattern = pattern;
+        }
+        else
+        {
+            mesh->faces[i].pattern = pattern;
+        }
+    }
+
+    memoryPushTag(kMemoryTagMesh);
+    arrsetlen(mesh->bakedLevels, vertexCount);
+    memoryPopTag();
+    for (int i = 0; i < vertexCount; i++)
+    {
+        float intensity = bakePoint(&scene, settings, meshGetVertex(mesh, i), mesh->vertexNormals[i], radius);
+        mesh->bakedLevels[i] = lightDitherLevel(intensity);
+    }
+
+    LOG_INFO("Baked %d faces and %d vertices with %d lights in %u ms", faceCount, vertexCount,
+        settings->lightCount, pd->system->getCurrentTimeMilliseconds() - startTime);
+
+    arrfree(scene.nodes);
+    pdFree(scene.corners);
+    pdFree(scene.centroids);
+    pdFree(scene.order);
+    return 0;
+}
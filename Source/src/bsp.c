@@ -0,0 +1,384 @@
+#include "global.h"
+#include "bsp.h"
+#include "mesh.h"
+#include "logging.h"
+#include "memory.h"
+#include "stb_ds.h"
+
+/* Distance under which a vertex is considered to lie on a splitting plane */
+#define BSP_PLANE_EPSILON 0.001f
+
+/* Number of faces evaluated as splitter candidates per node */
+#define BSP_SPLITTER_CANDIDATES 16
+
+/* Cost of one split relative to one face of front/back imbalance */
+#define BSP_SPLIT_COST 8
+
+/* Classification of a face against a plane */
+enum
+{
+    kFaceCoplanar,
+    kFaceFront,
+    kFaceBack,
+    kFaceSpanning
+};
+
+/* Computes the plane of a face, returns 0 if the face is degenerate */
+static int facePlane(const Mesh* mesh, Face face, Vector3D* normal, float* distance)
+{
+    Vector3D a = mesh->vertices[face.a];
+    Vector3D b = mesh->vertices[face.b];
+    Vector3D c = mesh->vertices[face.c];
+
+    Vector3D n = vector3DCross(vector3DSub(b, a), vector3DSub(c, a));
+    float length = vector3DLength(n);
+    if (floatIsZero(length))
+    {
+        return 0;
+    }
+
+    *normal = vector3DMul(n, 1.0f / length);
+    *distance = vector3DDot(*normal, a);
+    return 1;
+}
+
+/* Classifies a face against a plane, storing the signed vertex distances */
+static int classifyFace(const Mesh* mesh, Face face, Vector3D normal, float distance, float d[3])
+{
+    int front = 0, back = 0;
+
+    d[0] = vector3DDot(normal, mesh->vertices[face.a]) - distance;
+    d[1] = vector3DDot(normal, mesh->vertices[face.b]) - distance;
+    d[2] = vector3DDot(normal, mesh->vertices[face.c]) - distance;
+
+    for (int i = 0; i < 3; i++)
+    {
+        if (d[i] > BSP_PLANE_EPSILON) front++;
+        else if (d[i] < -BSP_PLANE_EPSILON) back++;
+    }
+
+    if (front && back) return kFaceSpanning;
+    if (front) return kFaceFront;
+    if (back) return kFaceBack;
+    return kFaceCoplanar;
+}
+
+/* Picks the face whose plane gives the fewest splits and the best balance */
+static int chooseSplitter(const Mesh* mesh, const Face* faces)
+{
+    int count = arrlen(faces);
+    int step = count > BSP_SPLITTER_CANDIDATES ? count / BSP_SPLITTER_CANDIDATES : 1;
+    int best = -1;
+    int bestScore = 0;
+
+    for (int i = 0; i < count; i += step)
+    {
+        Vector3D normal;
+        float distance;
+        if (!facePlane(mesh, faces[i], &normal, &distance))
+        {
+            continue;
+        }
+
+        int front = 0, back = 0, splits = 0;
+        for (int j = 0; j < count; j++)
+        {
+            float d[3];
+            switch (classifyFace(mesh, faces[j], normal, distance, d))
+            {
+            case kFaceFront: front++; break;
+            case kFaceBack: back++; break;
+            case kFaceSpanning: splits++; break;
+            default: break;
+            }
+        }
+
+        int score = splits * BSP_SPLIT_COST + abs(front - back);
+        if (best < 0 || score < bestScore)
+        {
+            best = i;
+            bestScore = score;
+        }
+    }
+
+    return best;
+}
+
+/* Corner of a polygon produced by splitting a face, indices into the mesh arrays */
+typedef struct
+{
+    int vertex;
+    int uv;
+    int normal;
+} PolygonCorner;
+
+/* Fan-triangulates a convex polygon into a face list */
+static void emitPolygon(Face** faces, const PolygonCorner* corners, int count, Face source)
+{
+    for (int i = 1; i + 1 < count; i++)
+    {
+        Face face = source;
+        face.a = corners[0].vertex;
+        face.b = corners[i].vertex;
+        face.c = corners[i + 1].vertex;
+        face.uva = corners[0].uv;
+        face.uvb = corners[i].uv;
+        face.uvc = corners[i + 1].uv;
+        face.na = corners[0].normal;
+        face.nb = corners[i].normal;
+        face.nc = corners[i + 1].normal;
+        arrput(*faces, face);
+    }
+}
+
+/* Interpolates the corners of an edge at t, appending the new attributes to the mesh */
+static PolygonCorner splitEdge(Mesh* mesh, PolygonCorner ci, PolygonCorner cj, float t)
+{
+    PolygonCorner corner = { .vertex = (int)arrlen(mesh->vertices), .uv = -1, .normal = -1 };
+
+    Vector3D vi = mesh->vertices[ci.vertex];
+    Vector3D vj = mesh->vertices[cj.vertex];
+    arrput(mesh->vertices, vector3DAdd(vi, vector3DMul(vector3DSub(vj, vi), t)));
+
+    if (mesh->bakedLevels)
+    {
+        float li = mesh->bakedLevels[ci.vertex];
+        float lj = mesh->bakedLevels[cj.vertex];
+        arrput(mesh->bakedLevels, (uint8_t)(li + (lj - li) * t + 0.5f));
+    }
+
+    if (ci.uv >= 0 && cj.uv >= 0)
+    {
+        Vector2D uvi = mesh->uvs[ci.uv];
+        Vector2D uvj = mesh->uvs[cj.uv];
+        Vector2D uv = { uvi.x + (uvj.x - uvi.x) * t, uvi.y + (uvj.y - uvi.y) * t };
+        corner.uv = (int)arrlen(mesh->uvs);
+        arrput(mesh->uvs, uv);
+    }
+    if (ci.normal >= 0 && cj.normal >= 0)
+    {
+        Vector3D ni = mesh->normals[ci.normal];
+        Vector3D nj = mesh->normals[cj.normal];
+        corner.normal = (int)arrlen(mesh->normals);
+        arrput(mesh->normals, vector3DNormalize(vector3DAdd(ni, vector3DMul(vector3DSub(nj, ni), t))));
+    }
+
+    return corner;
+}
+
+/* Splits a spanning face by a plane into front and back faces */
+static void splitFace(Mesh* mesh, Face face, const float d[3], Face** frontFaces, Face** backFaces)
+{
+    PolygonCorner corners[3] = {
+        { face.a, face.uva, face.na },
+        { face.b, face.uvb, face.nb },
+        { face.c, face.uvc, face.nc }
+    };
+    PolygonCorner frontPolygon[4], backPolygon[4];
+    int frontCount = 0, backCount = 0;
+
+    for (int i = 0; i < 3; i++)
+    {
+        int j = (i + 1) % 3;
+
+        if (d[i] >= -BSP_PLANE_EPSILON) frontPolygon[frontCount++] = corners[i];
+        if (d[i] <= BSP_PLANE_EPSILON) backPolygon[backCount++] = corners[i];
+
+        if ((d[i] > BSP_PLANE_EPSILON && d[j] < -BSP_PLANE_EPSILON) ||
+            (d[i] < -BSP_PLANE_EPSILON && d[j] > BSP_PLANE_EPSILON))
+        {
+            // Add the intersection of the edge with the plane as a new corner
+            PolygonCorner corner = splitEdge(mesh, corners[i], corners[j], d[i] / (d[i] - d[j]));
+            frontPolygon[frontCount++] = corner;
+            backPolygon[backCount++] = corner;
+        }
+    }
+
+    emitPolygon(frontFaces, frontPolygon, frontCount, face);
+    emitPolygon(backFaces, backPolygon, backCount, face);
+}
+
+/* Faces waiting to be built into a subtree, and the node to link it to */
+typedef struct
+{
+    Face* faces;
+    int parent;     /* Index of the parent node, -1 for the root */
+    int isFront;    /* Non-zero if the subtree is in front of the parent plane */
+} BSPBuildTask;
+
+/* Builds the nodes for a list of faces, with an explicit stack since convex regions make the tree as deep as their face count */
+static void buildNodes(Mesh* mesh, Face* faces, Face** sortedFaces)
+{
+    BSPBuildTask* tasks = NULL;
+    BSPBuildTask root = { .faces = faces, .parent = -1, .isFront = 0 };
+    arrput(tasks, root);
+
+    while (arrlen(tasks) > 0)
+    {
+        BSPBuildTask task = arrpop(tasks);
+        faces = task.faces;
+
+        BSPNode node = { .normal = { 0.0f, 0.0f, 0.0f }, .distance = 0.0f, .front = -1, .back = -1 };
+        Face* frontFaces = NULL;
+        Face* backFaces = NULL;
+
+        int splitter = chooseSplitter(mesh, faces);
+        node.firstFace = (int)arrlen(*sortedFaces);
+
+        if (splitter < 0)
+        {
+            // Only degenerate faces are left, their order does not matter
+            for (int i = 0; i < arrlen(faces); i++)
+            {
+                arrput(*sortedFaces, faces[i]);
+            }
+        }
+        else
+        {
+            facePlane(mesh, faces[splitter], &node.normal, &node.distance);
+
+            for (int i = 0; i < arrlen(faces); i++)
+            {
+                float d[3];
+                switch (classifyFace(mesh, faces[i], node.normal, node.distance, d))
+                {
+                case kFaceCoplanar: arrput(*sortedFaces, faces[i]); break;
+                case kFaceFront: arrput(frontFaces, faces[i]); break;
+                case kFaceBack: arrput(backFaces, faces[i]); break;
+                default: splitFace(mesh, faces[i], d, &frontFaces, &backFaces); break;
+                }
+            }
+        }
+
+        node.faceCount = (int)arrlen(*sortedFaces) - node.firstFace;
+        arrfree(faces);
+
+        // Children are always appended after their parent
+        int nodeIndex = (int)arrlen(mesh->bspNodes);
+        arrput(mesh->bspNodes, node);
+        if (task.parent >= 0)
+        {
+            if (task.isFront)
+            {
+                mesh->bspNodes[task.parent].front = nodeIndex;
+            }
+            else
+            {
+                mesh->bspNodes[task.parent].back = nodeIndex;
+            }
+        }
+
+        // The front subtree is popped first, so nodes and faces stay in depth-first order
+        if (arrlen(backFaces) > 0)
+        {
+            BSPBuildTask back = { .faces = backFaces, .parent = nodeIndex, .isFront = 0 };
+            arrput(tasks, back);
+        }
+        if (arrlen(frontFaces) > 0)
+        {
+            BSPBuildTask front = { .faces = frontFaces, .parent = nodeIndex, .isFront = 1 };
+            arrput(tasks, front);
+        }
+    }
+
+    arrfree(tasks);
+}
+
+int buildMeshBSP(Mesh* mesh)
+{
+    if (!mesh || arrlen(mesh->faces) == 0)
+    {
+        LOG_ERROR("Cannot build a BSP tree for an empty mesh");
+        return 1;
+    }
+    if (mesh->block || mesh->quantizedVertices)
+    {
+        LOG_ERROR("Cannot build a BSP tree for a binary or quantized mesh, build it before");
+        return 1;
+    }
+
+    arrfree(mesh->bspNodes);
+    mesh->bspNodes = NULL;
+
+    if (mesh->isConvex)
+    {
+        // No face of a convex mesh can hide another, the tree would only be a chain as long as the face count
+        LOG_INFO("Mesh is convex, no BSP tree needed");
+        return 0;
+    }
+
+    int faceCount = (int)arrlen(mesh->faces);
+    Face* faces = NULL;
+    Face* sortedFaces = NULL;
+    arrsetcap(sortedFaces, faceCount);
+    for (int i = 0; i < faceCount; i++)
+    {
+        arrput(faces, mesh->faces[i]);
+    }
+
+    buildNodes(mesh, faces, &sortedFaces);
+
+    arrfree(mesh->faces);
+    mesh->faces = sortedFaces;
+    computeMeshNormals(mesh);
+
+    LOG_INFO("Built BSP tree with %d nodes, %d faces (%d before splitting)",
+        (int)arrlen(mesh->bspNodes), (int)arrlen(mesh->faces), faceCount);
+
+    return 0;
+}
+
+int traverseMeshBSP(const Mesh* mesh, Vector3D eye, int* faceOrder)
+{
+    if (!mesh->bspNodes)
+    {
+        return 0;
+    }
+
+    // The stack grows down from the end of faceOrder. Every entry still has at least one face to
+    // write, so it never reaches the faces already written and no memory is needed however deep the tree
+    int capacity = meshFaceCount(mesh);
+    int count = 0;
+    int top = capacity;
+    if (top > 0)
+    {
+        faceOrder[--top] = 0;
+    }
+
+    while (top < capacity)
+    {
+        int entry = faceOrder[top++];
+        if (entry < 0)
+        {
+            // The far side is done, write the faces on the plane
+            const BSPNode* node = &mesh->bspNodes[~entry];
+            for (int i = 0; i < node->faceCount && count < top; i++)
+            {
+                faceOrder[count++] = node->firstFace + i;
+            }
+            continue;
+        }
+
+        const BSPNode* node = &mesh->bspNodes[entry];
+        int eyeInFront = vector3DDot(node->normal, eye) >= node->distance;
+        int nearChild = eyeInFront ? node->front : node->back;
+        int farChild = eyeInFront ? node->back : node->front;
+
+        // Far side first, then the faces on the plane, then the near side
+        if (top - count < 1 + (nearChild >= 0) + (farChild >= 0))
+        {
+            break;
+        }
+        if (nearChild >= 0)
+        {
+            faceOrder[--top] = nearChild;
+        }
+        faceOrder[--top] = ~entry;
+        if (farChild >= 0)
+        {
+            faceOrder[--top] = farChild;
+        }
+    }
+
+    return count;
+}
@@ -1,11 +1,23 @@
+#include <limits.h>
+
 #include "global.h"
 #include "display.h"
 #include "logging.h"
+#include "memory.h"
 
 /* Grid configuration constants */
 #define GRID_OFFSET 5
 #define GRID_SPACING 10
 
+/* Depth buffer configuration constants */
+#define DEPTH_NEAR 0.25f      /* Nearest view-space depth that can be stored */
+#define DEPTH_MAX 0xFFFF      /* Depth value of a point at DEPTH_NEAR */
+#define DEPTH_TILE_SHIFT 3    /* Tiles are 8x8 pixels, one framebuffer byte wide */
+#define DEPTH_LINE_BIAS 16    /* Tolerance letting outlines pass over their own triangle */
+
+/* Smallest 1/z a texture coordinate is divided by, guards planes extrapolated past the horizon */
+#define TEXTURE_MIN_W 1.0e-4f
+
 /* Static variables for display information */
 static int displayRowBytes = 0;
 static int displayWidth = 0;
@@ -13,6 +25,114 @@ static int displayHeight = 0;
 
 static uint8_t* frameBuffer = NULL;
 
+/*
+ * Depth is stored as 1/z in 16-bit fixed point so that it interpolates linearly
+ * in screen space. Larger values are nearer, 0 is infinitely far.
+ * Each 8x8 tile keeps a lower bound (tileMin) and an upper bound (tileMax) of
+ * the depths stored in it. tileMin goes stale when pixels are overwritten and
+ * is recomputed lazily, a stale value is still a valid lower bound.
+ */
+static uint16_t* depthBuffer = NULL;
+static uint16_t* depthTileMin = NULL;
+static uint16_t* depthTileMax = NULL;
+static uint8_t* depthTileDirty = NULL;
+static int depthTileColumns = 0;
+static int depthTileRows = 0;
+
+/*
+ * Coverage mask for front-to-back rendering, same layout as frameBuffer.
+ * A set bit means the pixel already holds its final color. Rows keep a count
+ * of covered pixels so fully covered rows are skipped without touching the mask.
+ */
+static uint8_t* coverageBuffer = NULL;
+static int16_t* coverageRowCount = NULL;
+static int coverageFullRows = 0;
+
+/*
+ * Deferred shading buffers. While deferred shading is active, each pixel a
+ * fill covers stores a 4-bit intensity, two pixels per byte with the left one
+ * in the high nibble, and sets its bit in a mask laid out like frameBuffer.
+ * Only masked intensities are ever read, so the intensities are never cleared.
+ */
+static uint8_t* intensityBuffer = NULL;
+static uint8_t* intensityMask = NULL;
+static int intensityRowBytes = 0;
+static int deferredActive = 0;
+
+/*
+ * Edge flags of the polygon being filled, same layout as frameBuffer.
+ * Each edge toggles one pixel per row it crosses, the fill pass turns the
+ * flags into pixels and clears them, so the buffer is all zero between fills.
+ */
+static uint8_t* edgeFlagBuffer = NULL;
+
+/* Pixels drawLine sets on each row for the three edges of the triangle being outlined */
+static int edgeRunStart[3][LCD_ROWS];
+static int edgeRunEnd[3][LCD_ROWS];
+
+/* Number of set bits in each 4-bit value */
+static const uint8_t nibbleBitCount[16] = { 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 };
+
+/* 8x8 Bayer matrix, a pixel is lit by every dither level above its threshold */
+static const uint8_t bayerMatrix[8][8] = {
+    {  0, 32,  8, 40,  2, 34, 10, 42 },
+    { 48, 16, 56, 24, 50, 18, 58, 26 },
+    { 12, 44,  4, 36, 14, 46,  6, 38 },
+    { 60, 28, 52, 20, 62, 30, 54, 22 },
+    {  3, 35, 11, 43,  1, 33,  9, 41 },
+    { 51, 19, 59, 27, 49, 17, 57, 25 },
+    { 15, 47,  7, 39, 13, 45,  5, 37 },
+    { 63, 31, 55, 23, 61, 29, 53, 21 }
+};
+
+uint8_t ditherRowMasks[DITHER_LEVELS][8];
+
+/* Dither level of each 4-bit texel, spread evenly from black to white */
+static const uint8_t texelDitherLevels[TEXTURE_4BIT_LEVELS] = {
+    0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64
+};
+
+/* Framebuffer bits of the two pixels of an intensity byte, by dither row, pixel pair in the byte and byte value */
+static uint8_t resolveTable[8][4][256];
+
+/* Build the row masks of every dither level from the Bayer matrix */
+static void buildDitherRowMasks(void)
+{
+    for (int level = 0; level < DITHER_LEVELS; level++)
+    {
+        for (int y = 0; y < 8; y++)
+        {
+            uint8_t mask = 0;
+            for (int x = 0; x < 8; x++)
+            {
+                if (bayerMatrix[y][x] < level)
+                {
+                    mask |= 0x80 >> x;
+                }
+            }
+            ditherRowMasks[level][y] = mask;
+        }
+    }
+}
+
+/* Build the resolve table from the row masks of the levels of the 4-bit intensities */
+static void buildResolveTable(void)
+{
+    for (int y = 0; y < 8; y++)
+    {
+        for (int pair = 0; pair < 4; pair++)
+        {
+            uint8_t left = 0x80 >> (pair << 1);
+            uint8_t right = left >> 1;
+            for (int value = 0; value < 256; value++)
+            {
+                resolveTable[y][pair][value] = (ditherRowMasks[texelDitherLevels[value >> 4]][y] & left) |
+                    (ditherRowMasks[texelDitherLevels[value & 0x0F]][y] & right);
+            }
+        }
+    }
+}
+
 int initDisplay(void)
 {
     uint8_t* bitMapMask = NULL;
@@ -26,6 +146,9 @@ int initDisplay(void)
         &bitMapMask,
         &frameBuffer
     );
+
+    buildDitherRowMasks();
+    buildResolveTable();
     return 0;
 }
 
@@ -68,6 +191,46 @@ void drawLine(int x0, int y0, int x1, int y1, LCDSolidColor color)
     }
 }
 
+/* Record the first and last pixel drawLine sets on each screen row between two points */
+static void traceLineRuns(int x0, int y0, int x1, int y1, int* runStart, int* runEnd, int* yFirst, int* yLast)
+{
+    int dx = abs(x1 - x0), sx = x0 < x1 ? 1 : -1;
+    int dy = -abs(y1 - y0), sy = y0 < y1 ? 1 : -1;
+    int err = dx + dy, e2;
+
+    *yFirst = y0 < y1 ? y0 : y1;
+    *yLast = y0 < y1 ? y1 : y0;
+    if (*yFirst < 0) *yFirst = 0;
+    if (*yLast > displayHeight - 1) *yLast = displayHeight - 1;
+    for (int y = *yFirst; y <= *yLast; y++)
+    {
+        runStart[y] = INT_MAX;
+        runEnd[y] = INT_MIN;
+    }
+
+    // Same steps as drawLine, y moves by at most one per step so every row in range gets a pixel
+    for (;;)
+    {
+        if (y0 >= 0 && y0 < displayHeight)
+        {
+            if (x0 < runStart[y0]) runStart[y0] = x0;
+            if (x0 > runEnd[y0]) runEnd[y0] = x0;
+        }
+        if (x0 == x1 && y0 == y1) break;
+        e2 = 2 * err;
+        if (e2 >= dy)
+        {
+            err += dy;
+            x0 += sx;
+        }
+        if (e2 <= dx)
+        {
+            err += dx;
+            y0 += sy;
+        }
+    }
+}
+
 void drawTriangle(int x0, int y0, int x1, int y1, int x2, int y2, LCDSolidColor color)
 {
     drawLine(x0, y0, x1, y1, color);
@@ -158,6 +321,1165 @@ void drawFilledTriangle(int x0, int y0, int x1, int y1, int x2, int y2, LCDSolid
     }
 }
 
+/* Convert a view-space depth into a depth buffer value */
+static float depthFromViewZ(float z)
+{
+    if (z <= DEPTH_NEAR)
+    {
+        return (float)DEPTH_MAX;
+    }
+    return (DEPTH_MAX * DEPTH_NEAR) / z;
+}
+
+/* Get the exact lower bound of a tile, recomputing it if pixels changed */
+static uint16_t depthTileFarthest(int tileX, int tileY)
+{
+    int tile = tileY * depthTileColumns + tileX;
+    if (depthTileDirty[tile])
+    {
+        uint16_t farthest = DEPTH_MAX;
+        int yEnd = (tileY + 1) << DEPTH_TILE_SHIFT;
+        if (yEnd > displayHeight) yEnd = displayHeight;
+
+        for (int y = tileY << DEPTH_TILE_SHIFT; y < yEnd; y++)
+        {
+            const uint16_t* depth = depthBuffer + y * displayWidth + (tileX << DEPTH_TILE_SHIFT);
+            for (int i = 0; i < (1 << DEPTH_TILE_SHIFT); i++)
+            {
+                if (depth[i] < farthest) farthest = depth[i];
+            }
+        }
+        depthTileMin[tile] = farthest;
+        depthTileDirty[tile] = 0;
+    }
+    return depthTileMin[tile];
+}
+
+/* Check whether every tile under a bounding box is nearer than a depth */
+static int isRegionOccluded(int minX, int minY, int maxX, int maxY, uint16_t nearest)
+{
+    for (int tileY = minY >> DEPTH_TILE_SHIFT; tileY <= maxY >> DEPTH_TILE_SHIFT; tileY++)
+    {
+        for (int tileX = minX >> DEPTH_TILE_SHIFT; tileX <= maxX >> DEPTH_TILE_SHIFT; tileX++)
+        {
+            int tile = tileY * depthTileColumns + tileX;
+
+            // Try the stale bound first, only recompute when it is not enough
+            if (depthTileMin[tile] >= nearest) continue;
+            if (depthTileFarthest(tileX, tileY) < nearest) return 0;
+        }
+    }
+    return 1;
+}
+
+/* Get the row of a pattern for a scanline, or the solid color if there is no pattern */
+static inline uint8_t patternRowAt(const LCDPattern* pattern, LCDSolidColor color, int y)
+{
+    if (pattern)
+    {
+        return (*pattern)[y & 7];
+    }
+    return color ? 0xFF : 0x00;
+}
+
+/* Get the row of a triangle's pattern for a scanline, or the solid color if it has no pattern */
+static inline uint8_t trianglePatternRow(const Triangle2D* triangle, LCDSolidColor color, int y)
+{
+    return patternRowAt(triangle->pattern, color, y);
+}
+
+/* Get the 4-bit intensity of a pattern, the share of its 64 pixels that are lit */
+static uint8_t patternIntensity(const LCDPattern* pattern, LCDSolidColor color)
+{
+    int lit = color ? 64 : 0;
+    if (pattern)
+    {
+        lit = 0;
+        for (int y = 0; y < 8; y++)
+        {
+            uint8_t row = (*pattern)[y];
+            lit += nibbleBitCount[row & 0x0F] + nibbleBitCount[row >> 4];
+        }
+    }
+    return (uint8_t)((lit * (TEXTURE_4BIT_LEVELS - 1) + 32) / 64);
+}
+
+void spanShadeFlat(SpanShade* shade, uint8_t patternRow)
+{
+    shade->patternRow = patternRow;
+    shade->smooth = 0;
+    shade->texture = NULL;
+}
+
+void spanShadeSmooth(SpanShade* shade, int y, int xStart, int xEnd, float levelStart, float levelEnd)
+{
+    // Clamped ends keep every level stepped inside the span in range, the half rounds to the nearest level
+    levelStart = floatClamp(levelStart, 0.0f, DITHER_LEVELS - 1.0f) + 0.5f;
+    levelEnd = floatClamp(levelEnd, 0.0f, DITHER_LEVELS - 1.0f) + 0.5f;
+
+    shade->smooth = 1;
+    shade->texture = NULL;
+    shade->ditherRow = (uint8_t)(y & 7);
+    shade->xStart = xStart;
+    shade->level = (int32_t)(levelStart * 65536.0f);
+    shade->levelStep = xEnd > xStart ? (int32_t)((levelEnd - levelStart) * 65536.0f / (xEnd - xStart)) : 0;
+}
+
+void spanShadeTextured(SpanShade* shade, const Texture* texture, int y, int xStart, int xEnd,
+    const float uvw[3], const float uvwDx[3])
+{
+    shade->smooth = 0;
+    shade->texture = texture;
+    shade->ditherRow = (uint8_t)(y & 7);
+    shade->xStart = xStart;
+    shade->xEnd = xEnd;
+    for (int i = 0; i < 3; i++)
+    {
+        shade->uvw[i] = uvw[i];
+        shade->uvwDx[i] = uvwDx[i];
+    }
+}
+
+/* Texture coordinates of the pixels of a textured span inside one framebuffer byte */
+typedef struct
+{
+    int first, last;        /* Pixels of the span in the byte */
+    int32_t u, v;           /* Coordinates of the first pixel in 16.16 texels, wrapped into the texture */
+    int32_t uStep, vStep;   /* Change of the coordinates per pixel */
+} TextureByteSteps;
+
+/* Get the texture coordinates of the pixels of a textured span inside one framebuffer byte */
+static void textureByteSteps(const SpanShade* shade, int byteIndex, TextureByteSteps* steps)
+{
+    const Texture* texture = shade->texture;
+    int first = byteIndex << 3;
+    int last = first + 7;
+    if (first < shade->xStart) first = shade->xStart;
+    if (last > shade->xEnd) last = shade->xEnd;
+
+    // Perspective-correct coordinates at the centers of the end pixels, affine in between
+    float x0 = first + 0.5f;
+    float x1 = last + 0.5f;
+    float z0 = 1.0f / fmaxf(shade->uvw[2] + shade->uvwDx[2] * x0, TEXTURE_MIN_W);
+    float z1 = 1.0f / fmaxf(shade->uvw[2] + shade->uvwDx[2] * x1, TEXTURE_MIN_W);
+    float u0 = (shade->uvw[0] + shade->uvwDx[0] * x0) * z0;
+    float v0 = (shade->uvw[1] + shade->uvwDx[1] * x0) * z0;
+    float u1 = (shade->uvw[0] + shade->uvwDx[0] * x1) * z1;
+    float v1 = (shade->uvw[1] + shade->uvwDx[1] * x1) * z1;
+
+    // Wrap the start into the texture so that the 16.16 steps stay in range
+    int count = last - first;
+    float uWrap = floorf(u0 / texture->width) * texture->width;
+    float vWrap = floorf(v0 / texture->height) * texture->height;
+    int32_t u = (int32_t)((u0 - uWrap) * 65536.0f);
+    int32_t v = (int32_t)((v0 - vWrap) * 65536.0f);
+    int32_t uStep = 0, vStep = 0;
+    if (count > 0)
+    {
+        uStep = (int32_t)(floatClamp((u1 - u0) / count, -TEXTURE_MAX_SIZE, TEXTURE_MAX_SIZE) * 65536.0f);
+        vStep = (int32_t)(floatClamp((v1 - v0) / count, -TEXTURE_MAX_SIZE, TEXTURE_MAX_SIZE) * 65536.0f);
+    }
+
+    steps->first = first;
+    steps->last = last;
+    steps->u = u;
+    steps->v = v;
+    steps->uStep = uStep;
+    steps->vStep = vStep;
+}
+
+uint8_t spanShadeTextureByte(const SpanShade* shade, int byteIndex)
+{
+    const Texture* texture = shade->texture;
+    TextureByteSteps steps;
+    textureByteSteps(shade, byteIndex, &steps);
+    int32_t u = steps.u;
+    int32_t v = steps.v;
+
+    uint8_t bits = 0;
+    if (texture->format == kTextureFormat1Bit)
+    {
+        for (int x = steps.first; x <= steps.last; x++, u += steps.uStep, v += steps.vStep)
+        {
+            bits |= textureGetTexel(texture, u >> 16, v >> 16) << (7 - (x & 7));
+        }
+    }
+    else
+    {
+        for (int x = steps.first; x <= steps.last; x++, u += steps.uStep, v += steps.vStep)
+        {
+            uint8_t level = texelDitherLevels[textureGetTexel(texture, u >> 16, v >> 16)];
+            bits |= ditherRowMasks[level][shade->ditherRow] & (0x80 >> (x & 7));
+        }
+    }
+    return bits;
+}
+
+/* Get the 4-bit intensity of the pixels of a span inside one framebuffer byte, the others are left unset */
+static void spanIntensities(const SpanShade* shade, int byteIndex, uint8_t values[8])
+{
+    if (shade->texture)
+    {
+        const Texture* texture = shade->texture;
+        int scale = texture->format == kTextureFormat1Bit ? TEXTURE_4BIT_LEVELS - 1 : 1;
+        TextureByteSteps steps;
+        textureByteSteps(shade, byteIndex, &steps);
+        int32_t u = steps.u;
+        int32_t v = steps.v;
+        for (int x = steps.first; x <= steps.last; x++, u += steps.uStep, v += steps.vStep)
+        {
+            values[x & 7] = (uint8_t)(textureGetTexel(texture, u >> 16, v >> 16) * scale);
+        }
+    }
+    else if (shade->smooth)
+    {
+        for (int i = 0; i < 8; i++)
+        {
+            int32_t level = (shade->level + shade->levelStep * ((byteIndex << 3) + i - shade->xStart)) >> 16;
+            level = level < 0 ? 0 : level > DITHER_LEVELS - 1 ? DITHER_LEVELS - 1 : level;
+            values[i] = (uint8_t)((level * (TEXTURE_4BIT_LEVELS - 1) + (DITHER_LEVELS - 1) / 2) / (DITHER_LEVELS - 1));
+        }
+    }
+    else
+    {
+        memset(values, shade->intensity, 8);
+    }
+}
+
+/* Store the intensities of the pixels of a mask in a framebuffer byte, for resolveDeferredShading */
+static void writeIntensityByte(int y, int byteIndex, uint8_t mask, const SpanShade* shade)
+{
+    uint8_t* dst = intensityBuffer + y * intensityRowBytes + (byteIndex << 2);
+    intensityMask[y * displayRowBytes + byteIndex] |= mask;
+
+    if (mask == 0xFF && !shade->smooth && !shade->texture)
+    {
+        memset(dst, shade->intensity * 0x11, 4);
+        return;
+    }
+
+    uint8_t values[8];
+    spanIntensities(shade, byteIndex, values);
+    for (int i = 0; i < 8; i++)
+    {
+        if (mask & (0x80 >> i))
+        {
+            int shift = (i & 1) ? 0 : 4;
+            dst[i >> 1] = (uint8_t)((dst[i >> 1] & ~(0x0F << shift)) | (values[i] << shift));
+        }
+    }
+}
+
+/* Get the mask of the pixels of a span inside one framebuffer byte */
+static uint8_t spanByteMask(int byteIndex, int xStart, int xEnd)
+{
+    uint8_t mask = 0xFF;
+    if (byteIndex == xStart >> 3) mask &= 0xFF >> (xStart & 7);
+    if (byteIndex == xEnd >> 3) mask &= 0xFF << (7 - (xEnd & 7));
+    return mask;
+}
+
+/* Write the pixels of a mask in a framebuffer byte from a pattern row */
+static inline void writePatternByte(uint8_t* dst, uint8_t mask, uint8_t patternRow)
+{
+    *dst = (*dst & ~mask) | (patternRow & mask);
+}
+
+/* Write the pixels of a mask in a framebuffer byte with the shade of a span, or store their intensities while deferred */
+static inline void writeSpanByte(uint8_t* row, int y, int byteIndex, uint8_t mask, const SpanShade* shade)
+{
+    if (deferredActive)
+    {
+        writeIntensityByte(y, byteIndex, mask, shade);
+    }
+    else
+    {
+        writePatternByte(&row[byteIndex], mask, spanShadeByte(shade, byteIndex));
+    }
+}
+
+/*
+ * Fill a span, depth is 16.16 fixed point stepping by depthStep per pixel.
+ * The step may be negative, unsigned wrap-around keeps the sum exact as long
+ * as the depth stays within the span endpoints.
+ */
+static void fillSpanDepth(int y, int xStart, int xEnd, uint32_t depth, uint32_t depthStep, const SpanShade* shade)
+{
+    uint8_t* row = frameBuffer + y * displayRowBytes;
+    uint16_t* depthRow = depthBuffer + y * displayWidth;
+    int tileRow = (y >> DEPTH_TILE_SHIFT) * depthTileColumns;
+    int x = xStart;
+
+    while (x <= xEnd)
+    {
+        // Process the span one framebuffer byte, and so one tile, at a time
+        int byteIndex = x >> 3;
+        int segmentEnd = (byteIndex << 3) + 7;
+        if (segmentEnd > xEnd) segmentEnd = xEnd;
+        int count = segmentEnd - x + 1;
+
+        uint32_t lastDepth = depth + depthStep * (count - 1);
+        uint16_t segmentNear = (uint16_t)((depth > lastDepth ? depth : lastDepth) >> 16);
+        uint16_t segmentFar = (uint16_t)((depth < lastDepth ? depth : lastDepth) >> 16);
+        int tile = tileRow + byteIndex;
+
+        if (segmentNear <= depthTileMin[tile])
+        {
+            // Everything in the tile is nearer than this segment
+            depth += depthStep * count;
+            x = segmentEnd + 1;
+            continue;
+        }
+
+        uint8_t mask = 0;
+        if (segmentFar > depthTileMax[tile])
+        {
+            // Everything in the tile is farther, no need to compare
+            for (; x <= segmentEnd; x++, depth += depthStep)
+            {
+                depthRow[x] = (uint16_t)(depth >> 16);
+                mask |= 0x80 >> (x & 7);
+            }
+        }
+        else
+        {
+            for (; x <= segmentEnd; x++, depth += depthStep)
+            {
+                uint16_t value = (uint16_t)(depth >> 16);
+                if (value > depthRow[x])
+                {
+                    depthRow[x] = value;
+                    mask |= 0x80 >> (x & 7);
+                }
+            }
+        }
+
+        if (mask)
+        {
+            if (segmentNear > depthTileMax[tile]) depthTileMax[tile] = segmentNear;
+            depthTileDirty[tile] = 1;
+            writeSpanByte(row, y, byteIndex, mask, shade);
+        }
+    }
+}
+
+/* Edge walking state of a triangle, sampled at pixel centers */
+typedef struct
+{
+    float x[3], y[3];       /* Vertices sorted by y-coordinate */
+    int order[3];           /* Index in the source triangle of each sorted vertex */
+    float area;             /* Twice the signed area of the sorted triangle */
+    float invSlopeLong;     /* Inverse slope of the edge from the top to the bottom vertex */
+    float invSlopeTop;      /* Inverse slope of the edge from the top to the middle vertex */
+    float invSlopeBottom;   /* Inverse slope of the edge from the middle to the bottom vertex */
+    int minX, maxX;         /* Bounding box columns, clipped to the screen */
+    int yStart, yEnd;       /* Rows covered, clipped to the screen */
+} TriangleSetup;
+
+/* Prepare a triangle for scan conversion, returns 0 if nothing is visible */
+static int setupTriangle(const Triangle2D* triangle, TriangleSetup* setup)
+{
+    int* order = setup->order;
+    float* x = setup->x;
+    float* y = setup->y;
+
+    // Sort the vertices by y-coordinate
+    order[0] = 0; order[1] = 1; order[2] = 2;
+    if (triangle->points[order[0]].y > triangle->points[order[1]].y) intSwap(&order[0], &order[1]);
+    if (triangle->points[order[0]].y > triangle->points[order[2]].y) intSwap(&order[0], &order[2]);
+    if (triangle->points[order[1]].y > triangle->points[order[2]].y) intSwap(&order[1], &order[2]);
+    for (int i = 0; i < 3; i++)
+    {
+        x[i] = triangle->points[order[i]].x;
+        y[i] = triangle->points[order[i]].y;
+    }
+
+    setup->area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+    if (floatIsZero(setup->area))
+    {
+        return 0;
+    }
+
+    // Clip the bounding box to the screen
+    setup->minX = (int)fmaxf(0.0f, fminf(x[0], fminf(x[1], x[2])));
+    setup->maxX = (int)fminf(displayWidth - 1.0f, fmaxf(x[0], fmaxf(x[1], x[2])));
+    setup->yStart = (int)fmaxf(0.0f, ceilf(y[0] - 0.5f));
+    setup->yEnd = (int)fminf(displayHeight - 1.0f, ceilf(y[2] - 0.5f) - 1.0f);
+    if (setup->minX > setup->maxX || setup->yStart > setup->yEnd)
+    {
+        return 0;
+    }
+
+    // Inverse slopes of the long edge and of the two short edges
+    setup->invSlopeLong = (x[2] - x[0]) / (y[2] - y[0]);
+    setup->invSlopeTop = y[1] > y[0] ? (x[1] - x[0]) / (y[1] - y[0]) : 0.0f;
+    setup->invSlopeBottom = y[2] > y[1] ? (x[2] - x[1]) / (y[2] - y[1]) : 0.0f;
+    return 1;
+}
+
+/* Get the pixels covered by a triangle on a row, returns 0 if there are none */
+static int triangleRowSpan(const TriangleSetup* setup, int scanlineY, int* xStart, int* xEnd)
+{
+    // Sample at pixel centers
+    float centerY = scanlineY + 0.5f;
+    float xLong = setup->x[0] + (centerY - setup->y[0]) * setup->invSlopeLong;
+    float xShort = centerY < setup->y[1]
+        ? setup->x[0] + (centerY - setup->y[0]) * setup->invSlopeTop
+        : setup->x[1] + (centerY - setup->y[1]) * setup->invSlopeBottom;
+    float xLeft = fminf(xLong, xShort);
+    float xRight = fmaxf(xLong, xShort);
+
+    *xStart = (int)fmaxf(0.0f, ceilf(xLeft - 0.5f));
+    *xEnd = (int)fminf(displayWidth - 1.0f, ceilf(xRight - 0.5f) - 1.0f);
+    return *xStart <= *xEnd;
+}
+
+/* Get the screen-space gradients of a value interpolated linearly between the sorted vertices */
+static void triangleGradients(const TriangleSetup* setup, const float value[3], float* dx, float* dy)
+{
+    const float* x = setup->x;
+    const float* y = setup->y;
+    *dx = ((value[1] - value[0]) * (y[2] - y[0]) - (value[2] - value[0]) * (y[1] - y[0])) / setup->area;
+    *dy = ((value[2] - value[0]) * (x[1] - x[0]) - (value[1] - value[0]) * (x[2] - x[0])) / setup->area;
+}
+
+/* Shading of a triangle, either its pattern, the plane of its dither levels or its texture */
+typedef struct
+{
+    const Triangle2D* triangle;
+    LCDSolidColor color;    /* Color used if the triangle has no pattern */
+    uint8_t intensity;      /* 4-bit intensity of the pattern or color, for deferred shading */
+    float level0;           /* Dither level at the first sorted vertex */
+    float levelDx;          /* Change of the dither level per pixel along x */
+    float levelDy;          /* Change of the dither level per pixel along y */
+    float uvw0[3];          /* u/z, v/z and 1/z at the first sorted vertex */
+    float uvwDx[3];         /* Change of uvw per pixel along x */
+    float uvwDy[3];         /* Change of uvw per pixel along y */
+} TriangleShade;
+
+/* Prepare the shading of a triangle once its setup is done */
+static void setupTriangleShade(const Triangle2D* triangle, const TriangleSetup* setup, LCDSolidColor color,
+    TriangleShade* shade)
+{
+    shade->triangle = triangle;
+    shade->color = color;
+    shade->intensity = patternIntensity(triangle->pattern, color);
+
+    if (triangle->texture)
+    {
+        // u/z, v/z and 1/z are linear in screen space, unlike u and v
+        float uvw[3][3];
+        for (int i = 0; i < 3; i++)
+        {
+            int vertex = setup->order[i];
+            float w = 1.0f / fmaxf(triangle->depths[vertex], DEPTH_NEAR);
+            uvw[0][i] = triangle->uvs[vertex].x * w;
+            uvw[1][i] = triangle->uvs[vertex].y * w;
+            uvw[2][i] = w;
+        }
+        for (int i = 0; i < 3; i++)
+        {
+            shade->uvw0[i] = uvw[i][0];
+            triangleGradients(setup, uvw[i], &shade->uvwDx[i], &shade->uvwDy[i]);
+        }
+    }
+    else if (triangle->smooth)
+    {
+        float levels[3];
+        for (int i = 0; i < 3; i++)
+        {
+            levels[i] = triangle->levels[setup->order[i]];
+        }
+        shade->level0 = levels[0];
+        triangleGradients(setup, levels, &shade->levelDx, &shade->levelDy);
+    }
+}
+
+/* Get the shade of the span of a triangle on a row */
+static void triangleSpanShade(const TriangleShade* shade, const TriangleSetup* setup, int y, int xStart, int xEnd,
+    SpanShade* span)
+{
+    if (shade->triangle->texture)
+    {
+        float rowUvw[3];
+        for (int i = 0; i < 3; i++)
+        {
+            rowUvw[i] = shade->uvw0[i] - shade->uvwDx[i] * setup->x[0] + shade->uvwDy[i] * (y + 0.5f - setup->y[0]);
+        }
+        spanShadeTextured(span, shade->triangle->texture, y, xStart, xEnd, rowUvw, shade->uvwDx);
+        return;
+    }
+    if (!shade->triangle->smooth)
+    {
+        spanShadeFlat(span, trianglePatternRow(shade->triangle, shade->color, y));
+        span->intensity = shade->intensity;
+        return;
+    }
+
+    // Levels at the pixel centers of both span ends
+    float rowLevel = shade->level0 + shade->levelDx * (0.5f - setup->x[0]) + shade->levelDy * (y + 0.5f - setup->y[0]);
+    spanShadeSmooth(span, y, xStart, xEnd, rowLevel + shade->levelDx * xStart, rowLevel + shade->levelDx * xEnd);
+}
+
+void drawFilledTrianglePattern(const Triangle2D* triangle, LCDSolidColor color)
+{
+    TriangleSetup setup;
+    if (!setupTriangle(triangle, &setup))
+    {
+        return;
+    }
+
+    TriangleShade shade;
+    setupTriangleShade(triangle, &setup, color, &shade);
+
+    for (int scanlineY = setup.yStart; scanlineY <= setup.yEnd; scanlineY++)
+    {
+        int xStart, xEnd;
+        if (!triangleRowSpan(&setup, scanlineY, &xStart, &xEnd))
+        {
+            continue;
+        }
+
+        uint8_t* row = frameBuffer + scanlineY * displayRowBytes;
+        SpanShade span;
+        triangleSpanShade(&shade, &setup, scanlineY, xStart, xEnd, &span);
+        int firstByte = xStart >> 3;
+        int lastByte = xEnd >> 3;
+        if (deferredActive)
+        {
+            for (int byteIndex = firstByte; byteIndex <= lastByte; byteIndex++)
+            {
+                writeIntensityByte(scanlineY, byteIndex, spanByteMask(byteIndex, xStart, xEnd), &span);
+            }
+            continue;
+        }
+        if (firstByte == lastByte)
+        {
+            writePatternByte(&row[firstByte], spanByteMask(firstByte, xStart, xEnd), spanShadeByte(&span, firstByte));
+            continue;
+        }
+
+        // Partial bytes at both ends, whole bytes in between
+        writePatternByte(&row[firstByte], 0xFF >> (xStart & 7), spanShadeByte(&span, firstByte));
+        if (span.smooth || span.texture)
+        {
+            for (int byteIndex = firstByte + 1; byteIndex < lastByte; byteIndex++)
+            {
+                row[byteIndex] = spanShadeByte(&span, byteIndex);
+            }
+        }
+        else
+        {
+            memset(row + firstByte + 1, span.patternRow, lastByte - firstByte - 1);
+        }
+        writePatternByte(&row[lastByte], 0xFF << (7 - (xEnd & 7)), spanShadeByte(&span, lastByte));
+    }
+}
+
+void drawFilledTriangleOutline(const Triangle2D* triangle, LCDSolidColor color, LCDSolidColor outlineColor)
+{
+    TriangleSetup setup;
+    TriangleShade shade;
+    int filled = setupTriangle(triangle, &setup);
+    if (filled)
+    {
+        setupTriangleShade(triangle, &setup, color, &shade);
+    }
+
+    // The outline takes the pixels drawTriangle would draw over the fill, degenerate triangles included
+    int edgeFirst[3], edgeLast[3];
+    int yFirst = filled ? setup.yStart : displayHeight;
+    int yLast = filled ? setup.yEnd : -1;
+    for (int i = 0; i < 3; i++)
+    {
+        int j = (i + 1) % 3;
+        traceLineRuns((int)triangle->points[i].x, (int)triangle->points[i].y,
+            (int)triangle->points[j].x, (int)triangle->points[j].y,
+            edgeRunStart[i], edgeRunEnd[i], &edgeFirst[i], &edgeLast[i]);
+        if (edgeFirst[i] < yFirst) yFirst = edgeFirst[i];
+        if (edgeLast[i] > yLast) yLast = edgeLast[i];
+    }
+
+    SpanShade outline;
+    spanShadeFlat(&outline, outlineColor ? 0xFF : 0x00);
+    outline.intensity = outlineColor ? TEXTURE_4BIT_LEVELS - 1 : 0;
+
+    for (int scanlineY = yFirst; scanlineY <= yLast; scanlineY++)
+    {
+        int xStart, xEnd;
+        SpanShade span;
+        int spanned = filled && scanlineY >= setup.yStart && scanlineY <= setup.yEnd &&
+            triangleRowSpan(&setup, scanlineY, &xStart, &xEnd);
+        int first = displayWidth, last = -1;
+        if (spanned)
+        {
+            triangleSpanShade(&shade, &setup, scanlineY, xStart, xEnd, &span);
+            first = xStart;
+            last = xEnd;
+        }
+
+        // Runs of the edges crossing this row, clipped to the screen
+        int runStart[3], runEnd[3];
+        int runCount = 0;
+        for (int i = 0; i < 3; i++)
+        {
+            if (scanlineY < edgeFirst[i] || scanlineY > edgeLast[i])
+            {
+                continue;
+            }
+            int start = edgeRunStart[i][scanlineY] > 0 ? edgeRunStart[i][scanlineY] : 0;
+            int end = edgeRunEnd[i][scanlineY] < displayWidth - 1 ? edgeRunEnd[i][scanlineY] : displayWidth - 1;
+            if (start <= end)
+            {
+                runStart[runCount] = start;
+                runEnd[runCount++] = end;
+                if (start < first) first = start;
+                if (end > last) last = end;
+            }
+        }
+
+        // Every pixel of the row is written once, edge pixels with the outline and the others with the fill
+        uint8_t* row = frameBuffer + scanlineY * displayRowBytes;
+        for (int byteIndex = first >> 3; first <= last && byteIndex <= last >> 3; byteIndex++)
+        {
+            uint8_t edgeMask = 0;
+            for (int i = 0; i < runCount; i++)
+            {
+                if (byteIndex >= runStart[i] >> 3 && byteIndex <= runEnd[i] >> 3)
+                {
+                    edgeMask |= spanByteMask(byteIndex, runStart[i], runEnd[i]);
+                }
+            }
+
+            uint8_t fillMask = 0;
+            if (spanned && byteIndex >= xStart >> 3 && byteIndex <= xEnd >> 3)
+            {
+                fillMask = spanByteMask(byteIndex, xStart, xEnd) & ~edgeMask;
+            }
+
+            if (fillMask)
+            {
+                writeSpanByte(row, scanlineY, byteIndex, fillMask, &span);
+            }
+            if (edgeMask)
+            {
+                writeSpanByte(row, scanlineY, byteIndex, edgeMask, &outline);
+            }
+        }
+    }
+}
+
+int prepareEdgeFlagBuffer(void)
+{
+    if (edgeFlagBuffer == NULL)
+    {
+        memoryPushTag(kMemoryTagFrame);
+        edgeFlagBuffer = (uint8_t*)pdCalloc(displayRowBytes * displayHeight, 1);
+        memoryPopTag();
+        if (!edgeFlagBuffer)
+        {
+            LOG_ERROR("Failed to allocate the edge flag buffer");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Toggle the first pixel right of an edge on each row whose center it crosses, and grow the rows and columns flagged */
+static void toggleEdgeFlags(Vector2D a, Vector2D b, int* yFirst, int* yLast, int* xFirst, int* xLast)
+{
+    if (a.y == b.y)
+    {
+        return;
+    }
+    if (a.y > b.y)
+    {
+        Vector2D swap = a;
+        a = b;
+        b = swap;
+    }
+
+    // Same sampling as triangleRowSpan: rows whose center is in [a.y, b.y), pixels whose center is right of the edge
+    float invSlope = (b.x - a.x) / (b.y - a.y);
+    int yStart = (int)fmaxf(0.0f, ceilf(a.y - 0.5f));
+    int yEnd = (int)fminf(displayHeight - 1.0f, ceilf(b.y - 0.5f) - 1.0f);
+    for (int y = yStart; y <= yEnd; y++)
+    {
+        float x = ceilf(a.x + (y + 0.5f - a.y) * invSlope - 0.5f);
+        if (x >= displayWidth)
+        {
+            // The rest of the row is inside, the fill pass has to reach its end
+            *xLast = displayWidth - 1;
+            continue;
+        }
+
+        int flagX = x > 0.0f ? (int)x : 0;
+        edgeFlagBuffer[y * displayRowBytes + (flagX >> 3)] ^= 0x80 >> (flagX & 7);
+        if (flagX < *xFirst) *xFirst = flagX;
+        if (flagX > *xLast) *xLast = flagX;
+    }
+    if (yStart < *yFirst) *yFirst = yStart;
+    if (yEnd > *yLast) *yLast = yEnd;
+}
+
+void drawFilledPolygonEdgeFlag(const Vector2D* points, int count, const LCDPattern* pattern, LCDSolidColor color)
+{
+    if (count < 3)
+    {
+        return;
+    }
+
+    // Degenerate polygons would leave stray pixels where the rounding of coincident edges differs
+    float area = 0.0f;
+    for (int i = 1; i < count - 1; i++)
+    {
+        area += (points[i].x - points[0].x) * (points[i + 1].y - points[0].y) -
+            (points[i + 1].x - points[0].x) * (points[i].y - points[0].y);
+    }
+    if (floatIsZero(area))
+    {
+        return;
+    }
+
+    int yFirst = displayHeight, yLast = -1;
+    int xFirst = displayWidth, xLast = -1;
+    for (int i = 0; i < count; i++)
+    {
+        toggleEdgeFlags(points[i], points[(i + 1) % count], &yFirst, &yLast, &xFirst, &xLast);
+    }
+    if (xFirst > xLast)
+    {
+        // Every toggle was right of the screen, nothing is flagged
+        return;
+    }
+
+    SpanShade span;
+    span.intensity = patternIntensity(pattern, color);
+    for (int y = yFirst; y <= yLast; y++)
+    {
+        uint8_t* row = frameBuffer + y * displayRowBytes;
+        uint8_t* flags = edgeFlagBuffer + y * displayRowBytes;
+        spanShadeFlat(&span, patternRowAt(pattern, color, y));
+
+        // A pixel is inside when an odd number of flags is left of it or on it, carried from byte to byte
+        uint8_t inside = 0x00;
+        for (int byteIndex = xFirst >> 3; byteIndex <= xLast >> 3; byteIndex++)
+        {
+            uint8_t mask = flags[byteIndex];
+            flags[byteIndex] = 0;
+            mask ^= mask >> 1;
+            mask ^= mask >> 2;
+            mask ^= mask >> 4;
+            mask ^= inside;
+            inside = (mask & 1) ? 0xFF : 0x00;
+            if (mask)
+            {
+                writeSpanByte(row, y, byteIndex, mask, &span);
+            }
+        }
+    }
+}
+
+void drawFilledTriangleEdgeFlag(const Triangle2D* triangle, LCDSolidColor color)
+{
+    if (triangle->smooth || triangle->texture)
+    {
+        drawFilledTrianglePattern(triangle, color);
+        return;
+    }
+    drawFilledPolygonEdgeFlag(triangle->points, 3, triangle->pattern, color);
+}
+
+void drawFilledTriangleDepth(const Triangle2D* triangle, LCDSolidColor color)
+{
+    TriangleSetup setup;
+    if (!setupTriangle(triangle, &setup))
+    {
+        return;
+    }
+
+    const float* x = setup.x;
+    const float* y = setup.y;
+    float w[3];
+    for (int i = 0; i < 3; i++)
+    {
+        w[i] = depthFromViewZ(triangle->depths[setup.order[i]]);
+    }
+
+    // 1/z is linear in screen space, so the nearest point is a vertex
+    uint16_t nearest = (uint16_t)fmaxf(w[0], fmaxf(w[1], w[2]));
+    if (isRegionOccluded(setup.minX, setup.yStart, setup.maxX, setup.yEnd, nearest))
+    {
+        return;
+    }
+
+    // Depth gradients of the triangle plane
+    float depthDx, depthDy;
+    triangleGradients(&setup, w, &depthDx, &depthDy);
+
+    TriangleShade shade;
+    setupTriangleShade(triangle, &setup, color, &shade);
+
+    for (int scanlineY = setup.yStart; scanlineY <= setup.yEnd; scanlineY++)
+    {
+        int xStart, xEnd;
+        if (!triangleRowSpan(&setup, scanlineY, &xStart, &xEnd))
+        {
+            continue;
+        }
+
+        // Depth at both span ends, clamped so that the fixed point steps never leave the range
+        float rowDepth = w[0] + depthDx * (0.5f - x[0]) + depthDy * (scanlineY + 0.5f - y[0]);
+        float depthStart = floatClamp(rowDepth + depthDx * xStart, 0.0f, (float)DEPTH_MAX);
+        float depthEnd = floatClamp(rowDepth + depthDx * xEnd, 0.0f, (float)DEPTH_MAX);
+        uint32_t depthStep = 0;
+        if (xEnd > xStart)
+        {
+            depthStep = (uint32_t)(int64_t)((depthEnd - depthStart) * 65536.0f / (xEnd - xStart));
+        }
+
+        SpanShade span;
+        triangleSpanShade(&shade, &setup, scanlineY, xStart, xEnd, &span);
+        fillSpanDepth(scanlineY, xStart, xEnd, (uint32_t)(depthStart * 65536.0f), depthStep, &span);
+    }
+}
+
+/* Draw a line with depth interpolated along it, skipping hidden pixels */
+static void drawLineDepth(int x0, int y0, float w0, int x1, int y1, float w1, LCDSolidColor color)
+{
+    int dx = abs(x1 - x0), sx = x0 < x1 ? 1 : -1;
+    int dy = -abs(y1 - y0), sy = y0 < y1 ? 1 : -1;
+    int err = dx + dy, e2;
+    int steps = dx > -dy ? dx : -dy;
+    float depthStep = steps > 0 ? (w1 - w0) / steps : 0.0f;
+    float depth = w0;
+
+    for (;;)
+    {
+        if (x0 >= 0 && x0 < displayWidth && y0 >= 0 && y0 < displayHeight &&
+            depth + DEPTH_LINE_BIAS >= depthBuffer[y0 * displayWidth + x0])
+        {
+            uint8_t* block = frameBuffer + (y0 * displayRowBytes) + (x0 / 8);
+            uint8_t data = 0x80 >> (x0 % 8);
+            *block = color ? *block | data : *block & ~data;
+        }
+        if (x0 == x1 && y0 == y1) break;
+        e2 = 2 * err;
+        if (e2 >= dy)
+        {
+            err += dy;
+            x0 += sx;
+        }
+        if (e2 <= dx)
+        {
+            err += dx;
+            y0 += sy;
+        }
+        depth += depthStep;
+    }
+}
+
+void drawTriangleDepth(const Triangle2D* triangle, LCDSolidColor color)
+{
+    for (int i = 0; i < 3; i++)
+    {
+        int j = (i + 1) % 3;
+        drawLineDepth(
+            (int)triangle->points[i].x, (int)triangle->points[i].y, depthFromViewZ(triangle->depths[i]),
+            (int)triangle->points[j].x, (int)triangle->points[j].y, depthFromViewZ(triangle->depths[j]),
+            color);
+    }
+}
+
+int prepareDepthBuffer(void)
+{
+    if (depthBuffer == NULL)
+    {
+        depthTileColumns = (displayWidth + (1 << DEPTH_TILE_SHIFT) - 1) >> DEPTH_TILE_SHIFT;
+        depthTileRows = (displayHeight + (1 << DEPTH_TILE_SHIFT) - 1) >> DEPTH_TILE_SHIFT;
+
+        memoryPushTag(kMemoryTagFrame);
+        depthBuffer = (uint16_t*)pdMalloc(displayWidth * displayHeight * sizeof(uint16_t));
+        depthTileMin = (uint16_t*)pdMalloc(depthTileColumns * depthTileRows * sizeof(uint16_t));
+        depthTileMax = (uint16_t*)pdMalloc(depthTileColumns * depthTileRows * sizeof(uint16_t));
+        depthTileDirty = (uint8_t*)pdMalloc(depthTileColumns * depthTileRows);
+        memoryPopTag();
+        if (!depthBuffer || !depthTileMin || !depthTileMax || !depthTileDirty)
+        {
+            LOG_ERROR("Failed to allocate the depth buffer");
+            pdFree(depthBuffer);
+            pdFree(depthTileMin);
+            pdFree(depthTileMax);
+            pdFree(depthTileDirty);
+            depthBuffer = NULL;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int clearDepthBuffer(void)
+{
+    if (prepareDepthBuffer() != 0)
+    {
+        return 1;
+    }
+
+    memset(depthBuffer, 0, displayWidth * displayHeight * sizeof(uint16_t));
+    memset(depthTileMin, 0, depthTileColumns * depthTileRows * sizeof(uint16_t));
+    memset(depthTileMax, 0, depthTileColumns * depthTileRows * sizeof(uint16_t));
+    memset(depthTileDirty, 0, depthTileColumns * depthTileRows);
+    return 0;
+}
+
+/* Mark pixels of a row as covered and keep the row counters up to date */
+static void addRowCoverage(int y, int count)
+{
+    coverageRowCount[y] += count;
+    if (coverageRowCount[y] == displayWidth)
+    {
+        coverageFullRows++;
+    }
+}
+
+/* Fill the uncovered pixels of a span and mark them as covered */
+static void fillSpanCoverage(int y, int xStart, int xEnd, const SpanShade* shade)
+{
+    if (coverageRowCount[y] == displayWidth)
+    {
+        return;
+    }
+
+    uint8_t* row = frameBuffer + y * displayRowBytes;
+    uint8_t* coverage = coverageBuffer + y * displayRowBytes;
+    int covered = 0;
+
+    for (int byteIndex = xStart >> 3; byteIndex <= xEnd >> 3; byteIndex++)
+    {
+        uint8_t mask = spanByteMask(byteIndex, xStart, xEnd) & ~coverage[byteIndex];
+        if (mask)
+        {
+            coverage[byteIndex] |= mask;
+            writePatternByte(&row[byteIndex], mask, spanShadeByte(shade, byteIndex));
+            covered += nibbleBitCount[mask & 0x0F] + nibbleBitCount[mask >> 4];
+        }
+    }
+
+    addRowCoverage(y, covered);
+}
+
+/* Check whether every pixel of a bounding box is already covered */
+static int isRegionCovered(int minX, int minY, int maxX, int maxY)
+{
+    for (int y = minY; y <= maxY; y++)
+    {
+        if (coverageRowCount[y] == displayWidth)
+        {
+            continue;
+        }
+
+        const uint8_t* coverage = coverageBuffer + y * displayRowBytes;
+        for (int byteIndex = minX >> 3; byteIndex <= maxX >> 3; byteIndex++)
+        {
+            uint8_t mask = spanByteMask(byteIndex, minX, maxX);
+            if ((coverage[byteIndex] & mask) != mask)
+            {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+void drawFilledTriangleCoverage(const Triangle2D* triangle, LCDSolidColor color)
+{
+    TriangleSetup setup;
+    if (!setupTriangle(triangle, &setup) ||
+        isRegionCovered(setup.minX, setup.yStart, setup.maxX, setup.yEnd))
+    {
+        return;
+    }
+
+    TriangleShade shade;
+    setupTriangleShade(triangle, &setup, color, &shade);
+
+    for (int scanlineY = setup.yStart; scanlineY <= setup.yEnd; scanlineY++)
+    {
+        int xStart, xEnd;
+        if (triangleRowSpan(&setup, scanlineY, &xStart, &xEnd))
+        {
+            SpanShade span;
+            triangleSpanShade(&shade, &setup, scanlineY, xStart, xEnd, &span);
+            fillSpanCoverage(scanlineY, xStart, xEnd, &span);
+        }
+    }
+}
+
+/* Draw a line only over uncovered pixels, marking them as covered */
+static void drawLineCoverage(int x0, int y0, int x1, int y1, LCDSolidColor color)
+{
+    int dx = abs(x1 - x0), sx = x0 < x1 ? 1 : -1;
+    int dy = -abs(y1 - y0), sy = y0 < y1 ? 1 : -1;
+    int err = dx + dy, e2;
+
+    for (;;)
+    {
+        if (x0 >= 0 && x0 < displayWidth && y0 >= 0 && y0 < displayHeight)
+        {
+            uint8_t* coverage = coverageBuffer + (y0 * displayRowBytes) + (x0 / 8);
+            uint8_t data = 0x80 >> (x0 % 8);
+            if (!(*coverage & data))
+            {
+                uint8_t* block = frameBuffer + (y0 * displayRowBytes) + (x0 / 8);
+                *block = color ? *block | data : *block & ~data;
+                *coverage |= data;
+                addRowCoverage(y0, 1);
+            }
+        }
+        if (x0 == x1 && y0 == y1) break;
+        e2 = 2 * err;
+        if (e2 >= dy)
+        {
+            err += dy;
+            x0 += sx;
+        }
+        if (e2 <= dx)
+        {
+            err += dx;
+            y0 += sy;
+        }
+    }
+}
+
+void drawTriangleCoverage(const Triangle2D* triangle, LCDSolidColor color)
+{
+    for (int i = 0; i < 3; i++)
+    {
+        int j = (i + 1) % 3;
+        drawLineCoverage(
+            (int)triangle->points[i].x, (int)triangle->points[i].y,
+            (int)triangle->points[j].x, (int)triangle->points[j].y,
+            color);
+    }
+}
+
+int isFrameCovered(void)
+{
+    return coverageFullRows == displayHeight;
+}
+
+int prepareCoverageBuffer(void)
+{
+    if (coverageBuffer == NULL)
+    {
+        memoryPushTag(kMemoryTagFrame);
+        coverageBuffer = (uint8_t*)pdMalloc(displayRowBytes * displayHeight);
+        coverageRowCount = (int16_t*)pdMalloc(displayHeight * sizeof(int16_t));
+        memoryPopTag();
+        if (!coverageBuffer || !coverageRowCount)
+        {
+            LOG_ERROR("Failed to allocate the coverage buffer");
+            pdFree(coverageBuffer);
+            pdFree(coverageRowCount);
+            coverageBuffer = NULL;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int clearCoverageBuffer(void)
+{
+    if (prepareCoverageBuffer() != 0)
+    {
+        return 1;
+    }
+
+    memset(coverageBuffer, 0, displayRowBytes * displayHeight);
+    memset(coverageRowCount, 0, displayHeight * sizeof(int16_t));
+    coverageFullRows = 0;
+    return 0;
+}
+
+int prepareIntensityBuffer(void)
+{
+    if (intensityBuffer == NULL)
+    {
+        intensityRowBytes = ((displayWidth + 7) >> 3) << 2;
+
+        memoryPushTag(kMemoryTagFrame);
+        intensityBuffer = (uint8_t*)pdMalloc(intensityRowBytes * displayHeight);
+        intensityMask = (uint8_t*)pdMalloc(displayRowBytes * displayHeight);
+        memoryPopTag();
+        if (!intensityBuffer || !intensityMask)
+        {
+            LOG_ERROR("Failed to allocate the intensity buffer");
+            pdFree(intensityBuffer);
+            pdFree(intensityMask);
+            intensityBuffer = NULL;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int beginDeferredShading(void)
+{
+    if (prepareIntensityBuffer() != 0)
+    {
+        return 1;
+    }
+
+    memset(intensityMask, 0, displayRowBytes * displayHeight);
+    deferredActive = 1;
+    return 0;
+}
+
+void resolveDeferredShading(void)
+{
+    if (!deferredActive)
+    {
+        return;
+    }
+    deferredActive = 0;
+
+    for (int y = 0; y < displayHeight; y++)
+    {
+        uint8_t* row = frameBuffer + y * displayRowBytes;
+        const uint8_t* mask = intensityMask + y * displayRowBytes;
+        const uint8_t* intensity = intensityBuffer + y * intensityRowBytes;
+        const uint8_t (*table)[256] = resolveTable[y & 7];
+
+        // Each byte of intensities holds two pixels, so four lookups dither a framebuffer byte
+        for (int byteIndex = 0; byteIndex < intensityRowBytes >> 2; byteIndex++, intensity += 4)
+        {
+            if (mask[byteIndex])
+            {
+                uint8_t bits = table[0][intensity[0]] | table[1][intensity[1]] |
+                    table[2][intensity[2]] | table[3][intensity[3]];
+                writePatternByte(&row[byteIndex], mask[byteIndex], bits);
+            }
+        }
+    }
+}
+
+void drawRowMasked(int y, const uint8_t* data, const uint8_t* mask)
+{
+    if (y < 0 || y >= displayHeight)
+    {
+        return;
+    }
+
+    uint8_t* row = frameBuffer + y * displayRowBytes;
+    for (int byteIndex = 0; byteIndex < displayRowBytes; byteIndex++)
+    {
+        if (mask[byteIndex])
+        {
+            row[byteIndex] = (row[byteIndex] & ~mask[byteIndex]) | (data[byteIndex] & mask[byteIndex]);
+        }
+    }
+}
+
 void drawRect(int x, int y, int width, int height, LCDSolidColor color)
 {
     for (int j = y; j < y + height; j++)
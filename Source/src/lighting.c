@@ -0,0 +1,63 @@
+#include "global.h"
+#include "lighting.h"
+
+ShadingMode shadingMode = kShadingFlat;
+
+/* Light from the upper left, slightly behind the camera */
+DirectionalLight sceneLight = {
+    .direction = { 0.57735027f, 0.57735027f, 0.57735027f },
+    .ambient = 0.2f,
+    .diffuse = 0.8f
+};
+
+void setLightDirection(Vector3D direction)
+{
+    sceneLight.direction = vector3DNormalize(direction);
+}
+
+Vector3D lightToMeshSpace(const Matrix3x4* modelToView)
+{
+    // The rotation part is orthonormal, its transpose takes view directions back to mesh space
+    Vector3D toward = vector3DMul(sceneLight.direction, -1.0f);
+    return (Vector3D){
+        modelToView->m[0][0] * toward.x + modelToView->m[1][0] * toward.y + modelToView->m[2][0] * toward.z,
+        modelToView->m[0][1] * toward.x + modelToView->m[1][1] * toward.y + modelToView->m[2][1] * toward.z,
+        modelToView->m[0][2] * toward.x + modelToView->m[1][2] * toward.y + modelToView->m[2][2] * toward.z
+    };
+}
+
+void buildMatcap(Matcap* matcap, const DirectionalLight* light, float specular, float shininess)
+{
+    // The camera looks down +z, so visible normals and the view vector point towards -z
+    Vector3D toward = vector3DMul(light->direction, -1.0f);
+    Vector3D halfway = vector3DNormalize(vector3DAdd(toward, (Vector3D){ 0.0f, 0.0f, -1.0f }));
+
+    for (int v = 0; v < MATCAP_SIZE; v++)
+    {
+        for (int u = 0; u < MATCAP_SIZE; u++)
+        {
+            // Point of the unit sphere seen through the cell, clamped to its silhouette
+            Vector3D normal = {
+                u * 2.0f / (MATCAP_SIZE - 1) - 1.0f,
+                v * 2.0f / (MATCAP_SIZE - 1) - 1.0f,
+                0.0f
+            };
+            float radius = vector3DLength(normal);
+            if (radius > 1.0f)
+            {
+                normal = vector3DDiv(normal, radius);
+            }
+            else
+            {
+                normal.z = -sqrtf(1.0f - radius * radius);
+            }
+
+            float lambert = vector3DDot(normal, toward);
+            float highlight = vector3DDot(normal, halfway);
+            float intensity = light->ambient +
+                (lambert > 0.0f ? light->diffuse * lambert : 0.0f) +
+                (lambert > 0.0f && highlight > 0.0f ? specular * powf(highlight, shininess) : 0.0f);
+            matcap->patterns[v][u] = lightPatternIndex(intensity);
+        }
+    }
+}
@@ -0,0 +1,212 @@
+#include "global.h"
+#include "lz.h"
+#include "memory.h"
+
+/* Number of entries of the match finder hash table */
+#define LZ_HASH_BITS 12
+#define LZ_HASH_SIZE (1 << LZ_HASH_BITS)
+
+/* A token nibble with this value is followed by extra length bytes */
+#define LZ_LENGTH_EXTENDED 15
+
+/* Hashes the four bytes at a position */
+static inline uint32_t hashBytes(const uint8_t* p)
+{
+    uint32_t value = (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+    return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* Writes the extra bytes of a length that did not fit in its token nibble */
+static int writeLength(uint8_t** out, const uint8_t* end, int length)
+{
+    length -= LZ_LENGTH_EXTENDED;
+    while (length >= 255)
+    {
+        if (*out >= end)
+        {
+            return 1;
+        }
+        *(*out)++ = 255;
+        length -= 255;
+    }
+    if (*out >= end)
+    {
+        return 1;
+    }
+    *(*out)++ = (uint8_t)length;
+    return 0;
+}
+
+/* Writes a run of literals followed by a match, or the literals alone if matchLength is 0 */
+static int writeSequence(uint8_t** out, const uint8_t* end, const uint8_t* literals, int literalLength,
+    int offset, int matchLength)
+{
+    if (*out >= end)
+    {
+        return 1;
+    }
+
+    int matchCode = matchLength > 0 ? matchLength - LZ_MIN_MATCH : 0;
+    uint8_t* token = (*out)++;
+    *token = (uint8_t)(((literalLength < LZ_LENGTH_EXTENDED ? literalLength : LZ_LENGTH_EXTENDED) << 4) |
+        (matchCode < LZ_LENGTH_EXTENDED ? matchCode : LZ_LENGTH_EXTENDED));
+
+    if (literalLength >= LZ_LENGTH_EXTENDED && writeLength(out, end, literalLength) != 0)
+    {
+        return 1;
+    }
+    if (end - *out < literalLength)
+    {
+        return 1;
+    }
+    memcpy(*out, literals, literalLength);
+    *out += literalLength;
+
+    if (matchLength == 0)
+    {
+        return 0;
+    }
+    if (end - *out < 2)
+    {
+        return 1;
+    }
+    *(*out)++ = (uint8_t)(offset & 0xFF);
+    *(*out)++ = (uint8_t)(offset >> 8);
+    if (matchCode >= LZ_LENGTH_EXTENDED && writeLength(out, end, matchCode) != 0)
+    {
+        return 1;
+    }
+    return 0;
+}
+
+int lzCompress(const uint8_t* src, int srcSize, uint8_t* dst, int dstCapacity)
+{
+    // Positions are stored plus one so that zero marks an empty entry
+    uint32_t* table = (uint32_t*)pdCalloc(LZ_HASH_SIZE, sizeof(uint32_t));
+    if (!table)
+    {
+        return 0;
+    }
+
+    uint8_t* out = dst;
+    const uint8_t* end = dst + dstCapacity;
+    int anchor = 0;
+    int position = 0;
+    int failed = 0;
+
+    while (position + LZ_MIN_MATCH <= srcSize && !failed)
+    {
+        uint32_t hash = hashBytes(src + position);
+        int candidate = (int)table[hash] - 1;
+        table[hash] = (uint32_t)position + 1;
+
+        if (candidate < 0 || position - candidate > LZ_MAX_OFFSET ||
+            memcmp(src + candidate, src + position, LZ_MIN_MATCH) != 0)
+        {
+            position++;
+            continue;
+        }
+
+        int length = LZ_MIN_MATCH;
+        while (position + length < srcSize && src[candidate + length] == src[position + length])
+        {
+            length++;
+        }
+
+        failed = writeSequence(&out, end, src + anchor, position - anchor, position - candidate, length);
+        position += length;
+        anchor = position;
+    }
+
+    // The block ends with the bytes left after the last match
+    if (!failed && anchor < srcSize)
+    {
+        failed = writeSequence(&out, end, src + anchor, srcSize - anchor, 0, 0);
+    }
+
+    pdFree(table);
+    return failed ? 0 : (int)(out - dst);
+}
+
+/* Reads the extra bytes of a length, returns -1 past the end of the input */
+static int readLength(const uint8_t** in, const uint8_t* end, int length)
+{
+    uint8_t byte;
+    do
+    {
+        if (*in >= end)
+        {
+            return -1;
+        }
+        byte = *(*in)++;
+        length += byte;
+    } while (byte == 255);
+    return length;
+}
+
+int lzDecompress(const uint8_t* src, int srcSize, uint8_t* dst, int dstSize)
+{
+    const uint8_t* in = src;
+    const uint8_t* inEnd = src + srcSize;
+    uint8_t* out = dst;
+    uint8_t* outEnd = dst + dstSize;
+
+    while (out < outEnd)
+    {
+        if (in >= inEnd)
+        {
+            return 1;
+        }
+        uint8_t token = *in++;
+
+        int literalLength = token >> 4;
+        if (literalLength == LZ_LENGTH_EXTENDED)
+        {
+            literalLength = readLength(&in, inEnd, literalLength);
+        }
+        if (literalLength < 0 || inEnd - in < literalLength || outEnd - out < literalLength)
+        {
+            return 1;
+        }
+        memcpy(out, in, literalLength);
+        in += literalLength;
+        out += literalLength;
+
+        // Only the last sequence of a block has no match
+        if (out == outEnd)
+        {
+            break;
+        }
+
+        if (inEnd - in < 2)
+        {
+            return 1;
+        }
+        int offset = in[0] | (in[1] << 8);
+        in += 2;
+        int matchLength = token & 0x0F;
+        if (matchLength == LZ_LENGTH_EXTENDED)
+        {
+            matchLength = readLength(&in, inEnd, matchLength);
+        }
+        if (matchLength < 0 || offset == 0 || offset > out - dst)
+        {
+            return 1;
+        }
+        matchLength += LZ_MIN_MATCH;
+        if (outEnd - out < matchLength)
+        {
+            return 1;
+        }
+
+        // Matches may overlap their own output, so they are copied byte by byte
+        const uint8_t* match = out - offset;
+        for (int i = 0; i < matchLength; i++)
+        {
+            out[i] = match[i];
+        }
+        out += matchLength;
+    }
+
+    return 0;
+}
@@ -6,66 +6,394 @@
 
 #include "pd_api.h"
 #include "memory.h"
-#define STBDS_REALLOC(c,p,s) pdRealloc(p,s)
-#define STBDS_FREE(c,p)      pdFree(p)
-#define STB_DS_IMPLEMENTATION
-#include "stb_ds.h"
-
 #include "mesh.h"
+#include "meshcache.h"
 #include "display.h"
 #include "vector.h"
+#include "matrix.h"
+#include "lighting.h"
+#include "bsp.h"
+#include "scanline.h"
+#include "texture.h"
+
+// The implementation must come after every header that includes stb_ds.h
+#define STB_DS_IMPLEMENTATION
+#include "stb_ds.h"
 
 #define SCREEN_WIDTH 400
 #define SCREEN_HEIGHT 240
 #define MAX_VERTICES 1000
+#define MESH_DISTANCE 5.f
+#define N_CUBE_INSTANCES 3
+#define MAX_INSTANCES 64
+#define FRAME_ARENA_SIZE (512 * 1024) /* Initial size, grown to the scene as meshes are placed */
+#define STREAMED_MESH_PATH "assets/obj/model.obj"
+#define PROP_MESH_PATH "assets/obj/prop.pdz" /* Written by meshconv --quantize --compress */
+#define N_PROP_INSTANCES 4
+#define MESH_LOAD_BUDGET 0.010f /* Seconds of each frame spent loading meshes */
+#define LOADING_BAR_WIDTH 200
+#define LOADING_BAR_HEIGHT 6
+#define GLOSSY_SPECULAR 0.6f
+#define GLOSSY_SHININESS 24.0f
+#define CHECKER_TEXTURE_SIZE 32
+#define CHECKER_SHIFT 3 /* Checks are 8x8 texels */
 
 /* Playdate API instance */
 PlaydateAPI* pd = NULL;
 
+/* Transient render data, reset at the start of every frame */
+MemoryArena frameArena;
+
 /* Playdate Font */
 const char* fontpath = "/System/Fonts/Asheville-Sans-14-Bold.pft";
 LCDFont* font = NULL;
 
 /* Mesh to be loaded from file */
 static Mesh* mesh = NULL;
+
+/* Load of the streamed mesh in progress, NULL when idle */
+static MeshLoader* meshLoader = NULL;
+
+/* Streamed mesh once loaded, NULL until then */
+static Mesh* streamedMesh = NULL;
+
+/* Prop shared through the mesh cache, acquired once per instance placed */
+static const Mesh* propMesh = NULL;
+static int propReferences = 0;
+
+/* Glossy material of the streamed mesh, baked from the scene light */
+static Matcap glossyMatcap;
+
+/* 4-bit checkerboard mapped on the streamed mesh if it has texture coordinates */
+static Texture* checkerTexture = NULL;
+
+/* System menu option selecting the shading mode, in ShadingMode order */
+static PDMenuItem* shadingMenuItem = NULL;
+static const char* shadingModeNames[] = { "none", "flat", "smooth" };
+
+/* System menu option shading the filled triangles into an intensity buffer, dithered once per frame */
+static PDMenuItem* deferredMenuItem = NULL;
+static int deferredShading = 0;
+
+/* System menu option filling the sorted solid triangles by edge flagging instead of span setup */
+static PDMenuItem* edgeFlagMenuItem = NULL;
+static int edgeFlagFill = 0;
+
+/* Instances of the meshes placed in the scene */
+static MemoryPool instancePool;
 static float rotationX = 0.02f, rotationY = 0.02f, rotationZ = 0.04f;
 
 /* Camera position and cube rotation angles */
 Vector3D cameraPosition = { .x = 0.f, .y = 0.f, .z = 0.f };
 float fovFactor = 256.f;
 
-/* Array of triangles that should be rendered frame by frame */
+/* Array of triangles that should be rendered frame by frame, allocated from the frame arena */
 Triangle2D* trianglesToRender = NULL;
+static int numTrianglesToRender = 0;
+static int maxTrianglesToRender = 0;
+
+/**
+ * @brief View-space depth range of a mesh instance and its run of triangles.
+ */
+typedef struct
+{
+    MeshInstance* instance;
+    Matrix3x4 transform; /* Model-to-view transformation of the instance */
+    float depth;        /* Depth of the bounding sphere center */
+    float nearDepth;    /* Depth of the nearest point of the bounding sphere */
+    float farDepth;     /* Depth of the farthest point of the bounding sphere */
+    int firstTriangle;  /* Index of the first triangle of the object in trianglesToRender */
+    int triangleCount;  /* Number of triangles of the object in trianglesToRender */
+} ObjectDepth;
+
+/**
+ * @brief Shading inputs of a mesh instance, prepared once before its faces are processed.
+ */
+typedef struct
+{
+    const Matrix3x4* modelToView;   /* Rotates mesh-space normals into view space for matcaps */
+    Vector3D towardLight;           /* Direction towards the scene light in mesh space */
+    const uint8_t* vertexLevels;    /* Dither level of each vertex when smooth shaded, NULL otherwise */
+} InstanceShading;
+
+/* Objects of the current frame, sorted back to front */
+static ObjectDepth* objectsToRender = NULL;
+static int numObjectsToRender = 0;
+
+/* Scratch array used to merge the triangles of overlapping objects, allocated on first merge */
+static Triangle2D* mergeBuffer = NULL;
+static int mergeBufferSize = 0;     /* Triangles of the largest object rendered this frame */
+
+/* Objects left out of the frame because the arena could not hold them, to only report changes */
+static int droppedObjects = 0;
 
 static void initialize(void);
 static int update(void* userdata);
 
-/* Compare function for qsort to sort triangles by average depth */
+/* Compare function for qsort to sort triangles back to front by average depth */
 int triangleAvgDepthCompare(const void* a, const void* b)
 {
     const Triangle2D* triangleA = (const Triangle2D*)a;
     const Triangle2D* triangleB = (const Triangle2D*)b;
 
-    if (triangleA->avgDepth < triangleB->avgDepth) return -1;
-    if (triangleA->avgDepth > triangleB->avgDepth) return 1;
+    if (triangleA->avgDepth > triangleB->avgDepth) return -1;
+    if (triangleA->avgDepth < triangleB->avgDepth) return 1;
+    return 0;
+}
+
+/* Compare function for qsort to sort objects back to front by bounding sphere depth */
+int objectDepthCompare(const void* a, const void* b)
+{
+    const ObjectDepth* objectA = (const ObjectDepth*)a;
+    const ObjectDepth* objectB = (const ObjectDepth*)b;
+
+    if (objectA->depth > objectB->depth) return -1;
+    if (objectA->depth < objectB->depth) return 1;
     return 0;
 }
 
+/* Apply the shading mode picked in the system menu */
+static void shadingMenuChanged(void* userdata)
+{
+    (void)userdata;
+    shadingMode = (ShadingMode)pd->system->getMenuItemValue(shadingMenuItem);
+}
+
+/* Apply the deferred shading option picked in the system menu */
+static void deferredMenuChanged(void* userdata)
+{
+    (void)userdata;
+    deferredShading = pd->system->getMenuItemValue(deferredMenuItem);
+}
+
+/* Apply the edge flag fill option picked in the system menu */
+static void edgeFlagMenuChanged(void* userdata)
+{
+    (void)userdata;
+    edgeFlagFill = pd->system->getMenuItemValue(edgeFlagMenuItem);
+}
+
+/* Frame arena bytes of a mesh instance with every face visible, the merge buffer aside */
+static size_t instanceFrameBytes(const Mesh* mesh, int scanline)
+{
+    int faceCount = meshFaceCount(mesh);
+    int vertexCount = meshVertexCount(mesh);
+
+    // Triangles, view-space vertices, smooth levels and BSP face order, each padded to the alignment
+    size_t bytes = faceCount * (sizeof(Triangle2D) + sizeof(int)) + vertexCount * (sizeof(Vector3D) + 1) +
+        4 * MEMORY_ARENA_ALIGNMENT;
+    return scanline ? bytes + scanlineFrameBytes(faceCount) : bytes;
+}
+
+/* Frame arena bytes of the whole scene with every face visible */
+static size_t sceneFrameBytes(int scanline)
+{
+    size_t bytes = MAX_INSTANCES * sizeof(ObjectDepth) + 2 * MEMORY_ARENA_ALIGNMENT;
+    int largestFaceCount = 0;
+    for (int i = 0; i < instancePool.capacity; i++)
+    {
+        MeshInstance* instance = (MeshInstance*)poolAt(&instancePool, i);
+        if (instance != NULL)
+        {
+            int faceCount = meshFaceCount(instance->mesh);
+            bytes += instanceFrameBytes(instance->mesh, scanline);
+            largestFaceCount = faceCount > largestFaceCount ? faceCount : largestFaceCount;
+        }
+    }
+    return bytes + largestFaceCount * sizeof(Triangle2D);
+}
+
+/* Grow the frame arena to the worst case of the scene, so that frames never run out of it */
+static void reserveFrameArena(void)
+{
+    // The scanline tables more than double the need, without them only the scanline mode drops objects
+    size_t bytes = sceneFrameBytes(1);
+    memoryPushTag(kMemoryTagFrame);
+    if (arenaReserve(&frameArena, bytes) != 0)
+    {
+        arenaReserve(&frameArena, sceneFrameBytes(0));
+    }
+    memoryPopTag();
+    if (frameArena.capacity < bytes)
+    {
+        LOG_WARNING("Frame arena holds %zu bytes of the %zu needed, the farthest objects may be dropped",
+            frameArena.capacity, bytes);
+    }
+}
+
+/* Place a row of instances of the optional prop behind the cubes, all sharing one cached mesh */
+static void placeProps(void)
+{
+    FileStat stat;
+    if (pd->file->stat(PROP_MESH_PATH, &stat) != 0)
+    {
+        return;
+    }
+
+    for (int i = 0; i < N_PROP_INSTANCES; i++)
+    {
+        // Only the first acquire loads the file, the others add a reference
+        const Mesh* prop = meshCacheAcquire(PROP_MESH_PATH, 0);
+        if (prop == NULL)
+        {
+            return;
+        }
+        MeshInstance* instance = poolAllocType(&instancePool, MeshInstance);
+        if (instance == NULL)
+        {
+            meshCacheRelease(prop);
+            return;
+        }
+        propMesh = prop;
+        propReferences++;
+
+        // Far enough back for the whole row to fit the width of the screen
+        float radius = prop->boundsRadius;
+        float offset = i - (N_PROP_INSTANCES - 1) * 0.5f;
+        instance->mesh = prop;
+        instance->position = vector3DSub((Vector3D){ offset * 2.5f * radius, 2.5f, MESH_DISTANCE + 8.0f + 7.0f * radius },
+            prop->boundsCenter);
+    }
+}
+
 /* Application setup and initialization */
 void setup(void)
 {
     initDisplay();
 
+    shadingMenuItem = pd->system->addOptionsMenuItem("shading", shadingModeNames,
+        sizeof(shadingModeNames) / sizeof(shadingModeNames[0]), shadingMenuChanged, NULL);
+    if (shadingMenuItem != NULL)
+    {
+        pd->system->setMenuItemValue(shadingMenuItem, shadingMode);
+    }
+    deferredMenuItem = pd->system->addCheckmarkMenuItem("deferred", deferredShading, deferredMenuChanged, NULL);
+    edgeFlagMenuItem = pd->system->addCheckmarkMenuItem("edge flag", edgeFlagFill, edgeFlagMenuChanged, NULL);
+
+    memoryPushTag(kMemoryTagFrame);
+    int arenaFailed = arenaInit(&frameArena, FRAME_ARENA_SIZE);
+    memoryPopTag();
+    if (arenaFailed)
+    {
+        LOG_ERROR("Failed to reserve the frame arena");
+        return;
+    }
+
     renderMode = kRenderWireframe;
     cullingMode = kCullingBackface;
+    depthMode = kDepthSort;
 
+    memoryPushTag(kMemoryTagMesh);
     mesh = loadCubeMeshData();
-    /*mesh = loadOBJ("assets/obj/cube.obj");
-    if (mesh == NULL)
+    buildMeshBSP(mesh);
+    quantizeMesh(mesh);
+    memoryPopTag();
+
+    if (poolInit(&instancePool, sizeof(MeshInstance), MAX_INSTANCES) != 0)
     {
-        LOG_ERROR("Failed to load cube mesh");
+        LOG_ERROR("Failed to reserve the instance pool");
         return;
-    }*/
+    }
+
+    // Place a cube in front of the camera and the others behind it on each side
+    for (int i = 0; i < N_CUBE_INSTANCES; i++)
+    {
+        int offset = i - N_CUBE_INSTANCES / 2;
+        MeshInstance* instance = poolAllocType(&instancePool, MeshInstance);
+        if (instance == NULL)
+        {
+            break;
+        }
+        instance->mesh = mesh;
+        instance->position = (Vector3D){ offset * 3.5f, 0.0f, offset == 0 ? MESH_DISTANCE : MESH_DISTANCE + 4.0f };
+    }
+    placeProps();
+    reserveFrameArena();
+
+    buildMatcap(&glossyMatcap, &sceneLight, GLOSSY_SPECULAR, GLOSSY_SHININESS);
+
+    // Light checks fade from grey to white down each check so that the 4-bit texels show
+    checkerTexture = createTexture(CHECKER_TEXTURE_SIZE, CHECKER_TEXTURE_SIZE, kTextureFormat4Bit);
+    for (int y = 0; checkerTexture != NULL && y < CHECKER_TEXTURE_SIZE; y++)
+    {
+        for (int x = 0; x < CHECKER_TEXTURE_SIZE; x++)
+        {
+            int light = ((x >> CHECKER_SHIFT) + (y >> CHECKER_SHIFT)) & 1;
+            textureSetTexel(checkerTexture, x, y, light ? (uint8_t)(8 + (y & 7)) : 2);
+        }
+    }
+    if (checkerTexture != NULL)
+    {
+        buildTextureMipmaps(checkerTexture);
+    }
+
+    // The optional model is streamed in over the next frames while the cubes keep spinning
+    FileStat stat;
+    if (pd->file->stat(STREAMED_MESH_PATH, &stat) == 0)
+    {
+        meshLoader = meshLoaderOpen(STREAMED_MESH_PATH, kMeshLoadWeld | kMeshLoadOptimize);
+    }
+}
+
+/* Advance the streamed mesh load and place the mesh in the scene once it is done */
+void updateMeshLoading(void)
+{
+    if (meshLoader == NULL)
+    {
+        return;
+    }
+
+    memoryPushTag(kMemoryTagMesh);
+    MeshLoaderState state = meshLoaderStep(meshLoader, MESH_LOAD_BUDGET);
+    memoryPopTag();
+    if (state < kMeshLoaderDone)
+    {
+        return;
+    }
+
+    Mesh* loaded = meshLoaderFinish(meshLoader);
+    meshLoader = NULL;
+    if (loaded == NULL)
+    {
+        LOG_ERROR("Failed to load %s", STREAMED_MESH_PATH);
+        return;
+    }
+    streamedMesh = loaded;
+
+    // The model is shaded as a glossy material, the cubes keep the scene light
+    loaded->matcap = &glossyMatcap;
+    if (loaded->uvs != NULL)
+    {
+        loaded->texture = checkerTexture;
+    }
+
+    // Place the model above the cubes, centered on its bounding sphere
+    MeshInstance* instance = poolAllocType(&instancePool, MeshInstance);
+    if (instance == NULL)
+    {
+        return;
+    }
+    instance->mesh = loaded;
+    instance->position = vector3DSub((Vector3D){ 0.0f, -3.0f, MESH_DISTANCE + 4.0f + loaded->boundsRadius },
+        loaded->boundsCenter);
+
+    // Called right after the arena is reset, nothing is allocated from it yet
+    reserveFrameArena();
+}
+
+/* Draw the progress of the streamed mesh load */
+void drawLoadingProgress(void)
+{
+    if (meshLoader == NULL)
+    {
+        return;
+    }
+
+    int width = (int)(meshLoaderProgress(meshLoader) * LOADING_BAR_WIDTH);
+    int x = (SCREEN_WIDTH - LOADING_BAR_WIDTH) / 2;
+    int y = SCREEN_HEIGHT - 2 * LOADING_BAR_HEIGHT;
+    pd->graphics->drawRect(x, y, LOADING_BAR_WIDTH, LOADING_BAR_HEIGHT, kColorWhite);
+    pd->graphics->fillRect(x, y, width, LOADING_BAR_HEIGHT, kColorWhite);
 }
 
 /* Process input from the user */
@@ -121,6 +449,24 @@ void processInput(void)
 			cullingMode++;
 		}
 	}
+
+    if (released & kButtonA)
+    {
+        if (depthMode == kDepthScanline)
+        {
+            depthMode = kDepthSort;
+        }
+        else
+        {
+            depthMode++;
+        }
+    }
+
+    if (released & kButtonB)
+    {
+        memoryLogStats();
+        meshCacheLogStats();
+    }
 }
 
 /* Project a 3D point to 2D space */
@@ -130,101 +476,393 @@ Vector2D project(Vector3D point)
                         .y = (fovFactor * point.y) / point.z };
 }
 
-void gameUpdate(void)
+/* Build the transformation from the local space of a mesh instance into view space */
+Matrix3x4 instanceToViewSpace(const MeshInstance* instance)
+{
+    // Rotate around X, then Y, then Z, then translate relative to the camera
+    Matrix3x4 rotationX = matrixRotationX(instance->rotation.x);
+    Matrix3x4 rotationY = matrixRotationY(instance->rotation.y);
+    Matrix3x4 rotationZ = matrixRotationZ(instance->rotation.z);
+    Matrix3x4 transform = matrixMul(&rotationY, &rotationX);
+    transform = matrixMul(&rotationZ, &transform);
+    transform.m[0][3] = instance->position.x;
+    transform.m[1][3] = instance->position.y;
+    transform.m[2][3] = instance->position.z;
+    return transform;
+}
+
+/* Convert the camera position into the local space of a mesh instance */
+Vector3D cameraToMeshSpace(const MeshInstance* instance)
+{
+    // Undo the instance translation and rotations in reverse order
+    Vector3D eye = vector3DSub(cameraPosition, instance->position);
+    eye = vector3DRotateZ(eye, -instance->rotation.z);
+    eye = vector3DRotateY(eye, -instance->rotation.y);
+    eye = vector3DRotateX(eye, -instance->rotation.x);
+    return eye;
+}
+
+/* Cull, shade and project a face whose vertices are already in view space into the triangles to render */
+void processMeshFace(const Mesh* mesh, int faceIndex, const Vector3D* viewVertices, const InstanceShading* shading)
 {
-    // Update cube rotation angles
-    mesh->rotation.x += rotationX;
-    mesh->rotation.y += rotationY;
-    mesh->rotation.z += rotationZ;
+    if (numTrianglesToRender == maxTrianglesToRender)
+    {
+        return;
+    }
+
+    // Get the transformed vertices that make up the current face
+    Face meshFace = meshGetFace(mesh, faceIndex);
+    Vector3D transformedVertices[3];
+    transformedVertices[0] = viewVertices[meshFace.a];
+    transformedVertices[1] = viewVertices[meshFace.b];
+    transformedVertices[2] = viewVertices[meshFace.c];
+
+    if (cullingMode == kCullingBackface)
+    {
+        // Check backface culling
+        Vector3D vectorA = transformedVertices[0]; /*   A   */
+        Vector3D vectorB = transformedVertices[1]; /*  / \  */
+        Vector3D vectorC = transformedVertices[2]; /* C---B */
+
+        // Get the vector subtraction of B-A and C-A
+        Vector3D vectorAB = vector3DSub(vectorB, vectorA);
+        Vector3D vectorAC = vector3DSub(vectorC, vectorA);
+        vectorAB = vector3DNormalize(vectorAB);
+        vectorAC = vector3DNormalize(vectorAC);
+
+        // Compute the face normal (using cross product to find perpendicular)
+        Vector3D normal = vector3DCross(vectorAB, vectorAC);
+        normal = vector3DNormalize(normal);
+
+        // Find the vector between a point in the triangle and the camera origin
+        Vector3D cameraRay = vector3DSub(cameraPosition, vectorA);
+
+        // Calculate how aligned the camera ray is with the face normal (using dot product)
+        float dotNormalCamera = vector3DDot(normal, cameraRay);
+
+        // Bypass the triangles that are looking away from the camera
+        if (dotNormalCamera < 0)
+        {
+            return;
+        }
+    }
 
-    // Process each face of the mesh (cube)
-    for (int i = 0; i < arrlen(mesh->faces); i++)
+    // Flat shading costs one dot product per visible face, the light is already in mesh space
+    // Baked meshes already hold their light in the face patterns
+    uint8_t pattern = meshFace.pattern;
+    if (shadingMode == kShadingFlat && mesh->faceNormals && mesh->bakedLevels == NULL)
     {
-        // Get the vertices that make up the current face
-        Face meshFace = mesh->faces[i];
-        Vector3D faceVertices[3];
-        faceVertices[0] = mesh->vertices[meshFace.a - 1];
-        faceVertices[1] = mesh->vertices[meshFace.b - 1];
-        faceVertices[2] = mesh->vertices[meshFace.c - 1];
+        Vector3D normal = mesh->faceNormals[faceIndex];
+        pattern = mesh->matcap != NULL
+            ? matcapPatternIndex(mesh->matcap, matrixTransformDirection(shading->modelToView, normal))
+            : lightPatternIndex(lightIntensity(normal, shading->towardLight));
+    }
+
+    Vector2D projectedPoints[3];
+
+    for (int j = 0; j < 3; j++)
+    {
+        // Project the current vertex
+        projectedPoints[j] = project(transformedVertices[j]);
+
+        // Scale and translate the projected points to the middle of the screen
+        projectedPoints[j].x += (pd->display->getWidth() * 0.5f);
+        projectedPoints[j].y += (pd->display->getHeight() * 0.5f);
+
+    }
+
+    Triangle2D projectedTriangle = {
+        .points = {
+            { projectedPoints[0].x, projectedPoints[0].y },
+            { projectedPoints[1].x, projectedPoints[1].y },
+            { projectedPoints[2].x, projectedPoints[2].y }
+        },
+        .depths = { transformedVertices[0].z, transformedVertices[1].z, transformedVertices[2].z },
+        .pattern = ditheringPatterns[pattern],
+        .avgDepth = (transformedVertices[0].z + transformedVertices[1].z + transformedVertices[2].z) / 3
+    };
+    if (shading->vertexLevels)
+    {
+        projectedTriangle.levels[0] = shading->vertexLevels[meshFace.a];
+        projectedTriangle.levels[1] = shading->vertexLevels[meshFace.b];
+        projectedTriangle.levels[2] = shading->vertexLevels[meshFace.c];
+        projectedTriangle.smooth = 1;
+    }
 
-        Vector3D transformedVertices[3];
+    // Texture coordinates are scaled to texels, v grows upwards in OBJ files and texel rows downwards
+    if (mesh->texture && meshFace.uva >= 0 && meshFace.uvb >= 0 && meshFace.uvc >= 0)
+    {
+        Vector2D uvs[3] = { mesh->uvs[meshFace.uva], mesh->uvs[meshFace.uvb], mesh->uvs[meshFace.uvc] };
+
+        // The mip level follows the texels covered per pixel over the whole triangle
+        Vector2D uvAB = vector2DSub(uvs[1], uvs[0]);
+        Vector2D uvAC = vector2DSub(uvs[2], uvs[0]);
+        Vector2D screenAB = vector2DSub(projectedPoints[1], projectedPoints[0]);
+        Vector2D screenAC = vector2DSub(projectedPoints[2], projectedPoints[0]);
+        float texelArea = (uvAB.x * uvAC.y - uvAC.x * uvAB.y) * mesh->texture->width * mesh->texture->height;
+        float pixelArea = screenAB.x * screenAC.y - screenAC.x * screenAB.y;
+        const Texture* texture = textureMipLevel(mesh->texture, texelArea, pixelArea);
 
-        // Process each vertex of the face
         for (int j = 0; j < 3; j++)
         {
-            Vector3D transformedVertex = faceVertices[j];
+            projectedTriangle.uvs[j] = (Vector2D){ uvs[j].x * texture->width, (1.0f - uvs[j].y) * texture->height };
+        }
+        projectedTriangle.texture = texture;
+    }
+
+    // Save the projected triangle in the array of triangles to render
+    trianglesToRender[numTrianglesToRender++] = projectedTriangle;
+}
 
-            // Apply rotation transformations
-            transformedVertex = vector3DRotateX(transformedVertex, mesh->rotation.x);
-            transformedVertex = vector3DRotateY(transformedVertex, mesh->rotation.y);
-            transformedVertex = vector3DRotateZ(transformedVertex, mesh->rotation.z);
+/* Check whether the current depth mode relies on the triangles being sorted */
+int isSortedDepthMode(void)
+{
+    return depthMode == kDepthSort || depthMode == kDepthFrontToBack;
+}
+
+/* Queue the triangles of a mesh instance, in back-to-front order within the object */
+void processInstance(ObjectDepth* object)
+{
+    const MeshInstance* instance = object->instance;
+    const Mesh* mesh = instance->mesh;
+    int vertexCount = meshVertexCount(mesh);
+    int faceCount = meshFaceCount(mesh);
 
-            // Translate vertex relative to camera
-            transformedVertex.z += 5.f;
+    object->firstTriangle = numTrianglesToRender;
+    object->triangleCount = 0;
 
-            // Save transformed vertex in the array of transformed vertices
-            transformedVertices[j] = transformedVertex;
+    // Transform each vertex once, faces then share the results
+    Vector3D* viewVertices = (Vector3D*)arenaAlloc(&frameArena, vertexCount * sizeof(Vector3D));
+    if (viewVertices == NULL)
+    {
+        return;
+    }
+    if (mesh->quantizedVertices)
+    {
+        // Dequantization is folded into the model matrix, the cost per vertex is unchanged
+        Matrix3x4 dequantize = matrixScaleTranslation(mesh->quantizationScale, mesh->quantizationOffset);
+        Matrix3x4 transform = matrixMul(&object->transform, &dequantize);
+        for (int i = 0; i < vertexCount; i++)
+        {
+            QuantizedVertex v = mesh->quantizedVertices[i];
+            viewVertices[i] = matrixTransformPoint(&transform, v.x, v.y, v.z);
         }
+    }
+    else
+    {
+        for (int i = 0; i < vertexCount; i++)
+        {
+            Vector3D v = mesh->vertices[i];
+            viewVertices[i] = matrixTransformPoint(&object->transform, v.x, v.y, v.z);
+        }
+    }
 
-        if (cullingMode == kCullingBackface)
+    InstanceShading shading = {
+        .modelToView = &object->transform,
+        .towardLight = lightToMeshSpace(&object->transform),
+        .vertexLevels = NULL
+    };
+
+    // Smooth shading lights each vertex once, faces then interpolate the levels of their vertices
+    if (shadingMode == kShadingGouraud && mesh->bakedLevels)
+    {
+        shading.vertexLevels = mesh->bakedLevels;
+    }
+    else if (shadingMode == kShadingGouraud && mesh->vertexNormals)
+    {
+        uint8_t* vertexLevels = (uint8_t*)arenaAlloc(&frameArena, vertexCount);
+        for (int i = 0; vertexLevels != NULL && i < vertexCount; i++)
         {
-            // Check backface culling
-            Vector3D vectorA = transformedVertices[0]; /*   A   */
-            Vector3D vectorB = transformedVertices[1]; /*  / \  */
-            Vector3D vectorC = transformedVertices[2]; /* C---B */
+            vertexLevels[i] = mesh->matcap != NULL
+                ? patternDitherLevel(matcapPatternIndex(mesh->matcap,
+                    matrixTransformDirection(&object->transform, mesh->vertexNormals[i])))
+                : lightDitherLevel(lightIntensity(mesh->vertexNormals[i], shading.towardLight));
+        }
+        shading.vertexLevels = vertexLevels;
+    }
 
-            // Get the vector subtraction of B-A and C-A
-            Vector3D vectorAB = vector3DSub(vectorB, vectorA);
-            Vector3D vectorAC = vector3DSub(vectorC, vectorA);
-            vectorAB = vector3DNormalize(vectorAB);
-            vectorAC = vector3DNormalize(vectorAC);
+    int* faceOrder = mesh->bspNodes != NULL ? (int*)arenaAlloc(&frameArena, faceCount * sizeof(int)) : NULL;
+    if (faceOrder != NULL)
+    {
+        // Walking the BSP tree from the camera yields the faces already in back-to-front order
+        faceCount = traverseMeshBSP(mesh, cameraToMeshSpace(instance), faceOrder);
+        for (int i = 0; i < faceCount; i++)
+        {
+            processMeshFace(mesh, faceOrder[i], viewVertices, &shading);
+        }
+    }
+    else
+    {
+        for (int i = 0; i < faceCount; i++)
+        {
+            processMeshFace(mesh, i, viewVertices, &shading);
+        }
+    }
 
-            // Compute the face normal (using cross product to find perpendicular)
-            Vector3D normal = vector3DCross(vectorAB, vectorAC);
-            normal = vector3DNormalize(normal);
+    object->triangleCount = numTrianglesToRender - object->firstTriangle;
 
-            // Find the vector between a point in the triangle and the camera origin
-            Vector3D cameraRay = vector3DSub(cameraPosition, vectorA);
+    // Visible faces of a convex mesh never overlap, any order is correct
+    int needsSort = isSortedDepthMode() && faceOrder == NULL &&
+        !(mesh->isConvex && cullingMode == kCullingBackface);
+    if (needsSort && object->triangleCount > 1)
+    {
+        qsort(trianglesToRender + object->firstTriangle, object->triangleCount, sizeof(Triangle2D), triangleAvgDepthCompare);
+    }
+}
 
-            // Calculate how aligned the camera ray is with the face normal (using dot product)
-            float dotNormalCamera = vector3DDot(normal, cameraRay);
+/* Merge two adjacent back-to-front runs of triangles, keeping the order inside each run */
+void mergeTriangleRuns(int first, int middle, int end)
+{
+    if (mergeBuffer == NULL)
+    {
+        mergeBuffer = (Triangle2D*)arenaAlloc(&frameArena, mergeBufferSize * sizeof(Triangle2D));
+        if (mergeBuffer == NULL)
+        {
+            return;
+        }
+    }
 
-            // Bypass the triangles that are looking away from the camera
-            if (dotNormalCamera < 0)
-            {
-                continue;
-            }
+    // Only the second run, the triangles of one object, is copied out, the runs are then merged from their end
+    int i = middle - 1, j = end - middle - 1, k = end - 1;
+    memcpy(mergeBuffer, trianglesToRender + middle, (end - middle) * sizeof(Triangle2D));
+    while (i >= first && j >= 0)
+    {
+        if (trianglesToRender[i].avgDepth < mergeBuffer[j].avgDepth)
+        {
+            trianglesToRender[k--] = trianglesToRender[i--];
+        }
+        else
+        {
+            trianglesToRender[k--] = mergeBuffer[j--];
         }
+    }
+    while (j >= 0) trianglesToRender[k--] = mergeBuffer[j--];
+}
 
-        Vector2D projectedPoints[3];
+void gameUpdate(void)
+{
+    int instanceCount = instancePool.count;
 
-        for (int j = 0; j < 3; j++)
+    maxTrianglesToRender = 0;
+    numTrianglesToRender = 0;
+    numObjectsToRender = 0;
+    mergeBuffer = NULL;
+    mergeBufferSize = 0;
+    objectsToRender = (ObjectDepth*)arenaAlloc(&frameArena, instanceCount * sizeof(ObjectDepth));
+    if (objectsToRender == NULL)
+    {
+        return;
+    }
+
+    for (int i = 0; i < instancePool.capacity; i++)
+    {
+        MeshInstance* instance = (MeshInstance*)poolAt(&instancePool, i);
+        if (instance == NULL)
         {
-            // Project the current vertex
-            projectedPoints[j] = project(transformedVertices[j]);
+            continue;
+        }
+
+        // Update cube rotation angles
+        instance->rotation.x += rotationX;
+        instance->rotation.y += rotationY;
+        instance->rotation.z += rotationZ;
+
+        // Get the depth range covered by the bounding sphere of the instance
+        Matrix3x4 transform = instanceToViewSpace(instance);
+        Vector3D boundsCenter = instance->mesh->boundsCenter;
+        Vector3D center = matrixTransformPoint(&transform, boundsCenter.x, boundsCenter.y, boundsCenter.z);
+        ObjectDepth object = {
+            .instance = instance,
+            .transform = transform,
+            .depth = center.z,
+            .nearDepth = center.z - instance->mesh->boundsRadius,
+            .farDepth = center.z + instance->mesh->boundsRadius
+        };
+        objectsToRender[numObjectsToRender++] = object;
+    }
 
-            // Scale and translate the projected points to the middle of the screen
-            projectedPoints[j].x += (pd->display->getWidth() * 0.5f);
-            projectedPoints[j].y += (pd->display->getHeight() * 0.5f);
+    /* Sort the objects back to front, triangles are then only sorted within each object */
+    qsort(objectsToRender, numObjectsToRender, sizeof(ObjectDepth), objectDepthCompare);
 
+    // Keep the nearest objects whose worst case fits in the arena, every face visible, the farthest ones are dropped
+    size_t available = frameArena.capacity - frameArena.used - 2 * MEMORY_ARENA_ALIGNMENT;
+    size_t needed = 0;
+    int kept = 0;
+    while (kept < numObjectsToRender)
+    {
+        const Mesh* mesh = objectsToRender[numObjectsToRender - 1 - kept].instance->mesh;
+        int faceCount = meshFaceCount(mesh);
+        int largestFaceCount = faceCount > mergeBufferSize ? faceCount : mergeBufferSize;
+        size_t bytes = needed + instanceFrameBytes(mesh, depthMode == kDepthScanline);
+        if (bytes + largestFaceCount * sizeof(Triangle2D) > available)
+        {
+            break;
+        }
+        needed = bytes;
+        mergeBufferSize = largestFaceCount;
+        maxTrianglesToRender += faceCount;
+        kept++;
+    }
+    if (kept < numObjectsToRender)
+    {
+        memmove(objectsToRender, objectsToRender + numObjectsToRender - kept, kept * sizeof(ObjectDepth));
+    }
+    if (numObjectsToRender - kept != droppedObjects)
+    {
+        droppedObjects = numObjectsToRender - kept;
+        if (droppedObjects > 0)
+        {
+            LOG_WARNING("%d objects do not fit in the %zu bytes of the frame arena", droppedObjects, frameArena.capacity);
         }
+    }
+    numObjectsToRender = kept;
 
-        Triangle2D projectedTriangle = {
-            .points = {
-                { projectedPoints[0].x, projectedPoints[0].y },
-                { projectedPoints[1].x, projectedPoints[1].y },
-                { projectedPoints[2].x, projectedPoints[2].y }
-            },
-			.pattern = meshFace.pattern,
-			.avgDepth = (transformedVertices[0].z + transformedVertices[1].z + transformedVertices[2].z) / 3
-        };
+    trianglesToRender = (Triangle2D*)arenaAlloc(&frameArena, maxTrianglesToRender * sizeof(Triangle2D));
+    if (trianglesToRender == NULL)
+    {
+        maxTrianglesToRender = 0;
+        numObjectsToRender = 0;
+        return;
+    }
+
+    int groupStart = 0;
+    float groupNearDepth = 0.0f;
+    for (int i = 0; i < numObjectsToRender; i++)
+    {
+        ObjectDepth* object = &objectsToRender[i];
+        processInstance(object);
 
-        // Save the projected triangle in the array of triangles to render
-        arrput(trianglesToRender, projectedTriangle);
+        if (isSortedDepthMode() && i > 0 && object->farDepth > groupNearDepth)
+        {
+            // The object overlaps the previous ones in depth, interleave their triangles
+            mergeTriangleRuns(groupStart, object->firstTriangle, object->firstTriangle + object->triangleCount);
+            groupNearDepth = fminf(groupNearDepth, object->nearDepth);
+        }
+        else
+        {
+            groupStart = object->firstTriangle;
+            groupNearDepth = object->nearDepth;
+        }
     }
+}
 
-    /* Sort the triangles to render by average depth */
-    qsort(trianglesToRender, arrlen(trianglesToRender), sizeof(Triangle2D), triangleAvgDepthCompare);
+/* Allocate the full-screen buffers of the selected modes, render() then only clears them */
+static void prepareRenderBuffers(void)
+{
+    int solid = renderMode == kRenderSolid || renderMode == kRenderSolidWireframe;
+    if (depthMode == kDepthZBuffer)
+    {
+        prepareDepthBuffer();
+    }
+    int coverage = depthMode == kDepthFrontToBack && solid && prepareCoverageBuffer() == 0;
+    if (deferredShading && !coverage && depthMode != kDepthScanline && solid)
+    {
+        prepareIntensityBuffer();
+    }
+    if (edgeFlagFill && renderMode == kRenderSolid && depthMode == kDepthSort)
+    {
+        prepareEdgeFlagBuffer();
+    }
 }
 
 void render(void)
@@ -232,22 +870,78 @@ void render(void)
     clearFramebuffer(kColorBlack);
     drawGrid(kColorWhite);
 
-    for (int i = 0; i < arrlen(trianglesToRender); i++)
+    // The depth buffer resolves visibility, triangles are left unsorted
+    int useDepthBuffer = depthMode == kDepthZBuffer && clearDepthBuffer() == 0;
+
+    // Walking the sorted triangles front to back, only uncovered pixels are written
+    int useCoverage = depthMode == kDepthFrontToBack &&
+        (renderMode == kRenderSolid || renderMode == kRenderSolidWireframe) &&
+        clearCoverageBuffer() == 0;
+
+    // Fills store intensities dithered in one pass at the end, depth-tested outlines then need the finished depth buffer
+    int useDeferred = deferredShading && !useCoverage && depthMode != kDepthScanline &&
+        (renderMode == kRenderSolid || renderMode == kRenderSolidWireframe) &&
+        beginDeferredShading() == 0;
+
+    // Solid fills without depth buffer or coverage toggle edge flags instead of walking spans
+    int useEdgeFlag = edgeFlagFill && renderMode == kRenderSolid && depthMode == kDepthSort &&
+        prepareEdgeFlagBuffer() == 0;
+
+    int triangleCount = numTrianglesToRender;
+
+    // The scanline renderer resolves visibility for the whole scene at once
+    if (depthMode == kDepthScanline && (renderMode == kRenderSolid || renderMode == kRenderSolidWireframe))
+    {
+        drawScanlineTriangles(trianglesToRender, triangleCount, renderMode == kRenderSolidWireframe);
+        triangleCount = 0;
+    }
+
+    for (int n = 0; n < triangleCount; n++)
     {
         // Extract vertices for the current triangle
+        int i = useCoverage ? triangleCount - 1 - n : n;
         Triangle2D triangle = trianglesToRender[i];
 
+        if (useCoverage)
+        {
+            if (isFrameCovered())
+            {
+                break;
+            }
+
+            // The outline goes first so that the fill keeps its pixels
+            if (renderMode == kRenderSolidWireframe)
+            {
+                drawTriangleCoverage(&triangle, kColorBlack);
+            }
+            drawFilledTriangleCoverage(&triangle, kColorWhite);
+            continue;
+        }
+
         if (renderMode == kRenderSolid || renderMode == kRenderSolidWireframe)
         {
             // Draw the triangle
-            drawFilledTriangle(
-                triangle.points[0].x, triangle.points[0].y,
-                triangle.points[1].x, triangle.points[1].y,
-                triangle.points[2].x, triangle.points[2].y,
-                kColorWhite);
+            if (useDepthBuffer)
+            {
+                drawFilledTriangleDepth(&triangle, kColorWhite);
+            }
+            else if (renderMode == kRenderSolidWireframe)
+            {
+                // The outline is written along with the fill, each pixel once
+                drawFilledTriangleOutline(&triangle, kColorWhite, kColorBlack);
+            }
+            else if (useEdgeFlag)
+            {
+                drawFilledTriangleEdgeFlag(&triangle, kColorWhite);
+            }
+            else
+            {
+                drawFilledTrianglePattern(&triangle, kColorWhite);
+            }
         }
         
-        if (renderMode == kRenderWireframe || renderMode == kRenderSolidWireframe || renderMode == kRenderWireframeVertex) 
+        if (renderMode == kRenderWireframe || renderMode == kRenderWireframeVertex ||
+            (renderMode == kRenderSolidWireframe && useDepthBuffer && !useDeferred))
         {
 			LCDColor color = kColorWhite;
             if (renderMode == kRenderSolidWireframe)
@@ -255,11 +949,18 @@ void render(void)
 				color = kColorBlack;
             }
 
-            drawTriangle(
-                triangle.points[0].x, triangle.points[0].y,
-                triangle.points[1].x, triangle.points[1].y,
-                triangle.points[2].x, triangle.points[2].y,
-                color);
+            if (useDepthBuffer && renderMode == kRenderSolidWireframe)
+            {
+                drawTriangleDepth(&triangle, color);
+            }
+            else
+            {
+                drawTriangle(
+                    triangle.points[0].x, triangle.points[0].y,
+                    triangle.points[1].x, triangle.points[1].y,
+                    triangle.points[2].x, triangle.points[2].y,
+                    color);
+            }
         }
 
 		if (renderMode == kRenderWireframeVertex)
@@ -270,15 +971,20 @@ void render(void)
 		}
     }
 
-    // Update the Playdate display
-    renderBuffer();
-
-    // Free the array of triangles to render
-    if (trianglesToRender != NULL)
+    if (useDeferred)
     {
-        arrfree(trianglesToRender);
-        trianglesToRender = NULL;
+        resolveDeferredShading();
+        if (renderMode == kRenderSolidWireframe && useDepthBuffer)
+        {
+            for (int n = 0; n < triangleCount; n++)
+            {
+                drawTriangleDepth(&trianglesToRender[n], kColorBlack);
+            }
+        }
     }
+
+    // Update the Playdate display
+    renderBuffer();
 }
 
 static void initialize(void)
@@ -288,11 +994,23 @@ static void initialize(void)
 
 static int update(void* userdata)
 {
+    // Everything allocated from the frame arena during the previous frame is released here
+    arenaReset(&frameArena);
+
+    // Streaming allocates by design, so it runs outside the steady-state accounting of the frame
+    updateMeshLoading();
+
+    // A mode switched on allocates its buffers once, before the frame is counted
     processInput();
+    prepareRenderBuffers();
+    memoryBeginFrame();
+
     gameUpdate();
     render();
 
+    drawLoadingProgress();
     pd->system->drawFPS(0, 0);
+    memoryEndFrame();
 
     return 1;
 }
@@ -315,15 +1033,40 @@ int eventHandler(PlaydateAPI* playdate, PDSystemEvent event, uint32_t arg)
             LOG_ERROR("Could not load font %s", fontpath);
             return 1; // Indicate an error occurred
         }
-        else if (event == kEventTerminate)
-        {
-            //free_mesh();
-            arrfree(trianglesToRender);
-        }
 
         initialize();
         pd->system->setUpdateCallback(update, pd);
     }
+    else if (event == kEventTerminate)
+    {
+        // Cancelling a load that is still running frees what it read so far
+        if (meshLoader != NULL)
+        {
+            meshLoaderFinish(meshLoader);
+            meshLoader = NULL;
+        }
+        if (streamedMesh != NULL)
+        {
+            freeMesh(streamedMesh);
+            streamedMesh = NULL;
+        }
+        if (mesh != NULL)
+        {
+            freeMesh(mesh);
+            mesh = NULL;
+        }
+        for (; propReferences > 0; propReferences--)
+        {
+            meshCacheRelease(propMesh);
+        }
+        propMesh = NULL;
+        meshCacheClear();
+        freeTexture(checkerTexture);
+        checkerTexture = NULL;
+        poolDestroy(&instancePool);
+        arenaFree(&frameArena);
+        memoryLogStats();
+    }
 
     return 0;
 }
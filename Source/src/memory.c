@@ -0,0 +1,126 @@
+#include "memory.h"
+
+/* Maximum nesting of memoryPushTag calls */
+#define MEMORY_TAG_STACK_SIZE 8
+
+#if MEMORY_TRACKING
+
+static const char* tagNames[kMemoryTagCount] = { "general", "mesh", "frame", "asset" };
+
+/* Accounting of every tracked allocation */
+static MemoryStats stats;
+
+/* Tags of the allocations currently being made, the top is applied to new blocks */
+static MemoryTag tagStack[MEMORY_TAG_STACK_SIZE];
+static int tagDepth = 0;
+
+/* Frame accounting, an allocation inside update() after warm-up is reported */
+static int frameIndex = 0;
+static int insideFrame = 0;
+
+void memoryPushTag(MemoryTag tag)
+{
+    if (tagDepth >= MEMORY_TAG_STACK_SIZE)
+    {
+        LOG_ERROR("Memory tag stack overflow");
+        return;
+    }
+    tagStack[tagDepth++] = tag;
+}
+
+void memoryPopTag(void)
+{
+    if (tagDepth > 0)
+    {
+        tagDepth--;
+    }
+}
+
+MemoryTag memoryCurrentTag(void)
+{
+    return tagDepth > 0 ? tagStack[tagDepth - 1] : kMemoryTagGeneral;
+}
+
+void memoryTrackAlloc(size_t size, MemoryTag tag)
+{
+    MemoryTagStats* tagStats = &stats.tags[tag];
+    tagStats->liveBytes += size;
+    tagStats->allocCount++;
+    if (tagStats->liveBytes > tagStats->peakBytes)
+    {
+        tagStats->peakBytes = tagStats->liveBytes;
+    }
+
+    stats.liveBytes += size;
+    if (stats.liveBytes > stats.peakBytes)
+    {
+        stats.peakBytes = stats.liveBytes;
+    }
+
+    if (insideFrame)
+    {
+        stats.frameAllocCount++;
+        stats.frameAllocBytes += size;
+
+        if (frameIndex >= MEMORY_WARMUP_FRAMES)
+        {
+            LOG_WARNING("Allocation of %zu bytes (%s) in frame %d", size, tagNames[tag], frameIndex);
+#if MEMORY_ASSERT_STEADY_STATE
+            pd->system->error("Heap allocation in steady state frame %d", frameIndex);
+#endif
+        }
+    }
+}
+
+void memoryTrackFree(size_t size, MemoryTag tag)
+{
+    stats.tags[tag].liveBytes -= size;
+    stats.tags[tag].freeCount++;
+    stats.liveBytes -= size;
+}
+
+#endif /* MEMORY_TRACKING */
+
+void memoryBeginFrame(void)
+{
+#if MEMORY_TRACKING
+    insideFrame = 1;
+    stats.frameAllocCount = 0;
+    stats.frameAllocBytes = 0;
+#endif
+}
+
+void memoryEndFrame(void)
+{
+#if MEMORY_TRACKING
+    insideFrame = 0;
+    frameIndex++;
+#endif
+}
+
+int memoryGetStats(MemoryStats* out)
+{
+#if MEMORY_TRACKING
+    *out = stats;
+    return 0;
+#else
+    memset(out, 0, sizeof(*out));
+    return 1;
+#endif
+}
+
+void memoryLogStats(void)
+{
+#if MEMORY_TRACKING
+    LOG_INFO("Heap: %zu bytes live, %zu bytes peak, %d allocations last frame",
+        stats.liveBytes, stats.peakBytes, stats.frameAllocCount);
+    for (int i = 0; i < kMemoryTagCount; i++)
+    {
+        const MemoryTagStats* tagStats = &stats.tags[i];
+        LOG_INFO("  %-8s %8zu live %8zu peak %6d allocs %6d frees", tagNames[i],
+            tagStats->liveBytes, tagStats->peakBytes, tagStats->allocCount, tagStats->freeCount);
+    }
+#else
+    LOG_INFO("Memory tracking is disabled, build with MEMORY_TRACKING=1");
+#endif
+}
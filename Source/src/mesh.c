@@ -1,79 +1,156 @@
 #include "global.h"
 #include "mesh.h"
+#include "meshopt.h"
+#include "bake.h"
+#include "lighting.h"
 #include "patterns.h"
 #include "logging.h"
 #include "memory.h"
+#include "reader.h"
 #include "stb_ds.h"
 
 /* Constants for cube mesh */
 #define N_CUBE_VERTICES 8
 #define N_CUBE_FACES (6 * 2) /* 6 cube faces, 2 triangles per face */
 
+/* Tolerance of the convexity test, relative to the mesh radius */
+#define MESH_CONVEX_EPSILON 0.0001f
+
+/* Upper bound of vertex/face plane tests done by the convexity check */
+#define MESH_CONVEX_MAX_TESTS 1000000L
+
+/* Maximum number of distinct o/g/usemtl names given their own pattern */
+#define OBJ_MAX_GROUPS 64
+
+/* Pattern of the faces of an OBJ file that precede any group */
+#define OBJ_DEFAULT_PATTERN 16
+
+/* Patterns given to the groups of an OBJ file in order of appearance */
+#define OBJ_GROUP_PATTERN_COUNT 8
+static const uint8_t objGroupPatterns[OBJ_GROUP_PATTERN_COUNT] = { 16, 12, 8, 4, 14, 10, 6, 2 };
+
+/* State of the OBJ parser across the lines of a file */
+typedef struct
+{
+    Mesh* mesh;
+    uint32_t groupHashes[OBJ_MAX_GROUPS]; /* Hashes of the group names seen so far */
+    int groupCount;
+    uint8_t pattern;    /* Pattern of the current group */
+} ObjParser;
+
+/* Number of lines parsed by a loader step between two reads of the clock */
+#define MESH_LOADER_LINES_PER_CHECK 32
+
+/* Identifier and version at the start of a binary mesh file */
+#define MESH_FILE_MAGIC 0x314D4450 /* "PDM1" */
+#define MESH_FILE_VERSION 4
+
+/* Space left in front of each array of a binary mesh for its stb_ds header */
+#define MESH_FILE_ARRAY_GAP 32
+
+/* Alignment of the arrays of a binary mesh */
+#define MESH_FILE_ALIGNMENT 8
+
+/* Arrays stored in a binary mesh file, in file order */
+enum
+{
+    kMeshArrayVertices,
+    kMeshArrayFaces,
+    kMeshArrayUVs,
+    kMeshArrayNormals,
+    kMeshArrayBSPNodes,
+    kMeshArrayQuantizedVertices,
+    kMeshArrayQuantizedFaces,
+    kMeshArrayFaceNormals,
+    kMeshArrayVertexNormals,
+    kMeshArrayBakedLevels,
+    kMeshArrayCount
+};
+
+/* Location of an array in a binary mesh file */
+typedef struct
+{
+    uint32_t offset;    /* Offset of the first element from the start of the file */
+    uint32_t count;     /* Number of elements */
+} MeshFileArray;
+
+/* Header of a binary mesh file */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t fileSize;
+    int32_t isConvex;
+    Vector3D boundsCenter;
+    float boundsRadius;
+    Vector3D quantizationScale;
+    Vector3D quantizationOffset;
+    MeshFileArray arrays[kMeshArrayCount];
+} MeshFileHeader;
+
+/* Size of an element of each array of a binary mesh */
+static const uint32_t meshArrayElementSize[kMeshArrayCount] =
+{
+    sizeof(Vector3D), sizeof(Face), sizeof(Vector2D), sizeof(Vector3D), sizeof(BSPNode),
+    sizeof(QuantizedVertex), sizeof(QuantizedFace), sizeof(Vector3D), sizeof(Vector3D), sizeof(uint8_t)
+};
+
+/* Meshes are allocated from a fixed pool, created on first use */
+static MemoryPool meshPool;
+static int meshPoolReady = 0;
+
 /* Cube vertices */
 Vector3D cubeVertices[N_CUBE_VERTICES] = {
-    {.x = -1, .y = -1, .z = -1 }, /* 1 */
-    {.x = -1, .y = 1, .z = -1 }, /* 2 */
-    {.x = 1, .y = 1, .z = -1 }, /* 3 */
-    {.x = 1, .y = -1, .z = -1 }, /* 4 */
-    {.x = 1, .y = 1, .z = 1 }, /* 5 */
-    {.x = 1, .y = -1, .z = 1 }, /* 6 */
-    {.x = -1, .y = 1, .z = 1 }, /* 7 */
-    {.x = -1, .y = -1, .z = 1 }  /* 8 */
+    {.x = -1, .y = -1, .z = -1 }, /* 0 */
+    {.x = -1, .y = 1, .z = -1 }, /* 1 */
+    {.x = 1, .y = 1, .z = -1 }, /* 2 */
+    {.x = 1, .y = -1, .z = -1 }, /* 3 */
+    {.x = 1, .y = 1, .z = 1 }, /* 4 */
+    {.x = 1, .y = -1, .z = 1 }, /* 5 */
+    {.x = -1, .y = 1, .z = 1 }, /* 6 */
+    {.x = -1, .y = -1, .z = 1 }  /* 7 */
 };
 
 /* Cube faces */
 Face cubeFaces[N_CUBE_FACES] = {
     /* front */
-    {.a = 1, .b = 2, .c = 3, .pattern = BayerDither02 },
-    {.a = 1, .b = 3, .c = 4, .pattern = BayerDither02 },
+    {.a = 0, .b = 1, .c = 2, .uva = -1, .uvb = -1, .uvc = -1, .na = -1, .nb = -1, .nc = -1, .pattern = 2 },
+    {.a = 0, .b = 2, .c = 3, .uva = -1, .uvb = -1, .uvc = -1, .na = -1, .nb = -1, .nc = -1, .pattern = 2 },
     /* right */
-    {.a = 4, .b = 3, .c = 5, .pattern = BayerDither05 },
-    {.a = 4, .b = 5, .c = 6, .pattern = BayerDither05 },
+    {.a = 3, .b = 2, .c = 4, .uva = -1, .uvb = -1, .uvc = -1, .na = -1, .nb = -1, .nc = -1, .pattern = 5 },
+    {.a = 3, .b = 4, .c = 5, .uva = -1, .uvb = -1, .uvc = -1, .na = -1, .nb = -1, .nc = -1, .pattern = 5 },
     /* back */
-    {.a = 6, .b = 5, .c = 7, .pattern = BayerDither08 },
-    {.a = 6, .b = 7, .c = 8, .pattern = BayerDither08 },
+    {.a = 5, .b = 4, .c = 6, .uva = -1, .uvb = -1, .uvc = -1, .na = -1, .nb = -1, .nc = -1, .pattern = 8 },
+    {.a = 5, .b = 6, .c = 7, .uva = -1, .uvb = -1, .uvc = -1, .na = -1, .nb = -1, .nc = -1, .pattern = 8 },
     /* left */
-    {.a = 8, .b = 7, .c = 2, .pattern = BayerDither11 },
-    {.a = 8, .b = 2, .c = 1, .pattern = BayerDither11 },
+    {.a = 7, .b = 6, .c = 1, .uva = -1, .uvb = -1, .uvc = -1, .na = -1, .nb = -1, .nc = -1, .pattern = 11 },
+    {.a = 7, .b = 1, .c = 0, .uva = -1, .uvb = -1, .uvc = -1, .na = -1, .nb = -1, .nc = -1, .pattern = 11 },
     /* top */
-    {.a = 2, .b = 7, .c = 5, .pattern = BayerDither14 },
-    {.a = 2, .b = 5, .c = 3, .pattern = BayerDither14 },
+    {.a = 1, .b = 6, .c = 4, .uva = -1, .uvb = -1, .uvc = -1, .na = -1, .nb = -1, .nc = -1, .pattern = 14 },
+    {.a = 1, .b = 4, .c = 2, .uva = -1, .uvb = -1, .uvc = -1, .na = -1, .nb = -1, .nc = -1, .pattern = 14 },
     /* bottom */
-    {.a = 6, .b = 8, .c = 1, .pattern = BayerDither16 },
-    {.a = 6, .b = 1, .c = 4, .pattern = BayerDither16 }
+    {.a = 5, .b = 7, .c = 0, .uva = -1, .uvb = -1, .uvc = -1, .na = -1, .nb = -1, .nc = -1, .pattern = 16 },
+    {.a = 5, .b = 0, .c = 3, .uva = -1, .uvb = -1, .uvc = -1, .na = -1, .nb = -1, .nc = -1, .pattern = 16 }
 };
 
-// Custom readline function
-int readline(SDFile* file, char* buffer, int maxLength)
+Mesh* allocMesh(void)
 {
-    int bytesRead = 0;
-    char ch;
-    while (bytesRead < maxLength - 1)
+    if (!meshPoolReady)
     {
-        if (pd->file->read(file, &ch, 1) != 1)
-        {
-            break;  // End of file or error
-        }
-
-        if (ch == '\n')
+        memoryPushTag(kMemoryTagMesh);
+        meshPoolReady = poolInit(&meshPool, sizeof(Mesh), MAX_MESHES) == 0;
+        memoryPopTag();
+        if (!meshPoolReady)
         {
-            if (bytesRead == 0)
-            {
-                // Skip empty line
-                continue;
-            }
-            break;
+            return NULL;
         }
-        buffer[bytesRead++] = ch;
     }
-    buffer[bytesRead] = '\0';
-
-    return bytesRead;
+    return poolAllocType(&meshPool, Mesh);
 }
 
 Mesh* loadCubeMeshData(void)
 {
-    Mesh* mesh = (Mesh*)pdMalloc(sizeof(Mesh));
+    Mesh* mesh = allocMesh();
 	if (!mesh)
 	{
 		LOG_ERROR("Failed to allocate memory for mesh");
@@ -82,7 +159,10 @@ Mesh* loadCubeMeshData(void)
 
     mesh->vertices = NULL; // Initialize vertices array
     mesh->faces = NULL;    // Initialize faces array
-	mesh->rotation = (Vector3D){ 0.0f, 0.0f, 0.0f };
+    mesh->uvs = NULL;      // The cube has no texture coordinates
+    mesh->normals = NULL;  // or vertex normals
+    mesh->bspNodes = NULL; // No BSP tree until buildMeshBSP is called
+    mesh->block = NULL;    // Arrays are owned by stb_ds
 
     for (int i = 0; i < N_CUBE_VERTICES; i++)
     {
@@ -95,91 +175,1040 @@ Mesh* loadCubeMeshData(void)
         arrput(mesh->faces, cubeFace);
     }
 
+    computeMeshBounds(mesh);
+    computeMeshNormals(mesh);
+
 	return mesh;
 }
 
-Mesh* loadOBJ(const char* filename)
+/* Skips spaces and tabs */
+static const char* skipSpaces(const char* p)
 {
-    SDFile* file = pd->file->open(filename, kFileRead);
-    if (!file)
+    while (*p == ' ' || *p == '\t')
     {
-        LOG_ERROR("Failed to open file: %s", filename);
+        p++;
+    }
+    return p;
+}
+
+/* Parses an optionally signed decimal integer, returns NULL if there is none */
+static const char* parseInt(const char* p, int* value)
+{
+    int sign = 1;
+    if (*p == '-' || *p == '+')
+    {
+        sign = *p == '-' ? -1 : 1;
+        p++;
+    }
+    if (*p < '0' || *p > '9')
+    {
+        return NULL;
+    }
+
+    int result = 0;
+    while (*p >= '0' && *p <= '9')
+    {
+        result = result * 10 + (*p++ - '0');
+    }
+    *value = sign * result;
+    return p;
+}
+
+/* Parses a decimal float with optional fraction and exponent, returns NULL if there is none */
+static const char* parseFloat(const char* p, float* value)
+{
+    static const float powersOf10[] = { 1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f };
+
+    int negative = *p == '-';
+    if (*p == '-' || *p == '+')
+    {
+        p++;
+    }
+
+    // Accumulate up to 9 significant digits in an integer, the rest only moves the exponent
+    uint32_t mantissa = 0;
+    int digits = 0, exponent = 0, anyDigit = 0;
+    while (*p >= '0' && *p <= '9')
+    {
+        if (digits < 9)
+        {
+            mantissa = mantissa * 10 + (*p - '0');
+            digits += mantissa != 0;
+        }
+        else
+        {
+            exponent++;
+        }
+        anyDigit = 1;
+        p++;
+    }
+    if (*p == '.')
+    {
+        p++;
+        while (*p >= '0' && *p <= '9')
+        {
+            if (digits < 9)
+            {
+                mantissa = mantissa * 10 + (*p - '0');
+                digits += mantissa != 0;
+                exponent--;
+            }
+            anyDigit = 1;
+            p++;
+        }
+    }
+    if (!anyDigit)
+    {
+        return NULL;
+    }
+    if (*p == 'e' || *p == 'E')
+    {
+        int e;
+        const char* end = parseInt(p + 1, &e);
+        if (end)
+        {
+            exponent += e;
+            p = end;
+        }
+    }
+
+    float result = (float)mantissa;
+    while (exponent > 0)
+    {
+        int step = exponent > 9 ? 9 : exponent;
+        result *= powersOf10[step];
+        exponent -= step;
+    }
+    while (exponent < 0)
+    {
+        int step = -exponent > 9 ? 9 : -exponent;
+        result /= powersOf10[step];
+        exponent += step;
+    }
+
+    *value = negative ? -result : result;
+    return p;
+}
+
+/* Parses the floats of an attribute line, returns the number parsed */
+static int parseFloats(const char* p, float* values, int maxCount)
+{
+    int count = 0;
+    while (count < maxCount)
+    {
+        p = parseFloat(skipSpaces(p), &values[count]);
+        if (!p)
+        {
+            break;
+        }
+        count++;
+    }
+    return count;
+}
+
+/* Converts a 1-based or negative (relative to the end) OBJ index to a 0-based index, -1 if out of range */
+static int resolveIndex(int index, int count)
+{
+    int resolved = index > 0 ? index - 1 : count + index;
+    return index != 0 && resolved < count && resolved >= 0 ? resolved : -1;
+}
+
+/* Hashes the rest of a line, ignoring trailing spaces (FNV-1a) */
+static uint32_t hashName(const char* p)
+{
+    const char* end = p + strlen(p);
+    while (end > p && (end[-1] == ' ' || end[-1] == '\t'))
+    {
+        end--;
+    }
+
+    uint32_t hash = 2166136261u;
+    while (p < end)
+    {
+        hash = (hash ^ (uint8_t)*p++) * 16777619u;
+    }
+    return hash;
+}
+
+/* Gets the pattern of an o/g/usemtl name, giving the next pattern of the palette to a new name */
+static uint8_t groupPattern(ObjParser* parser, const char* name)
+{
+    uint32_t hash = hashName(name);
+    for (int i = 0; i < parser->groupCount; i++)
+    {
+        if (parser->groupHashes[i] == hash)
+        {
+            return objGroupPatterns[i % OBJ_GROUP_PATTERN_COUNT];
+        }
+    }
+
+    if (parser->groupCount < OBJ_MAX_GROUPS)
+    {
+        parser->groupHashes[parser->groupCount] = hash;
+        return objGroupPatterns[parser->groupCount++ % OBJ_GROUP_PATTERN_COUNT];
+    }
+    return objGroupPatterns[parser->groupCount % OBJ_GROUP_PATTERN_COUNT];
+}
+
+/* Parses the corners of a face line and fan-triangulates the polygon into the mesh */
+static int parseFace(ObjParser* parser, const char* p)
+{
+    Mesh* mesh = parser->mesh;
+    int vertexCount = (int)arrlen(mesh->vertices);
+    int uvCount = (int)arrlen(mesh->uvs);
+    int normalCount = (int)arrlen(mesh->normals);
+    Face face = { .uva = -1, .uvb = -1, .uvc = -1, .na = -1, .nb = -1, .nc = -1, .pattern = parser->pattern };
+    int corner = 0;
+
+    while (*(p = skipSpaces(p)) != '\0' && *p != '#')
+    {
+        // Corners are v, v/vt, v//vn or v/vt/vn
+        int v, vt = 0, vn = 0;
+        p = parseInt(p, &v);
+        if (!p)
+        {
+            return 1;
+        }
+        if (*p == '/')
+        {
+            p++;
+            if (*p != '/' && (p = parseInt(p, &vt)) == NULL)
+            {
+                return 1;
+            }
+            if (*p == '/' && (p = parseInt(p + 1, &vn)) == NULL)
+            {
+                return 1;
+            }
+        }
+
+        // A corner without a valid position is an error, a missing attribute is only dropped
+        int vertex = resolveIndex(v, vertexCount);
+        int uv = vt ? resolveIndex(vt, uvCount) : -1;
+        int normal = vn ? resolveIndex(vn, normalCount) : -1;
+        if (vertex < 0)
+        {
+            return 1;
+        }
+
+        if (corner == 0)
+        {
+            face.a = vertex;
+            face.uva = uv;
+            face.na = normal;
+        }
+        else
+        {
+            // Each corner past the second closes a triangle of the fan around the first
+            face.b = face.c;
+            face.uvb = face.uvc;
+            face.nb = face.nc;
+            face.c = vertex;
+            face.uvc = uv;
+            face.nc = normal;
+            if (corner >= 2)
+            {
+                arrput(mesh->faces, face);
+            }
+        }
+        corner++;
+    }
+
+    return corner < 3;
+}
+
+/* Parses one line of an OBJ file, returns non-zero on a malformed line */
+static int parseOBJLine(ObjParser* parser, const char* line)
+{
+    Mesh* mesh = parser->mesh;
+    float values[3];
+    line = skipSpaces(line);
+
+    if (line[0] == 'v' && (line[1] == ' ' || line[1] == '\t'))
+    {
+        if (parseFloats(line + 2, values, 3) != 3)
+        {
+            return 1;
+        }
+        Vector3D vertex = { values[0], values[1], values[2] };
+        arrput(mesh->vertices, vertex);
+    }
+    else if (line[0] == 'v' && line[1] == 't' && (line[2] == ' ' || line[2] == '\t'))
+    {
+        // The optional w coordinate is ignored
+        int count = parseFloats(line + 3, values, 2);
+        if (count < 1)
+        {
+            return 1;
+        }
+        Vector2D uv = { values[0], count == 2 ? values[1] : 0.0f };
+        arrput(mesh->uvs, uv);
+    }
+    else if (line[0] == 'v' && line[1] == 'n' && (line[2] == ' ' || line[2] == '\t'))
+    {
+        if (parseFloats(line + 3, values, 3) != 3)
+        {
+            return 1;
+        }
+        Vector3D normal = { values[0], values[1], values[2] };
+        arrput(mesh->normals, normal);
+    }
+    else if (line[0] == 'f' && (line[1] == ' ' || line[1] == '\t'))
+    {
+        return parseFace(parser, line + 2);
+    }
+    else if ((line[0] == 'o' || line[0] == 'g') && (line[1] == ' ' || line[1] == '\t'))
+    {
+        parser->pattern = groupPattern(parser, skipSpaces(line + 2));
+    }
+    else if (strncmp(line, "usemtl", 6) == 0 && (line[6] == ' ' || line[6] == '\t'))
+    {
+        parser->pattern = groupPattern(parser, skipSpaces(line + 7));
+    }
+
+    // Comments, smoothing groups, material libraries and lines are ignored
+    return 0;
+}
+
+/* Passes run over the whole mesh once it is parsed, in order, as many per step as the budget allows */
+typedef enum
+{
+    kMeshPassWeld,
+    kMeshPassOptimizeFaces,
+    kMeshPassReorderVertices,
+    kMeshPassBounds,
+    kMeshPassNormals,
+    kMeshPassCount
+} MeshPass;
+
+/* Incremental OBJ load, see meshLoaderOpen */
+struct MeshLoader
+{
+    MeshLoaderState state;
+    int flags;                  /* MeshLoadFlags applied once the file is parsed */
+    const char* filename;
+    BufferedReader reader;
+    ObjParser parser;
+    int lineNumber;
+    int fileSize;               /* Size of the file, 0 if unknown */
+    int parsedBytes;            /* Bytes of the file parsed so far */
+    unsigned int startTime;     /* Time of meshLoaderOpen in milliseconds */
+    int stepCount;
+    MeshPass pass;              /* Next pass to run while processing */
+    float acmrBefore;           /* Vertex cache ACMR before the faces were reordered */
+};
+
+MeshLoader* meshLoaderOpen(const char* filename, int flags)
+{
+    if (flags & kMeshLoadBake)
+    {
+        LOG_ERROR("Baking %s cannot be split over steps, bake it with loadOBJ or meshconv", filename);
+        return NULL;
+    }
+
+    memoryPushTag(kMemoryTagAsset);
+    MeshLoader* loader = (MeshLoader*)pdCalloc(1, sizeof(MeshLoader));
+    memoryPopTag();
+    if (!loader)
+    {
+        return NULL;
+    }
+
+    loader->startTime = pd->system->getCurrentTimeMilliseconds();
+    loader->flags = flags;
+    loader->filename = filename;
+
+    FileStat stat;
+    if (pd->file->stat(filename, &stat) == 0)
+    {
+        loader->fileSize = (int)stat.size;
+    }
+
+    if (readerOpen(&loader->reader, filename) != 0)
+    {
+        pdFree(loader);
         return NULL;
     }
 
-    Mesh* mesh = (Mesh*)pdMalloc(sizeof(Mesh));
+    Mesh* mesh = allocMesh();
     if (!mesh)
     {
         LOG_ERROR("Failed to allocate memory for mesh");
-        pd->file->close(file);
+        readerClose(&loader->reader);
+        pdFree(loader);
         return NULL;
     }
 
     mesh->vertices = NULL;
     mesh->faces = NULL;
-    mesh->rotation = (Vector3D) { 0.0f, 0.0f, 0.0f };
+    mesh->uvs = NULL;
+    mesh->normals = NULL;
+    mesh->bspNodes = NULL;
+    mesh->block = NULL;
 
-    char line[256];
-    while (readline(file, line, sizeof(line)) > 0)
+    loader->parser = (ObjParser){ .mesh = mesh, .groupCount = 0, .pattern = OBJ_DEFAULT_PATTERN };
+    loader->state = kMeshLoaderParsing;
+    return loader;
+}
+
+/* Parses lines until the end of the file or until the budget is spent */
+static MeshLoaderState parseOBJLines(MeshLoader* loader, float budget, float startTime)
+{
+    int length;
+    char* line;
+    int lines = 0;
+    while ((line = readerNextLine(&loader->reader, &length)) != NULL)
     {
-        if (strncmp(line, "v ", 2) == 0)
+        loader->lineNumber++;
+        loader->parsedBytes += length + 1;
+        if (parseOBJLine(&loader->parser, line) != 0)
         {
-            // Vertex
-            Vector3D vertex;
-            if (pd->system->parseString(line, "v %f %f %f", &vertex.x, &vertex.y, &vertex.z) != 3)
-            {
-                LOG_ERROR("Error parsing vertex: %s", line);
-                pd->file->close(file);
-                return NULL;
-            }
-            arrput(mesh->vertices, vertex);
+            LOG_ERROR("Error parsing line %d of %s: %s", loader->lineNumber, loader->filename, line);
+            return kMeshLoaderFailed;
         }
-        else if (strncmp(line, "f ", 2) == 0)
+
+        // Reading the clock costs more than a line, so it is only checked every few lines
+        if (budget > 0.0f && ++lines == MESH_LOADER_LINES_PER_CHECK)
         {
-            int vertexIndices[3];
-            int textureIndices[3];
-            int normalIndices[3];
-            if (pd->system->parseString(line, "f %d/%d/%d %d/%d/%d %d/%d/%d",
-                &vertexIndices[0], &textureIndices[0], &normalIndices[0],
-                &vertexIndices[1], &textureIndices[1], &normalIndices[1],
-                &vertexIndices[2], &textureIndices[2], &normalIndices[2]) != 9)
+            lines = 0;
+            if (pd->system->getElapsedTime() - startTime >= budget)
             {
-                LOG_ERROR("Error parsing face: %s", line);
-                pd->file->close(file);
-                return NULL;
+                return kMeshLoaderParsing;
             }
-            // OBJ indices are 1-based, convert to 0-based
-            Face face =
-            {
-                .a = vertexIndices[0],
-                .b = vertexIndices[1],
-                .c = vertexIndices[2]
-            };
-            arrput(mesh->faces, face);
         }
     }
 
-    pd->file->close(file);
+    loader->parsedBytes = loader->reader.totalRead;
+    readerClose(&loader->reader);
 
+    Mesh* mesh = loader->parser.mesh;
     if (arrlen(mesh->vertices) == 0 || arrlen(mesh->faces) == 0)
     {
-        LOG_ERROR("Failed to load any vertices or faces from file: %s", filename);
+        LOG_ERROR("Failed to load any vertices or faces from file: %s", loader->filename);
+        return kMeshLoaderFailed;
+    }
+    return kMeshLoaderProcessing;
+}
+
+/* Runs the next processing pass of the parsed mesh, skipping the ones the load flags leave out */
+static void processOBJPass(MeshLoader* loader)
+{
+    Mesh* mesh = loader->parser.mesh;
+    switch (loader->pass++)
+    {
+    case kMeshPassWeld:
+        if (loader->flags & kMeshLoadWeld)
+        {
+            int welded = weldMeshVertices(mesh);
+            LOG_INFO("Welded %d duplicate vertices", welded);
+        }
+        break;
+
+    case kMeshPassOptimizeFaces:
+        if (loader->flags & kMeshLoadOptimize)
+        {
+            loader->acmrBefore = computeMeshACMR(mesh, MESHOPT_CACHE_SIZE);
+            optimizeMeshFaceOrder(mesh);
+        }
+        break;
+
+    case kMeshPassReorderVertices:
+        if (loader->flags & kMeshLoadOptimize)
+        {
+            reorderMeshVertices(mesh);
+            LOG_INFO("Vertex cache ACMR %.3f -> %.3f", (double)loader->acmrBefore,
+                (double)computeMeshACMR(mesh, MESHOPT_CACHE_SIZE));
+        }
+        break;
+
+    case kMeshPassBounds:
+        computeMeshBounds(mesh);
+        break;
+
+    default:
+        computeMeshNormals(mesh);
+        break;
+    }
+}
+
+MeshLoaderState meshLoaderStep(MeshLoader* loader, float budget)
+{
+    float startTime = budget > 0.0f ? pd->system->getElapsedTime() : 0.0f;
+
+    switch (loader->state)
+    {
+    case kMeshLoaderParsing:
+        loader->state = parseOBJLines(loader, budget, startTime);
+        break;
+
+    case kMeshLoaderProcessing:
+        // Each pass works on the whole mesh, the next one only starts if the budget is not spent
+        do
+        {
+            processOBJPass(loader);
+        } while (loader->pass < kMeshPassCount &&
+            (budget <= 0.0f || pd->system->getElapsedTime() - startTime < budget));
+        if (loader->pass < kMeshPassCount)
+        {
+            break;
+        }
+
+        loader->state = kMeshLoaderDone;
+        LOG_INFO("Loaded mesh with %d vertices and %d faces from %d bytes in %u ms over %d steps",
+            meshVertexCount(loader->parser.mesh), meshFaceCount(loader->parser.mesh), loader->parsedBytes,
+            pd->system->getCurrentTimeMilliseconds() - loader->startTime, loader->stepCount + 1);
+        break;
+
+    default:
+        break;
+    }
+
+    loader->stepCount++;
+    return loader->state;
+}
+
+float meshLoaderProgress(const MeshLoader* loader)
+{
+    if (loader->state == kMeshLoaderDone)
+    {
+        return 1.0f;
+    }
+    if (loader->fileSize <= 0)
+    {
+        return 0.0f;
+    }
+
+    float progress = (float)loader->parsedBytes / loader->fileSize;
+    return progress < 1.0f ? progress : 1.0f;
+}
+
+MeshLoaderState meshLoaderState(const MeshLoader* loader)
+{
+    return loader->state;
+}
+
+Mesh* meshLoaderFinish(MeshLoader* loader)
+{
+    Mesh* mesh = loader->parser.mesh;
+    if (loader->state != kMeshLoaderDone)
+    {
         freeMesh(mesh);
+        mesh = NULL;
+    }
+
+    readerClose(&loader->reader);
+    pdFree(loader);
+    return mesh;
+}
+
+Mesh* loadOBJ(const char* filename, int flags)
+{
+    MeshLoader* loader = meshLoaderOpen(filename, flags & ~kMeshLoadBake);
+    if (!loader)
+    {
+        return NULL;
+    }
+
+    // Without a budget each step runs its stage to completion
+    while (meshLoaderStep(loader, 0.0f) < kMeshLoaderDone)
+    {
+    }
+
+    // Baking casts rays from every face and vertex, it only runs in blocking loads
+    Mesh* mesh = meshLoaderFinish(loader);
+    if (mesh && (flags & kMeshLoadBake))
+    {
+        bakeMeshLighting(mesh, NULL);
+    }
+    return mesh;
+}
+
+/* Gets an array of a mesh and its number of elements */
+static const void* meshArray(const Mesh* mesh, int array, uint32_t* count)
+{
+    const void* data = NULL;
+    switch (array)
+    {
+    case kMeshArrayVertices: data = mesh->vertices; break;
+    case kMeshArrayFaces: data = mesh->faces; break;
+    case kMeshArrayUVs: data = mesh->uvs; break;
+    case kMeshArrayNormals: data = mesh->normals; break;
+    case kMeshArrayBSPNodes: data = mesh->bspNodes; break;
+    case kMeshArrayQuantizedVertices: data = mesh->quantizedVertices; break;
+    case kMeshArrayQuantizedFaces: data = mesh->quantizedFaces; break;
+    case kMeshArrayFaceNormals: data = mesh->faceNormals; break;
+    case kMeshArrayVertexNormals: data = mesh->vertexNormals; break;
+    default: data = mesh->bakedLevels; break;
+    }
+    *count = data ? (uint32_t)stbds_header(data)->length : 0;
+    return data;
+}
+
+/* Points an array of a mesh at elements stored in its block, behind a fixed-capacity stb_ds header */
+static void setMeshArray(Mesh* mesh, int array, uint8_t* data, uint32_t count)
+{
+    if (count == 0)
+    {
+        data = NULL;
+    }
+    else
+    {
+        stbds_array_header* header = (stbds_array_header*)data - 1;
+        header->length = count;
+        header->capacity = count;
+        header->hash_table = NULL;
+        header->temp = 0;
+    }
+
+    switch (array)
+    {
+    case kMeshArrayVertices: mesh->vertices = (Vector3D*)data; break;
+    case kMeshArrayFaces: mesh->faces = (Face*)data; break;
+    case kMeshArrayUVs: mesh->uvs = (Vector2D*)data; break;
+    case kMeshArrayNormals: mesh->normals = (Vector3D*)data; break;
+    case kMeshArrayBSPNodes: mesh->bspNodes = (BSPNode*)data; break;
+    case kMeshArrayQuantizedVertices: mesh->quantizedVertices = (QuantizedVertex*)data; break;
+    case kMeshArrayQuantizedFaces: mesh->quantizedFaces = (QuantizedFace*)data; break;
+    case kMeshArrayFaceNormals: mesh->faceNormals = (Vector3D*)data; break;
+    case kMeshArrayVertexNormals: mesh->vertexNormals = (Vector3D*)data; break;
+    default: mesh->bakedLevels = data; break;
+    }
+}
+
+/* Checks that an attribute index is -1 or inside an array of the given length */
+static int isAttributeIndexValid(int index, int count)
+{
+    return index == -1 || (index >= 0 && index < count);
+}
+
+/* Checks every index of a binary mesh, rendering and traversal trust them */
+static int validateMeshBinary(const Mesh* mesh)
+{
+    int vertexCount = meshVertexCount(mesh);
+    int faceCount = meshFaceCount(mesh);
+    int uvCount = (int)arrlen(mesh->uvs);
+    int normalCount = (int)arrlen(mesh->normals);
+
+    for (int i = 0; i < (int)arrlen(mesh->faces); i++)
+    {
+        const Face* face = &mesh->faces[i];
+        if (face->a < 0 || face->a >= vertexCount || face->b < 0 || face->b >= vertexCount ||
+            face->c < 0 || face->c >= vertexCount || face->pattern >= LIGHT_LEVELS ||
+            !isAttributeIndexValid(face->uva, uvCount) || !isAttributeIndexValid(face->uvb, uvCount) ||
+            !isAttributeIndexValid(face->uvc, uvCount) || !isAttributeIndexValid(face->na, normalCount) ||
+            !isAttributeIndexValid(face->nb, normalCount) || !isAttributeIndexValid(face->nc, normalCount))
+        {
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < (int)arrlen(mesh->quantizedFaces); i++)
+    {
+        const QuantizedFace* face = &mesh->quantizedFaces[i];
+        if (face->a >= vertexCount || face->b >= vertexCount || face->c >= vertexCount ||
+            face->pattern >= LIGHT_LEVELS)
+        {
+            return 1;
+        }
+    }
+
+    // Same rules as a compressed mesh: face ranges inside the faces, children stored after their parent
+    int nodeCount = (int)arrlen(mesh->bspNodes);
+    for (int i = 0; i < nodeCount; i++)
+    {
+        const BSPNode* node = &mesh->bspNodes[i];
+        if (node->firstFace < 0 || node->firstFace > faceCount ||
+            node->faceCount < 0 || node->faceCount > faceCount - node->firstFace ||
+            (node->front != -1 && (node->front <= i || node->front >= nodeCount)) ||
+            (node->back != -1 && (node->back <= i || node->back >= nodeCount)))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Rounds a file offset up to the alignment of the arrays */
+static uint32_t alignMeshOffset(uint32_t offset)
+{
+    return (offset + MESH_FILE_ALIGNMENT - 1) & ~(uint32_t)(MESH_FILE_ALIGNMENT - 1);
+}
+
+Mesh* loadMeshBinary(const char* filename)
+{
+    unsigned int startTime = pd->system->getCurrentTimeMilliseconds();
+
+    FileStat stat;
+    if (pd->file->stat(filename, &stat) != 0 || stat.size < sizeof(MeshFileHeader))
+    {
+        LOG_ERROR("Failed to stat binary mesh: %s", filename);
+        return NULL;
+    }
+
+    SDFile* file = pd->file->open(filename, kFileRead);
+    if (!file)
+    {
+        LOG_ERROR("Failed to open file: %s", filename);
+        return NULL;
+    }
+
+    // The whole file goes into one block, the arrays are then used where they landed
+    memoryPushTag(kMemoryTagMesh);
+    uint8_t* block = (uint8_t*)pdMalloc(stat.size);
+    Mesh* mesh = block ? allocMesh() : NULL;
+    memoryPopTag();
+    if (!mesh)
+    {
+        LOG_ERROR("Failed to allocate memory for mesh");
+        pdFree(block);
+        pd->file->close(file);
+        return NULL;
+    }
+
+    int bytesRead = pd->file->read(file, block, stat.size);
+    pd->file->close(file);
+
+    const MeshFileHeader* header = (const MeshFileHeader*)block;
+    if (bytesRead != (int)stat.size || header->magic != MESH_FILE_MAGIC ||
+        header->version != MESH_FILE_VERSION || header->fileSize != stat.size)
+    {
+        LOG_ERROR("Invalid binary mesh: %s", filename);
+        pdFree(block);
+        poolFree(&meshPool, mesh);
+        return NULL;
+    }
+
+    // Each array must follow the previous one with room for its stb_ds header
+    uint64_t arrayEnd = sizeof(MeshFileHeader);
+    for (int i = 0; i < kMeshArrayCount; i++)
+    {
+        MeshFileArray array = header->arrays[i];
+        if (array.count == 0)
+        {
+            setMeshArray(mesh, i, NULL, 0);
+            continue;
+        }
+        if (array.offset < arrayEnd + MESH_FILE_ARRAY_GAP || array.offset % MESH_FILE_ALIGNMENT != 0 ||
+            array.offset + (uint64_t)array.count * meshArrayElementSize[i] > stat.size)
+        {
+            LOG_ERROR("Corrupt array %d in binary mesh: %s", i, filename);
+            pdFree(block);
+            poolFree(&meshPool, mesh);
+            return NULL;
+        }
+        setMeshArray(mesh, i, block + array.offset, array.count);
+        arrayEnd = array.offset + (uint64_t)array.count * meshArrayElementSize[i];
+    }
+
+    // Baked levels are read per vertex while rendering
+    if (mesh->bakedLevels && arrlen(mesh->bakedLevels) != meshVertexCount(mesh))
+    {
+        LOG_ERROR("Baked levels do not match the vertices in binary mesh: %s", filename);
+        pdFree(block);
+        poolFree(&meshPool, mesh);
+        return NULL;
+    }
+
+    // Normals are stored rather than computed, so they stay in the block as well
+    if ((mesh->faceNormals && arrlen(mesh->faceNormals) != meshFaceCount(mesh)) ||
+        (mesh->vertexNormals && arrlen(mesh->vertexNormals) != meshVertexCount(mesh)))
+    {
+        LOG_ERROR("Normals do not match the mesh in binary mesh: %s", filename);
+        pdFree(block);
+        poolFree(&meshPool, mesh);
+        return NULL;
+    }
+
+    if (validateMeshBinary(mesh) != 0)
+    {
+        LOG_ERROR("Invalid faces or BSP nodes in binary mesh: %s", filename);
+        pdFree(block);
+        poolFree(&meshPool, mesh);
         return NULL;
     }
 
-    LOG_INFO("Loaded mesh with %d vertices and %d faces", arrlen(mesh->vertices), arrlen(mesh->faces));
+    mesh->boundsCenter = header->boundsCenter;
+    mesh->boundsRadius = header->boundsRadius;
+    mesh->isConvex = header->isConvex;
+    mesh->quantizationScale = header->quantizationScale;
+    mesh->quantizationOffset = header->quantizationOffset;
+    mesh->block = block;
+
+    LOG_INFO("Loaded binary mesh with %d vertices and %d faces from %u bytes in %u ms", meshVertexCount(mesh),
+        meshFaceCount(mesh), stat.size, pd->system->getCurrentTimeMilliseconds() - startTime);
 
     return mesh;
 }
 
+int saveMeshBinary(const Mesh* mesh, const char* filename)
+{
+    MeshFileHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = MESH_FILE_MAGIC;
+    header.version = MESH_FILE_VERSION;
+    header.isConvex = mesh->isConvex;
+    header.boundsCenter = mesh->boundsCenter;
+    header.boundsRadius = mesh->boundsRadius;
+    header.quantizationScale = mesh->quantizationScale;
+    header.quantizationOffset = mesh->quantizationOffset;
+
+    // Lay the arrays out, each behind a gap the loader fills with its stb_ds header
+    uint32_t offset = sizeof(MeshFileHeader);
+    for (int i = 0; i < kMeshArrayCount; i++)
+    {
+        uint32_t count;
+        meshArray(mesh, i, &count);
+        header.arrays[i].count = count;
+        if (count > 0)
+        {
+            header.arrays[i].offset = alignMeshOffset(offset + MESH_FILE_ARRAY_GAP);
+            offset = header.arrays[i].offset + count * meshArrayElementSize[i];
+        }
+    }
+    header.fileSize = offset;
+
+    SDFile* file = pd->file->open(filename, kFileWrite);
+    if (!file)
+    {
+        LOG_ERROR("Failed to open file for writing: %s", filename);
+        return 1;
+    }
+
+    static const uint8_t padding[MESH_FILE_ARRAY_GAP + MESH_FILE_ALIGNMENT] = { 0 };
+    int failed = pd->file->write(file, &header, sizeof(header)) != (int)sizeof(header);
+    offset = sizeof(MeshFileHeader);
+    for (int i = 0; i < kMeshArrayCount && !failed; i++)
+    {
+        uint32_t count;
+        const void* data = meshArray(mesh, i, &count);
+        if (count == 0)
+        {
+            continue;
+        }
+
+        int gap = (int)(header.arrays[i].offset - offset);
+        int size = (int)(count * meshArrayElementSize[i]);
+        failed = pd->file->write(file, padding, gap) != gap || pd->file->write(file, data, size) != size;
+        offset = header.arrays[i].offset + size;
+    }
+    pd->file->close(file);
+
+    if (failed)
+    {
+        LOG_ERROR("Failed to write binary mesh: %s", filename);
+        return 1;
+    }
+
+    LOG_INFO("Saved binary mesh with %d vertices and %d faces to %u bytes", meshVertexCount(mesh),
+        meshFaceCount(mesh), header.fileSize);
+    return 0;
+}
+
+int quantizeMesh(Mesh* mesh)
+{
+    int vertexCount = (int)arrlen(mesh->vertices);
+    int faceCount = (int)arrlen(mesh->faces);
+    if (mesh->block || vertexCount == 0 || vertexCount > MESH_QUANTIZED_MAX_VERTICES)
+    {
+        LOG_ERROR("Cannot quantize a mesh with %d vertices", vertexCount);
+        return 1;
+    }
+
+    // Map the bounding box onto the full int16 range of each axis
+    Vector3D min = mesh->vertices[0];
+    Vector3D max = mesh->vertices[0];
+    for (int i = 1; i < vertexCount; i++)
+    {
+        Vector3D v = mesh->vertices[i];
+        min = (Vector3D){ fminf(min.x, v.x), fminf(min.y, v.y), fminf(min.z, v.z) };
+        max = (Vector3D){ fmaxf(max.x, v.x), fmaxf(max.y, v.y), fmaxf(max.z, v.z) };
+    }
+    Vector3D offset = vector3DMul(vector3DAdd(min, max), 0.5f);
+    Vector3D scale = vector3DMul(vector3DSub(max, min), 0.5f / INT16_MAX);
+    if (scale.x <= 0.0f) scale.x = 1.0f;
+    if (scale.y <= 0.0f) scale.y = 1.0f;
+    if (scale.z <= 0.0f) scale.z = 1.0f;
+
+    QuantizedVertex* quantizedVertices = NULL;
+    QuantizedFace* quantizedFaces = NULL;
+    arrsetlen(quantizedVertices, vertexCount);
+    arrsetlen(quantizedFaces, faceCount);
+
+    for (int i = 0; i < vertexCount; i++)
+    {
+        Vector3D v = mesh->vertices[i];
+        quantizedVertices[i].x = (int16_t)lroundf((v.x - offset.x) / scale.x);
+        quantizedVertices[i].y = (int16_t)lroundf((v.y - offset.y) / scale.y);
+        quantizedVertices[i].z = (int16_t)lroundf((v.z - offset.z) / scale.z);
+    }
+    for (int i = 0; i < faceCount; i++)
+    {
+        Face face = mesh->faces[i];
+        quantizedFaces[i].a = (uint16_t)face.a;
+        quantizedFaces[i].b = (uint16_t)face.b;
+        quantizedFaces[i].c = (uint16_t)face.c;
+        quantizedFaces[i].pattern = face.pattern;
+    }
+
+    arrfree(mesh->vertices);
+    arrfree(mesh->faces);
+    arrfree(mesh->uvs);
+    arrfree(mesh->normals);
+    mesh->quantizedVertices = quantizedVertices;
+    mesh->quantizedFaces = quantizedFaces;
+    mesh->quantizationScale = scale;
+    mesh->quantizationOffset = offset;
+
+    LOG_INFO("Quantized mesh to %d bytes of vertices and faces, from %d",
+        (int)(vertexCount * sizeof(QuantizedVertex) + faceCount * sizeof(QuantizedFace)),
+        (int)(vertexCount * sizeof(Vector3D) + faceCount * sizeof(Face)));
+    return 0;
+}
+
+/* Checks that every vertex lies behind the plane of every face */
+static int isMeshConvex(const Mesh* mesh)
+{
+    int vertexCount = (int)arrlen(mesh->vertices);
+    int faceCount = (int)arrlen(mesh->faces);
+    float epsilon = MESH_CONVEX_EPSILON * fmaxf(1.0f, mesh->boundsRadius);
+
+    if ((long)vertexCount * faceCount > MESH_CONVEX_MAX_TESTS)
+    {
+        // Too expensive to check at load time, assume the worst
+        return 0;
+    }
+
+    for (int i = 0; i < faceCount; i++)
+    {
+        Face face = mesh->faces[i];
+        Vector3D a = mesh->vertices[face.a];
+        Vector3D b = mesh->vertices[face.b];
+        Vector3D c = mesh->vertices[face.c];
+        Vector3D normal = vector3DCross(vector3DSub(b, a), vector3DSub(c, a));
+        if (floatIsZero(vector3DLength(normal)))
+        {
+            continue;
+        }
+        normal = vector3DNormalize(normal);
+
+        for (int j = 0; j < vertexCount; j++)
+        {
+            if (vector3DDot(normal, vector3DSub(mesh->vertices[j], a)) > epsilon)
+            {
+                return 0;
+            }
+        }
+    }
+
+    return 1;
+}
+
+void computeMeshBounds(Mesh* mesh)
+{
+    int vertexCount = (int)arrlen(mesh->vertices);
+    if (vertexCount == 0)
+    {
+        mesh->boundsCenter = (Vector3D){ 0.0f, 0.0f, 0.0f };
+        mesh->boundsRadius = 0.0f;
+        mesh->isConvex = 0;
+        return;
+    }
+
+    // Center the sphere on the axis-aligned bounding box
+    Vector3D min = mesh->vertices[0];
+    Vector3D max = mesh->vertices[0];
+    for (int i = 1; i < vertexCount; i++)
+    {
+        Vector3D v = mesh->vertices[i];
+        min = (Vector3D){ fminf(min.x, v.x), fminf(min.y, v.y), fminf(min.z, v.z) };
+        max = (Vector3D){ fmaxf(max.x, v.x), fmaxf(max.y, v.y), fmaxf(max.z, v.z) };
+    }
+    mesh->boundsCenter = vector3DMul(vector3DAdd(min, max), 0.5f);
+
+    float radius = 0.0f;
+    for (int i = 0; i < vertexCount; i++)
+    {
+        radius = fmaxf(radius, vector3DLength(vector3DSub(mesh->vertices[i], mesh->boundsCenter)));
+    }
+    mesh->boundsRadius = radius;
+
+    mesh->isConvex = isMeshConvex(mesh);
+}
+
+void computeMeshNormals(Mesh* mesh)
+{
+    int vertexCount = meshVertexCount(mesh);
+    int faceCount = meshFaceCount(mesh);
+    memoryPushTag(kMemoryTagMesh);
+    arrsetlen(mesh->faceNormals, faceCount);
+    arrsetlen(mesh->vertexNormals, vertexCount);
+    memoryPopTag();
+    for (int i = 0; i < vertexCount; i++)
+    {
+        mesh->vertexNormals[i] = (Vector3D){ 0.0f, 0.0f, 0.0f };
+    }
+
+    for (int i = 0; i < faceCount; i++)
+    {
+        // Same winding as the backface test, the normal points out of the visible side
+        Face face = meshGetFace(mesh, i);
+        Vector3D a = meshGetVertex(mesh, face.a);
+        Vector3D b = meshGetVertex(mesh, face.b);
+        Vector3D c = meshGetVertex(mesh, face.c);
+        Vector3D normal = vector3DCross(vector3DSub(b, a), vector3DSub(c, a));
+        float length = vector3DLength(normal);
+        mesh->faceNormals[i] = length > 0.0f ? vector3DDiv(normal, length) : (Vector3D){ 0.0f, 0.0f, 0.0f };
+
+        // The unnormalized cross product weights each face by its area
+        mesh->vertexNormals[face.a] = vector3DAdd(mesh->vertexNormals[face.a], normal);
+        mesh->vertexNormals[face.b] = vector3DAdd(mesh->vertexNormals[face.b], normal);
+        mesh->vertexNormals[face.c] = vector3DAdd(mesh->vertexNormals[face.c], normal);
+    }
+
+    for (int i = 0; i < vertexCount; i++)
+    {
+        float length = vector3DLength(mesh->vertexNormals[i]);
+        mesh->vertexNormals[i] = length > 0.0f ? vector3DDiv(mesh->vertexNormals[i], length) : (Vector3D){ 0.0f, 0.0f, 0.0f };
+    }
+}
+
+size_t meshMemorySize(const Mesh* mesh)
+{
+    return arrlenu(mesh->vertices) * sizeof(Vector3D) +
+        arrlenu(mesh->faces) * sizeof(Face) +
+        arrlenu(mesh->uvs) * sizeof(Vector2D) +
+        arrlenu(mesh->normals) * sizeof(Vector3D) +
+        arrlenu(mesh->bspNodes) * sizeof(BSPNode) +
+        arrlenu(mesh->quantizedVertices) * sizeof(QuantizedVertex) +
+        arrlenu(mesh->quantizedFaces) * sizeof(QuantizedFace) +
+        arrlenu(mesh->faceNormals) * sizeof(Vector3D) +
+        arrlenu(mesh->vertexNormals) * sizeof(Vector3D) +
+        arrlenu(mesh->bakedLevels);
+}
+
 void freeMesh(Mesh* mesh)
 {
     if (mesh)
     {
-        arrfree(mesh->vertices);
-        arrfree(mesh->faces);
-        pdFree(mesh);
+        if (mesh->block)
+        {
+            // The arrays of a binary mesh all live in its block
+            pdFree(mesh->block);
+        }
+        else
+        {
+            arrfree(mesh->vertices);
+            arrfree(mesh->faces);
+            arrfree(mesh->uvs);
+            arrfree(mesh->normals);
+            arrfree(mesh->bspNodes);
+            arrfree(mesh->quantizedVertices);
+            arrfree(mesh->quantizedFaces);
+            arrfree(mesh->faceNormals);
+            arrfree(mesh->vertexNormals);
+            arrfree(mesh->bakedLevels);
+        }
+        poolFree(&meshPool, mesh);
     }
     LOG_INFO("Mesh data freed.");
 }
\ No newline at end of file
@@ -0,0 +1,200 @@
+#include "global.h"
+#include "meshcache.h"
+#include "meshpack.h"
+#include "logging.h"
+#include "memory.h"
+#include "stb_ds.h"
+
+/* Mesh shared through the cache */
+typedef struct
+{
+    const char* path;   /* Key of the entry in the path map, NULL if the slot is free */
+    Mesh* mesh;
+    int refCount;
+    size_t bytes;       /* Size of the mesh arrays */
+    uint32_t lastUse;   /* Value of useClock at the last acquire or release */
+} MeshCacheEntry;
+
+/* Path to slot map entry */
+typedef struct
+{
+    char* key;
+    int value;
+} MeshCachePath;
+
+/* Meshes can only come from the mesh pool, so the cache never needs more slots */
+static MeshCacheEntry entries[MAX_MESHES];
+static MeshCachePath* paths = NULL;
+static size_t cachedBytes = 0;
+static size_t budgetBytes = 0;
+static uint32_t useClock = 0;
+
+/* Returns non-zero if a path ends with an extension */
+static int hasExtension(const char* path, const char* extension)
+{
+    size_t pathLength = strlen(path);
+    size_t extensionLength = strlen(extension);
+    return pathLength >= extensionLength && strcmp(path + pathLength - extensionLength, extension) == 0;
+}
+
+/* Frees the mesh of a slot and removes it from the path map */
+static void evictEntry(MeshCacheEntry* entry)
+{
+    LOG_INFO("Evicting %s, %zu bytes", entry->path, entry->bytes);
+    cachedBytes -= entry->bytes;
+    freeMesh(entry->mesh);
+    (void)shdel(paths, entry->path);
+    memset(entry, 0, sizeof(*entry));
+}
+
+/* Evicts unreferenced meshes, least recently used first, until the cache fits the budget */
+static void enforceBudget(void)
+{
+    while (cachedBytes > budgetBytes)
+    {
+        MeshCacheEntry* oldest = NULL;
+        for (int i = 0; i < MAX_MESHES; i++)
+        {
+            MeshCacheEntry* entry = &entries[i];
+            if (entry->path && entry->refCount == 0 && (!oldest || entry->lastUse < oldest->lastUse))
+            {
+                oldest = entry;
+            }
+        }
+        if (!oldest)
+        {
+            // Whatever remains is in use
+            break;
+        }
+        evictEntry(oldest);
+    }
+}
+
+/* Finds the slot holding a mesh */
+static MeshCacheEntry* findEntry(const Mesh* mesh)
+{
+    for (int i = 0; i < MAX_MESHES; i++)
+    {
+        if (entries[i].path && entries[i].mesh == mesh)
+        {
+            return &entries[i];
+        }
+    }
+    return NULL;
+}
+
+const Mesh* meshCacheAcquire(const char* path, int flags)
+{
+    if (!paths)
+    {
+        // Keys are copied so callers may pass temporary strings
+        sh_new_strdup(paths);
+    }
+
+    ptrdiff_t index = shgeti(paths, path);
+    if (index >= 0)
+    {
+        MeshCacheEntry* entry = &entries[paths[index].value];
+        entry->refCount++;
+        entry->lastUse = ++useClock;
+        return entry->mesh;
+    }
+
+    int slot = -1;
+    for (int i = 0; i < MAX_MESHES && slot < 0; i++)
+    {
+        if (!entries[i].path)
+        {
+            slot = i;
+        }
+    }
+    if (slot < 0)
+    {
+        LOG_ERROR("Mesh cache is full, cannot load %s", path);
+        return NULL;
+    }
+
+    memoryPushTag(kMemoryTagMesh);
+    Mesh* mesh;
+    if (hasExtension(path, ".pdm"))
+    {
+        mesh = loadMeshBinary(path);
+    }
+    else if (hasExtension(path, ".pdz"))
+    {
+        mesh = loadMeshCompressed(path);
+    }
+    else
+    {
+        mesh = loadOBJ(path, flags);
+    }
+    memoryPopTag();
+    if (!mesh)
+    {
+        return NULL;
+    }
+
+    shput(paths, path, slot);
+    MeshCacheEntry* entry = &entries[slot];
+    entry->path = paths[shgeti(paths, path)].key;
+    entry->mesh = mesh;
+    entry->refCount = 1;
+    entry->bytes = meshMemorySize(mesh);
+    entry->lastUse = ++useClock;
+    cachedBytes += entry->bytes;
+
+    // Older unreferenced meshes make room for the new one
+    enforceBudget();
+    return mesh;
+}
+
+void meshCacheRelease(const Mesh* mesh)
+{
+    if (!mesh)
+    {
+        return;
+    }
+
+    MeshCacheEntry* entry = findEntry(mesh);
+    if (!entry || entry->refCount <= 0)
+    {
+        LOG_ERROR("Releasing a mesh that was not acquired from the cache");
+        return;
+    }
+
+    entry->lastUse = ++useClock;
+    if (--entry->refCount == 0)
+    {
+        enforceBudget();
+    }
+}
+
+void meshCacheSetBudget(size_t bytes)
+{
+    budgetBytes = bytes;
+    enforceBudget();
+}
+
+void meshCacheClear(void)
+{
+    for (int i = 0; i < MAX_MESHES; i++)
+    {
+        if (entries[i].path && entries[i].refCount == 0)
+        {
+            evictEntry(&entries[i]);
+        }
+    }
+}
+
+void meshCacheLogStats(void)
+{
+    LOG_INFO("Mesh cache: %zu bytes cached, budget %zu bytes", cachedBytes, budgetBytes);
+    for (int i = 0; i < MAX_MESHES; i++)
+    {
+        const MeshCacheEntry* entry = &entries[i];
+        if (entry->path)
+        {
+            LOG_INFO("  %s: %d references, %zu bytes", entry->path, entry->refCount, entry->bytes);
+        }
+    }
+}
@@ -0,0 +1,367 @@
+#include "global.h"
+#include "meshopt.h"
+#include "logging.h"
+#include "memory.h"
+#include "stb_ds.h"
+
+/* Entry of the position hash map used for welding */
+typedef struct
+{
+    Vector3D key;
+    int value;
+} WeldEntry;
+
+/* Vertex-to-face adjacency in compressed rows */
+typedef struct
+{
+    int* offsets;       /* First entry of each vertex in faces, vertexCount + 1 entries */
+    int* faces;         /* Faces using each vertex */
+} MeshAdjacency;
+
+/* Gets the three vertex indices of a face */
+static void faceVertices(const Face* face, int vertices[3])
+{
+    vertices[0] = face->a;
+    vertices[1] = face->b;
+    vertices[2] = face->c;
+}
+
+int weldMeshVertices(Mesh* mesh)
+{
+    int vertexCount = (int)arrlen(mesh->vertices);
+    int faceCount = (int)arrlen(mesh->faces);
+    if (vertexCount == 0 || mesh->block)
+    {
+        return 0;
+    }
+
+    WeldEntry* positions = NULL;
+    Vector3D* welded = NULL;
+    int* remap = (int*)pdMalloc(vertexCount * sizeof(int));
+    if (!remap)
+    {
+        return 0;
+    }
+    arrsetcap(welded, vertexCount);
+
+    for (int i = 0; i < vertexCount; i++)
+    {
+        // Adding 0 turns -0 into +0, the map compares keys bytewise
+        Vector3D v = mesh->vertices[i];
+        Vector3D key = { v.x + 0.0f, v.y + 0.0f, v.z + 0.0f };
+
+        ptrdiff_t entry = hmgeti(positions, key);
+        if (entry >= 0)
+        {
+            remap[i] = positions[entry].value;
+        }
+        else
+        {
+            remap[i] = (int)arrlen(welded);
+            hmput(positions, key, remap[i]);
+            arrput(welded, v);
+        }
+    }
+
+    for (int i = 0; i < faceCount; i++)
+    {
+        Face* face = &mesh->faces[i];
+        face->a = remap[face->a];
+        face->b = remap[face->b];
+        face->c = remap[face->c];
+    }
+
+    int removed = vertexCount - (int)arrlen(welded);
+    arrfree(mesh->vertices);
+    mesh->vertices = welded;
+    hmfree(positions);
+    pdFree(remap);
+    return removed;
+}
+
+/* Builds the list of faces using each vertex */
+static int buildAdjacency(const Mesh* mesh, MeshAdjacency* adjacency)
+{
+    int vertexCount = (int)arrlen(mesh->vertices);
+    int faceCount = (int)arrlen(mesh->faces);
+
+    adjacency->offsets = (int*)pdCalloc(vertexCount + 1, sizeof(int));
+    adjacency->faces = (int*)pdMalloc(faceCount * 3 * sizeof(int));
+    if (!adjacency->offsets || !adjacency->faces)
+    {
+        pdFree(adjacency->offsets);
+        pdFree(adjacency->faces);
+        return 1;
+    }
+
+    // Count the faces of each vertex, then turn the counts into running offsets
+    for (int i = 0; i < faceCount; i++)
+    {
+        int vertices[3];
+        faceVertices(&mesh->faces[i], vertices);
+        for (int j = 0; j < 3; j++)
+        {
+            adjacency->offsets[vertices[j] + 1]++;
+        }
+    }
+    for (int v = 0; v < vertexCount; v++)
+    {
+        adjacency->offsets[v + 1] += adjacency->offsets[v];
+    }
+
+    int* cursor = (int*)pdMalloc(vertexCount * sizeof(int));
+    if (!cursor)
+    {
+        pdFree(adjacency->offsets);
+        pdFree(adjacency->faces);
+        return 1;
+    }
+    memcpy(cursor, adjacency->offsets, vertexCount * sizeof(int));
+    for (int i = 0; i < faceCount; i++)
+    {
+        int vertices[3];
+        faceVertices(&mesh->faces[i], vertices);
+        for (int j = 0; j < 3; j++)
+        {
+            adjacency->faces[cursor[vertices[j]]++] = i;
+        }
+    }
+    pdFree(cursor);
+
+    return 0;
+}
+
+/* Picks the next vertex to fan around once the faces of the current one are emitted */
+static int nextFanVertex(const int* candidates, int candidateCount, const int* liveFaces, const int* cacheTime,
+    int time, int** deadEnds, int* cursor, int vertexCount)
+{
+    int best = -1;
+    int bestPriority = -1;
+
+    // Prefer the candidate that has been in the cache longest and will still be there after its fan
+    for (int i = 0; i < candidateCount; i++)
+    {
+        int v = candidates[i];
+        if (liveFaces[v] <= 0)
+        {
+            continue;
+        }
+
+        int priority = 0;
+        if (time - cacheTime[v] + 2 * liveFaces[v] <= MESHOPT_CACHE_SIZE)
+        {
+            priority = time - cacheTime[v];
+        }
+        if (priority > bestPriority)
+        {
+            best = v;
+            bestPriority = priority;
+        }
+    }
+    if (best >= 0)
+    {
+        return best;
+    }
+
+    // Dead end, go back to recently used vertices, then to the next vertex in input order
+    while (arrlen(*deadEnds) > 0)
+    {
+        int v = arrpop(*deadEnds);
+        if (liveFaces[v] > 0)
+        {
+            return v;
+        }
+    }
+    while (*cursor < vertexCount)
+    {
+        if (liveFaces[*cursor] > 0)
+        {
+            return (*cursor)++;
+        }
+        (*cursor)++;
+    }
+    return -1;
+}
+
+void optimizeMeshFaceOrder(Mesh* mesh)
+{
+    int vertexCount = (int)arrlen(mesh->vertices);
+    int faceCount = (int)arrlen(mesh->faces);
+    if (faceCount == 0 || mesh->block)
+    {
+        return;
+    }
+
+    MeshAdjacency adjacency;
+    if (buildAdjacency(mesh, &adjacency) != 0)
+    {
+        return;
+    }
+
+    int* liveFaces = (int*)pdMalloc(vertexCount * sizeof(int));
+    int* cacheTime = (int*)pdCalloc(vertexCount, sizeof(int));
+    uint8_t* emitted = (uint8_t*)pdCalloc(faceCount, 1);
+    Face* ordered = NULL;
+    int* deadEnds = NULL;
+    int* candidates = NULL;
+    if (!liveFaces || !cacheTime || !emitted)
+    {
+        pdFree(liveFaces);
+        pdFree(cacheTime);
+        pdFree(emitted);
+        pdFree(adjacency.offsets);
+        pdFree(adjacency.faces);
+        return;
+    }
+    for (int v = 0; v < vertexCount; v++)
+    {
+        liveFaces[v] = adjacency.offsets[v + 1] - adjacency.offsets[v];
+    }
+    arrsetcap(ordered, faceCount);
+
+    int fan = 0;
+    int time = MESHOPT_CACHE_SIZE + 1;
+    int cursor = 1;
+    while (fan >= 0)
+    {
+        arrsetlen(candidates, 0);
+
+        // Emit every remaining face around the fan vertex
+        for (int i = adjacency.offsets[fan]; i < adjacency.offsets[fan + 1]; i++)
+        {
+            int faceIndex = adjacency.faces[i];
+            if (emitted[faceIndex])
+            {
+                continue;
+            }
+            emitted[faceIndex] = 1;
+            arrput(ordered, mesh->faces[faceIndex]);
+
+            int vertices[3];
+            faceVertices(&mesh->faces[faceIndex], vertices);
+            for (int j = 0; j < 3; j++)
+            {
+                int v = vertices[j];
+                arrput(deadEnds, v);
+                arrput(candidates, v);
+                liveFaces[v]--;
+                if (time - cacheTime[v] > MESHOPT_CACHE_SIZE)
+                {
+                    cacheTime[v] = time++;
+                }
+            }
+        }
+
+        fan = nextFanVertex(candidates, (int)arrlen(candidates), liveFaces, cacheTime, time,
+            &deadEnds, &cursor, vertexCount);
+    }
+
+    // Input already in strip order can miss less than the fans, the original order is then kept
+    float acmrBefore = computeMeshACMR(mesh, MESHOPT_CACHE_SIZE);
+    Face* original = mesh->faces;
+    mesh->faces = ordered;
+    if (computeMeshACMR(mesh, MESHOPT_CACHE_SIZE) < acmrBefore)
+    {
+        arrfree(original);
+    }
+    else
+    {
+        mesh->faces = original;
+        arrfree(ordered);
+    }
+
+    arrfree(candidates);
+    arrfree(deadEnds);
+    pdFree(liveFaces);
+    pdFree(cacheTime);
+    pdFree(emitted);
+    pdFree(adjacency.offsets);
+    pdFree(adjacency.faces);
+}
+
+void reorderMeshVertices(Mesh* mesh)
+{
+    int vertexCount = (int)arrlen(mesh->vertices);
+    int faceCount = (int)arrlen(mesh->faces);
+    if (vertexCount == 0 || mesh->block)
+    {
+        return;
+    }
+
+    int* remap = (int*)pdMalloc(vertexCount * sizeof(int));
+    Vector3D* reordered = NULL;
+    if (!remap)
+    {
+        return;
+    }
+    memset(remap, 0xFF, vertexCount * sizeof(int));
+    arrsetlen(reordered, vertexCount);
+
+    int next = 0;
+    for (int i = 0; i < faceCount; i++)
+    {
+        int* vertices[3] = { &mesh->faces[i].a, &mesh->faces[i].b, &mesh->faces[i].c };
+        for (int j = 0; j < 3; j++)
+        {
+            int v = *vertices[j];
+            if (remap[v] < 0)
+            {
+                remap[v] = next;
+                reordered[next++] = mesh->vertices[v];
+            }
+            *vertices[j] = remap[v];
+        }
+    }
+
+    // Unused vertices keep their relative order after the used ones
+    for (int v = 0; v < vertexCount; v++)
+    {
+        if (remap[v] < 0)
+        {
+            reordered[next++] = mesh->vertices[v];
+        }
+    }
+
+    arrfree(mesh->vertices);
+    mesh->vertices = reordered;
+    pdFree(remap);
+}
+
+float computeMeshACMR(const Mesh* mesh, int cacheSize)
+{
+    int vertexCount = meshVertexCount(mesh);
+    int faceCount = meshFaceCount(mesh);
+    if (faceCount == 0)
+    {
+        return 0.0f;
+    }
+
+    // A vertex is in the FIFO if it entered it less than cacheSize misses ago
+    int* entryTime = (int*)pdMalloc(vertexCount * sizeof(int));
+    if (!entryTime)
+    {
+        return 0.0f;
+    }
+    for (int v = 0; v < vertexCount; v++)
+    {
+        entryTime[v] = -cacheSize - 1;
+    }
+
+    int misses = 0;
+    for (int i = 0; i < faceCount; i++)
+    {
+        Face face = meshGetFace(mesh, i);
+        int vertices[3];
+        faceVertices(&face, vertices);
+        for (int j = 0; j < 3; j++)
+        {
+            if (misses - entryTime[vertices[j]] > cacheSize)
+            {
+                entryTime[vertices[j]] = misses++;
+            }
+        }
+    }
+
+    pdFree(entryTime);
+    return (float)misses / faceCount;
+}
@@ -0,0 +1,442 @@
+#include "global.h"
+#include "meshpack.h"
+#include "lighting.h"
+#include "logging.h"
+#include "memory.h"
+#include "reader.h"
+#include "lz.h"
+#include "stb_ds.h"
+
+/* Identifier and version at the start of a compressed mesh file */
+#define MESH_PACK_MAGIC 0x315A4450 /* "PDZ1" */
+#define MESH_PACK_VERSION 2
+
+/* Largest number of faces accepted, BSP trees have at most one node per face */
+#define MESH_PACK_MAX_FACES (4 * MESH_QUANTIZED_MAX_VERTICES)
+
+/* Longest varint, enough for any 32-bit value */
+#define MESH_PACK_MAX_VARINT 5
+
+/**
+ * @brief Header at the start of a compressed mesh file, followed by the blocks.
+ */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t vertexCount;
+    uint32_t faceCount;
+    uint32_t bspNodeCount;
+    uint32_t bakedLevelCount;   /* vertexCount if the lighting is baked, 0 otherwise */
+    int32_t isConvex;
+    Vector3D boundsCenter;
+    float boundsRadius;
+    Vector3D quantizationScale;
+    Vector3D quantizationOffset;
+    uint32_t streamSize;    /* Size of the decoded stream */
+} MeshPackHeader;
+
+/**
+ * @brief Header of each block, a block whose stored size equals its raw size is not compressed.
+ */
+typedef struct
+{
+    uint16_t rawSize;
+    uint16_t storedSize;
+} MeshPackBlock;
+
+/* State of the decoder, the decoded stream is consumed from block */
+typedef struct
+{
+    BufferedReader reader;
+    uint8_t* stored;    /* Compressed bytes of the current block */
+    uint8_t* block;     /* Decoded bytes of the current block */
+    int position;
+    int length;
+    int failed;
+} MeshPackDecoder;
+
+/* Maps signed deltas to unsigned values, small magnitudes to small values */
+static inline uint32_t zigzagEncode(int32_t value)
+{
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+static inline int32_t zigzagDecode(uint32_t value)
+{
+    return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+/* Appends a value in 7-bit groups, low groups first */
+static void putVarint(uint8_t** stream, uint32_t value)
+{
+    while (value >= 0x80)
+    {
+        arrput(*stream, (uint8_t)(value | 0x80));
+        value >>= 7;
+    }
+    arrput(*stream, (uint8_t)value);
+}
+
+int saveMeshCompressed(const Mesh* mesh, const char* filename)
+{
+    if (!mesh->quantizedVertices)
+    {
+        LOG_ERROR("Only quantized meshes can be compressed");
+        return 1;
+    }
+
+    int vertexCount = meshVertexCount(mesh);
+    int faceCount = meshFaceCount(mesh);
+    int bspNodeCount = (int)arrlen(mesh->bspNodes);
+    if (faceCount > MESH_PACK_MAX_FACES || bspNodeCount > faceCount)
+    {
+        LOG_ERROR("Mesh has too many faces to be compressed: %d", faceCount);
+        return 1;
+    }
+
+    // Build the whole stream first, it is then cut into blocks
+    uint8_t* stream = NULL;
+    QuantizedVertex previous = { 0, 0, 0 };
+    for (int i = 0; i < vertexCount; i++)
+    {
+        QuantizedVertex v = mesh->quantizedVertices[i];
+        putVarint(&stream, zigzagEncode(v.x - previous.x));
+        putVarint(&stream, zigzagEncode(v.y - previous.y));
+        putVarint(&stream, zigzagEncode(v.z - previous.z));
+        previous = v;
+    }
+
+    int previousIndex = 0;
+    for (int i = 0; i < faceCount; i++)
+    {
+        QuantizedFace face = mesh->quantizedFaces[i];
+        int indices[3] = { face.a, face.b, face.c };
+        for (int j = 0; j < 3; j++)
+        {
+            putVarint(&stream, zigzagEncode(indices[j] - previousIndex));
+            previousIndex = indices[j];
+        }
+        arrput(stream, face.pattern);
+    }
+
+    // Planes are stored as they are, face ranges and children relative to the previous node
+    int nextFace = 0;
+    for (int i = 0; i < bspNodeCount; i++)
+    {
+        const BSPNode* node = &mesh->bspNodes[i];
+        memcpy(arraddnptr(stream, sizeof(Vector3D)), &node->normal, sizeof(Vector3D));
+        memcpy(arraddnptr(stream, sizeof(float)), &node->distance, sizeof(float));
+        putVarint(&stream, zigzagEncode(node->firstFace - nextFace));
+        putVarint(&stream, (uint32_t)node->faceCount);
+        putVarint(&stream, node->front < 0 ? 0 : zigzagEncode(node->front - i) + 1);
+        putVarint(&stream, node->back < 0 ? 0 : zigzagEncode(node->back - i) + 1);
+        nextFace = node->firstFace + node->faceCount;
+    }
+
+    // Baked light varies smoothly between neighbouring vertices, deltas repeat well
+    int bakedLevelCount = mesh->bakedLevels ? vertexCount : 0;
+    uint8_t previousLevel = 0;
+    for (int i = 0; i < bakedLevelCount; i++)
+    {
+        arrput(stream, (uint8_t)(mesh->bakedLevels[i] - previousLevel));
+        previousLevel = mesh->bakedLevels[i];
+    }
+
+    MeshPackHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = MESH_PACK_MAGIC;
+    header.version = MESH_PACK_VERSION;
+    header.vertexCount = (uint32_t)vertexCount;
+    header.faceCount = (uint32_t)faceCount;
+    header.bspNodeCount = (uint32_t)bspNodeCount;
+    header.bakedLevelCount = (uint32_t)bakedLevelCount;
+    header.isConvex = mesh->isConvex;
+    header.boundsCenter = mesh->boundsCenter;
+    header.boundsRadius = mesh->boundsRadius;
+    header.quantizationScale = mesh->quantizationScale;
+    header.quantizationOffset = mesh->quantizationOffset;
+    header.streamSize = (uint32_t)arrlen(stream);
+
+    SDFile* file = pd->file->open(filename, kFileWrite);
+    uint8_t* compressed = (uint8_t*)pdMalloc(MESH_PACK_BLOCK_SIZE);
+    if (!file || !compressed)
+    {
+        LOG_ERROR("Failed to open file for writing: %s", filename);
+        if (file)
+        {
+            pd->file->close(file);
+        }
+        pdFree(compressed);
+        arrfree(stream);
+        return 1;
+    }
+
+    int fileSize = sizeof(header);
+    int failed = pd->file->write(file, &header, sizeof(header)) != (int)sizeof(header);
+    for (int offset = 0; offset < (int)header.streamSize && !failed; offset += MESH_PACK_BLOCK_SIZE)
+    {
+        int rawSize = (int)header.streamSize - offset;
+        if (rawSize > MESH_PACK_BLOCK_SIZE)
+        {
+            rawSize = MESH_PACK_BLOCK_SIZE;
+        }
+
+        // A block that does not shrink is stored as it is
+        int storedSize = lzCompress(stream + offset, rawSize, compressed, rawSize - 1);
+        const uint8_t* data = storedSize > 0 ? compressed : stream + offset;
+        if (storedSize == 0)
+        {
+            storedSize = rawSize;
+        }
+
+        MeshPackBlock block = { (uint16_t)rawSize, (uint16_t)storedSize };
+        failed = pd->file->write(file, &block, sizeof(block)) != (int)sizeof(block) ||
+            pd->file->write(file, data, storedSize) != storedSize;
+        fileSize += sizeof(block) + storedSize;
+    }
+    pd->file->close(file);
+    pdFree(compressed);
+    arrfree(stream);
+
+    if (failed)
+    {
+        LOG_ERROR("Failed to write compressed mesh: %s", filename);
+        return 1;
+    }
+
+    LOG_INFO("Saved compressed mesh with %d vertices and %d faces, %u byte stream in %d bytes", vertexCount,
+        faceCount, header.streamSize, fileSize);
+    return 0;
+}
+
+/* Reads and decodes the next block of the stream */
+static int nextBlock(MeshPackDecoder* decoder)
+{
+    MeshPackBlock block;
+    if (readerRead(&decoder->reader, &block, sizeof(block)) != (int)sizeof(block) ||
+        block.rawSize == 0 || block.rawSize > MESH_PACK_BLOCK_SIZE || block.storedSize > block.rawSize)
+    {
+        return 1;
+    }
+
+    if (block.storedSize == block.rawSize)
+    {
+        if (readerRead(&decoder->reader, decoder->block, block.rawSize) != block.rawSize)
+        {
+            return 1;
+        }
+    }
+    else if (readerRead(&decoder->reader, decoder->stored, block.storedSize) != block.storedSize ||
+        lzDecompress(decoder->stored, block.storedSize, decoder->block, block.rawSize) != 0)
+    {
+        return 1;
+    }
+
+    decoder->position = 0;
+    decoder->length = block.rawSize;
+    return 0;
+}
+
+/* Gets the next byte of the stream, or 0 once the decoder failed */
+static inline uint8_t nextByte(MeshPackDecoder* decoder)
+{
+    if (decoder->position == decoder->length && (decoder->failed || nextBlock(decoder) != 0))
+    {
+        decoder->failed = 1;
+        return 0;
+    }
+    return decoder->block[decoder->position++];
+}
+
+static inline uint32_t nextVarint(MeshPackDecoder* decoder)
+{
+    uint32_t value = 0;
+    for (int shift = 0; shift < 7 * MESH_PACK_MAX_VARINT; shift += 7)
+    {
+        uint8_t byte = nextByte(decoder);
+        value |= (uint32_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+        {
+            return value;
+        }
+    }
+    decoder->failed = 1;
+    return 0;
+}
+
+/* Copies bytes of the stream, a block at a time */
+static void nextBytes(MeshPackDecoder* decoder, void* data, int size)
+{
+    uint8_t* out = (uint8_t*)data;
+    while (size > 0 && !decoder->failed)
+    {
+        if (decoder->position == decoder->length && nextBlock(decoder) != 0)
+        {
+            decoder->failed = 1;
+            return;
+        }
+
+        int chunk = decoder->length - decoder->position;
+        if (chunk > size)
+        {
+            chunk = size;
+        }
+        memcpy(out, decoder->block + decoder->position, chunk);
+        decoder->position += chunk;
+        out += chunk;
+        size -= chunk;
+    }
+}
+
+/* Decodes the arrays of the stream into the mesh */
+static int decodeMesh(MeshPackDecoder* decoder, const MeshPackHeader* header, Mesh* mesh)
+{
+    int vertexCount = (int)header->vertexCount;
+    int faceCount = (int)header->faceCount;
+    arrsetlen(mesh->quantizedVertices, vertexCount);
+    arrsetlen(mesh->quantizedFaces, faceCount);
+    if (header->bspNodeCount > 0)
+    {
+        arrsetlen(mesh->bspNodes, header->bspNodeCount);
+    }
+    if (header->bakedLevelCount > 0)
+    {
+        arrsetlen(mesh->bakedLevels, vertexCount);
+    }
+
+    QuantizedVertex previous = { 0, 0, 0 };
+    for (int i = 0; i < vertexCount; i++)
+    {
+        previous.x = (int16_t)(previous.x + zigzagDecode(nextVarint(decoder)));
+        previous.y = (int16_t)(previous.y + zigzagDecode(nextVarint(decoder)));
+        previous.z = (int16_t)(previous.z + zigzagDecode(nextVarint(decoder)));
+        mesh->quantizedVertices[i] = previous;
+    }
+
+    // Deltas are summed in 64 bits so that a corrupt one cannot overflow before the range check
+    int64_t index = 0;
+    for (int i = 0; i < faceCount; i++)
+    {
+        int indices[3];
+        for (int j = 0; j < 3; j++)
+        {
+            index += zigzagDecode(nextVarint(decoder));
+            if (index < 0 || index >= vertexCount)
+            {
+                return 1;
+            }
+            indices[j] = (int)index;
+        }
+        QuantizedFace* face = &mesh->quantizedFaces[i];
+        face->a = (uint16_t)indices[0];
+        face->b = (uint16_t)indices[1];
+        face->c = (uint16_t)indices[2];
+        face->pattern = nextByte(decoder);
+        if (face->pattern >= LIGHT_LEVELS)
+        {
+            return 1;
+        }
+    }
+
+    int nodeCount = (int)header->bspNodeCount;
+    int nextFace = 0;
+    for (int i = 0; i < nodeCount && !decoder->failed; i++)
+    {
+        BSPNode* node = &mesh->bspNodes[i];
+        nextBytes(decoder, &node->normal, sizeof(Vector3D));
+        nextBytes(decoder, &node->distance, sizeof(float));
+        int64_t firstFace = (int64_t)nextFace + zigzagDecode(nextVarint(decoder));
+        uint32_t nodeFaceCount = nextVarint(decoder);
+        uint32_t front = nextVarint(decoder);
+        uint32_t back = nextVarint(decoder);
+        int64_t frontIndex = front == 0 ? -1 : (int64_t)i + zigzagDecode(front - 1);
+        int64_t backIndex = back == 0 ? -1 : (int64_t)i + zigzagDecode(back - 1);
+
+        // Traversal trusts these, so a corrupt file must not reach out of the arrays. Children are
+        // always stored after their parent, which also rules out any cycle
+        if (firstFace < 0 || firstFace > faceCount || nodeFaceCount > (uint32_t)(faceCount - firstFace) ||
+            (frontIndex != -1 && (frontIndex <= i || frontIndex >= nodeCount)) ||
+            (backIndex != -1 && (backIndex <= i || backIndex >= nodeCount)))
+        {
+            return 1;
+        }
+        node->firstFace = (int)firstFace;
+        node->faceCount = (int)nodeFaceCount;
+        node->front = (int)frontIndex;
+        node->back = (int)backIndex;
+        nextFace = node->firstFace + node->faceCount;
+    }
+
+    uint8_t level = 0;
+    for (int i = 0; mesh->bakedLevels && i < vertexCount; i++)
+    {
+        level = (uint8_t)(level + nextByte(decoder));
+        if (level >= DITHER_LEVELS)
+        {
+            return 1;
+        }
+        mesh->bakedLevels[i] = level;
+    }
+
+    return decoder->failed;
+}
+
+Mesh* loadMeshCompressed(const char* filename)
+{
+    unsigned int startTime = pd->system->getCurrentTimeMilliseconds();
+
+    MeshPackDecoder decoder;
+    memset(&decoder, 0, sizeof(decoder));
+    if (readerOpen(&decoder.reader, filename) != 0)
+    {
+        return NULL;
+    }
+
+    MeshPackHeader header;
+    if (readerRead(&decoder.reader, &header, sizeof(header)) != (int)sizeof(header) ||
+        header.magic != MESH_PACK_MAGIC || header.version != MESH_PACK_VERSION ||
+        header.vertexCount == 0 || header.vertexCount > MESH_QUANTIZED_MAX_VERTICES ||
+        header.faceCount == 0 || header.faceCount > MESH_PACK_MAX_FACES || header.bspNodeCount > header.faceCount ||
+        (header.bakedLevelCount != 0 && header.bakedLevelCount != header.vertexCount))
+    {
+        LOG_ERROR("Invalid compressed mesh: %s", filename);
+        readerClose(&decoder.reader);
+        return NULL;
+    }
+
+    memoryPushTag(kMemoryTagAsset);
+    decoder.stored = (uint8_t*)pdMalloc(2 * MESH_PACK_BLOCK_SIZE);
+    memoryPopTag();
+    decoder.block = decoder.stored + MESH_PACK_BLOCK_SIZE;
+
+    memoryPushTag(kMemoryTagMesh);
+    Mesh* mesh = decoder.stored ? allocMesh() : NULL;
+    int failed = !mesh || decodeMesh(&decoder, &header, mesh) != 0;
+    memoryPopTag();
+
+    int fileSize = decoder.reader.totalRead;
+    pdFree(decoder.stored);
+    readerClose(&decoder.reader);
+
+    if (failed)
+    {
+        LOG_ERROR("Failed to decode compressed mesh: %s", filename);
+        if (mesh)
+        {
+            freeMesh(mesh);
+        }
+        return NULL;
+    }
+
+    mesh->isConvex = header.isConvex;
+    mesh->boundsCenter = header.boundsCenter;
+    mesh->boundsRadius = header.boundsRadius;
+    mesh->quantizationScale = header.quantizationScale;
+    mesh->quantizationOffset = header.quantizationOffset;
+    computeMeshNormals(mesh);
+
+    LOG_INFO("Loaded compressed mesh with %d vertices and %d faces from %d bytes in %u ms", meshVertexCount(mesh),
+        meshFaceCount(mesh), fileSize, pd->system->getCurrentTimeMilliseconds() - startTime);
+    return mesh;
+}
@@ -0,0 +1,133 @@
+#include "global.h"
+#include "reader.h"
+#include "logging.h"
+#include "memory.h"
+
+/* Moves the unread bytes to the front of the buffer and fills the rest from the file */
+static int refill(BufferedReader* reader)
+{
+    int remaining = reader->length - reader->position;
+    if (remaining > 0 && reader->position > 0)
+    {
+        memmove(reader->buffer, reader->buffer + reader->position, remaining);
+    }
+    reader->position = 0;
+    reader->length = remaining;
+
+    if (reader->endOfFile || remaining == READER_BUFFER_SIZE)
+    {
+        return 0;
+    }
+
+    int bytesRead = pd->file->read(reader->file, reader->buffer + remaining, READER_BUFFER_SIZE - remaining);
+    if (bytesRead <= 0)
+    {
+        if (bytesRead < 0)
+        {
+            LOG_ERROR("Failed to read file");
+        }
+        reader->endOfFile = 1;
+        return 0;
+    }
+
+    reader->length += bytesRead;
+    reader->totalRead += bytesRead;
+    return bytesRead;
+}
+
+int readerOpen(BufferedReader* reader, const char* filename)
+{
+    memset(reader, 0, sizeof(*reader));
+
+    reader->file = pd->file->open(filename, kFileRead);
+    if (!reader->file)
+    {
+        LOG_ERROR("Failed to open file: %s", filename);
+        return 1;
+    }
+
+    memoryPushTag(kMemoryTagAsset);
+    reader->buffer = (char*)pdMalloc(READER_BUFFER_SIZE + 1);
+    memoryPopTag();
+    if (!reader->buffer)
+    {
+        pd->file->close(reader->file);
+        reader->file = NULL;
+        return 1;
+    }
+
+    return 0;
+}
+
+char* readerNextLine(BufferedReader* reader, int* length)
+{
+    char* newline = NULL;
+    while (1)
+    {
+        int remaining = reader->length - reader->position;
+        newline = (char*)memchr(reader->buffer + reader->position, '\n', remaining);
+        if (newline || refill(reader) == 0)
+        {
+            break;
+        }
+    }
+
+    int remaining = reader->length - reader->position;
+    if (remaining == 0)
+    {
+        return NULL;
+    }
+
+    // Without a newline the line ends at the end of the file, or is longer than the buffer
+    char* line = reader->buffer + reader->position;
+    char* end = newline ? newline : line + remaining;
+    reader->position = (int)(end - reader->buffer) + (newline ? 1 : 0);
+
+    if (end > line && end[-1] == '\r')
+    {
+        end--;
+    }
+    *end = '\0';
+
+    if (length)
+    {
+        *length = (int)(end - line);
+    }
+    return line;
+}
+
+int readerRead(BufferedReader* reader, void* data, int size)
+{
+    uint8_t* out = (uint8_t*)data;
+    int copied = 0;
+
+    while (copied < size)
+    {
+        if (reader->position == reader->length && refill(reader) == 0)
+        {
+            break;
+        }
+
+        int chunk = reader->length - reader->position;
+        if (chunk > size - copied)
+        {
+            chunk = size - copied;
+        }
+        memcpy(out + copied, reader->buffer + reader->position, chunk);
+        reader->position += chunk;
+        copied += chunk;
+    }
+
+    return copied;
+}
+
+void readerClose(BufferedReader* reader)
+{
+    if (reader->file)
+    {
+        pd->file->close(reader->file);
+        reader->file = NULL;
+    }
+    pdFree(reader->buffer);
+    reader->buffer = NULL;
+}
@@ -0,0 +1,462 @@
+#include "global.h"
+#include "scanline.h"
+#include "display.h"
+#include "logging.h"
+#include "memory.h"
+
+/**
+ * @brief Represents a non-horizontal triangle edge in the edge table.
+ */
+typedef struct
+{
+    float x;        /* x-coordinate at the center of the current scanline */
+    float dxdy;     /* Change of x per scanline */
+    float yTop;     /* Top of the edge */
+    float yBottom;  /* Bottom of the edge */
+    int yLast;      /* Last scanline whose center the edge crosses */
+    int polygon;    /* Index of the owning polygon */
+    int next;       /* Next edge starting on the same scanline, -1 at the end */
+} ScanEdge;
+
+/**
+ * @brief Represents a triangle being scan converted.
+ */
+typedef struct
+{
+    float depthDx;      /* Change of 1/z per pixel along x */
+    float depthDy;      /* Change of 1/z per pixel along y */
+    float depth0;       /* 1/z at the screen origin */
+    float rowDepth;     /* 1/z at x = 0 on the current scanline */
+    float levelDx;      /* Change of the dither level per pixel along x, smooth triangles only */
+    float levelDy;      /* Change of the dither level per pixel along y */
+    float level0;       /* Dither level at the screen origin */
+    float rowLevel;     /* Dither level at x = 0 on the current scanline */
+    int smooth;         /* Non-zero to dither the levels instead of using the pattern */
+    LCDPattern* pattern; /* Pattern of the triangle, NULL for solid white */
+    const Texture* texture; /* Texture of the triangle, NULL if untextured */
+    float uvwDx[3];     /* Change of u/z, v/z and 1/z per pixel along x, textured triangles only */
+    float uvwDy[3];     /* Change of u/z, v/z and 1/z per pixel along y */
+    float uvw0[3];      /* u/z, v/z and 1/z at the screen origin */
+    float rowUvw[3];    /* u/z, v/z and 1/z at x = 0 on the current scanline */
+    int inside;         /* Toggled by each edge crossed while walking a scanline */
+    int bandStart[2];   /* Outline pixels of the left and right edges on the current scanline */
+    int bandEnd[2];
+    int bandCount;      /* Number of edge bands found on the current scanline */
+} ScanPolygon;
+
+/* Scene-wide edge table, one bucket of edges per starting scanline, allocated from the frame arena */
+static int edgeTable[LCD_ROWS];
+static ScanEdge* edges = NULL;
+static ScanPolygon* polygons = NULL;
+static int edgeCount, polygonCount;
+
+/* Active edge list and the polygons covering the current span */
+static int* activeEdges = NULL;
+static int* activePolygons = NULL;
+static int activeEdgeCount, activePolygonCount;
+
+/* Composition of the current row, written to the framebuffer once complete */
+static uint8_t rowData[LCD_ROWSIZE];
+static uint8_t rowMask[LCD_ROWSIZE];
+static uint8_t rowOutline[LCD_ROWSIZE];
+
+/* Visible span waiting to be merged with the next one */
+static int pendingStart, pendingEnd;
+static int pendingPolygon;
+
+/* Add an edge of a triangle to the edge table */
+static void addEdge(Vector2D p0, Vector2D p1, int polygon)
+{
+    if (p0.y > p1.y)
+    {
+        Vector2D temp = p0;
+        p0 = p1;
+        p1 = temp;
+    }
+
+    // Scanlines whose center lies in [top, bottom)
+    int yFirst = (int)ceilf(p0.y - 0.5f);
+    int yLast = (int)ceilf(p1.y - 0.5f) - 1;
+    if (yFirst > yLast || yLast < 0 || yFirst >= LCD_ROWS)
+    {
+        return;
+    }
+    if (yFirst < 0) yFirst = 0;
+    if (yLast >= LCD_ROWS) yLast = LCD_ROWS - 1;
+
+    ScanEdge edge;
+    edge.dxdy = (p1.x - p0.x) / (p1.y - p0.y);
+    edge.x = p0.x + (yFirst + 0.5f - p0.y) * edge.dxdy;
+    edge.yTop = p0.y;
+    edge.yBottom = p1.y;
+    edge.yLast = yLast;
+    edge.polygon = polygon;
+    edge.next = edgeTable[yFirst];
+    edgeTable[yFirst] = edgeCount;
+    edges[edgeCount++] = edge;
+}
+
+/* Get the plane through the values at the three points of a triangle */
+static void trianglePlane(const Vector2D* p, float area, const float value[3], float* dx, float* dy, float* origin)
+{
+    *dx = ((value[1] - value[0]) * (p[2].y - p[0].y) - (value[2] - value[0]) * (p[1].y - p[0].y)) / area;
+    *dy = ((value[2] - value[0]) * (p[1].x - p[0].x) - (value[1] - value[0]) * (p[2].x - p[0].x)) / area;
+    *origin = value[0] - *dx * p[0].x - *dy * p[0].y;
+}
+
+/* Build the edge table and the depth, level and texture planes of all the triangles */
+static void buildEdgeTable(const Triangle2D* triangles, int count)
+{
+    edgeCount = 0;
+    polygonCount = 0;
+    for (int y = 0; y < LCD_ROWS; y++)
+    {
+        edgeTable[y] = -1;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        const Vector2D* p = triangles[i].points;
+        float area = (p[1].x - p[0].x) * (p[2].y - p[0].y) - (p[2].x - p[0].x) * (p[1].y - p[0].y);
+        if (floatIsZero(area) || triangles[i].depths[0] <= 0.0f ||
+            triangles[i].depths[1] <= 0.0f || triangles[i].depths[2] <= 0.0f)
+        {
+            continue;
+        }
+
+        // 1/z is linear in screen space, get the plane through the three points
+        float w[3];
+        for (int j = 0; j < 3; j++)
+        {
+            w[j] = 1.0f / triangles[i].depths[j];
+        }
+
+        ScanPolygon polygon;
+        trianglePlane(p, area, w, &polygon.depthDx, &polygon.depthDy, &polygon.depth0);
+        polygon.pattern = triangles[i].pattern;
+        polygon.smooth = triangles[i].smooth;
+        polygon.texture = triangles[i].texture;
+        polygon.inside = 0;
+
+        polygon.levelDx = polygon.levelDy = polygon.level0 = 0.0f;
+        if (polygon.smooth)
+        {
+            float levels[3] = { triangles[i].levels[0], triangles[i].levels[1], triangles[i].levels[2] };
+            trianglePlane(p, area, levels, &polygon.levelDx, &polygon.levelDy, &polygon.level0);
+        }
+
+        for (int j = 0; j < 3; j++)
+        {
+            polygon.uvwDx[j] = polygon.uvwDy[j] = polygon.uvw0[j] = 0.0f;
+        }
+        if (polygon.texture)
+        {
+            // u/z and v/z are linear in screen space like 1/z
+            float u[3], v[3];
+            for (int j = 0; j < 3; j++)
+            {
+                u[j] = triangles[i].uvs[j].x * w[j];
+                v[j] = triangles[i].uvs[j].y * w[j];
+            }
+            trianglePlane(p, area, u, &polygon.uvwDx[0], &polygon.uvwDy[0], &polygon.uvw0[0]);
+            trianglePlane(p, area, v, &polygon.uvwDx[1], &polygon.uvwDy[1], &polygon.uvw0[1]);
+            polygon.uvwDx[2] = polygon.depthDx;
+            polygon.uvwDy[2] = polygon.depthDy;
+            polygon.uvw0[2] = polygon.depth0;
+        }
+
+        int index = polygonCount++;
+        polygons[index] = polygon;
+        addEdge(p[0], p[1], index);
+        addEdge(p[1], p[2], index);
+        addEdge(p[2], p[0], index);
+    }
+}
+
+/* Write the pending span into the row composition */
+static void flushPendingSpan(int y)
+{
+    if (pendingStart > pendingEnd)
+    {
+        return;
+    }
+
+    const ScanPolygon* polygon = &polygons[pendingPolygon];
+    SpanShade shade;
+    if (polygon->texture)
+    {
+        spanShadeTextured(&shade, polygon->texture, y, pendingStart, pendingEnd, polygon->rowUvw, polygon->uvwDx);
+    }
+    else if (polygon->smooth)
+    {
+        spanShadeSmooth(&shade, y, pendingStart, pendingEnd,
+            polygon->rowLevel + polygon->levelDx * (pendingStart + 0.5f),
+            polygon->rowLevel + polygon->levelDx * (pendingEnd + 0.5f));
+    }
+    else
+    {
+        spanShadeFlat(&shade, polygon->pattern ? (*polygon->pattern)[y & 7] : 0xFF);
+    }
+
+    for (int byteIndex = pendingStart >> 3; byteIndex <= pendingEnd >> 3; byteIndex++)
+    {
+        uint8_t mask = 0xFF;
+        if (byteIndex == pendingStart >> 3) mask &= 0xFF >> (pendingStart & 7);
+        if (byteIndex == pendingEnd >> 3) mask &= 0xFF << (7 - (pendingEnd & 7));
+        rowData[byteIndex] = (rowData[byteIndex] & ~mask) | (spanShadeByte(&shade, byteIndex) & mask);
+        rowMask[byteIndex] |= mask;
+    }
+    pendingStart = 0;
+    pendingEnd = -1;
+}
+
+/* Mark the pixels of a range as outline */
+static void addOutline(int start, int end)
+{
+    for (int x = start; x <= end; x++)
+    {
+        rowOutline[x >> 3] |= 0x80 >> (x & 7);
+    }
+}
+
+/* Emit a visible span of a polygon, merging it with the pending span if possible */
+static void emitSpan(int y, int start, int end, int polygonIndex, int outline)
+{
+    ScanPolygon* polygon = &polygons[polygonIndex];
+
+    // Flat spans merge across polygons sharing a pattern, smooth and textured spans only continue their own polygon
+    const ScanPolygon* pending = &polygons[pendingPolygon];
+    int mergeable = polygon->smooth || polygon->texture ? polygonIndex == pendingPolygon :
+        !pending->smooth && !pending->texture && polygon->pattern == pending->pattern;
+    if (start == pendingEnd + 1 && mergeable)
+    {
+        pendingEnd = end;
+    }
+    else
+    {
+        flushPendingSpan(y);
+        pendingStart = start;
+        pendingEnd = end;
+        pendingPolygon = polygonIndex;
+    }
+
+    if (outline)
+    {
+        for (int i = 0; i < polygon->bandCount; i++)
+        {
+            int bandStart = polygon->bandStart[i] > start ? polygon->bandStart[i] : start;
+            int bandEnd = polygon->bandEnd[i] < end ? polygon->bandEnd[i] : end;
+            addOutline(bandStart, bandEnd);
+        }
+    }
+}
+
+/* Resolve the visible polygons over a range of pixels covered by the active polygons */
+static void resolveSpan(int y, int start, int end, int outline)
+{
+    int activeCount = activePolygonCount;
+
+    while (start <= end)
+    {
+        // Find the nearest polygon at the first pixel
+        float centerX = start + 0.5f;
+        int best = activePolygons[0];
+        float bestDepth = polygons[best].rowDepth + polygons[best].depthDx * centerX;
+        for (int i = 1; i < activeCount; i++)
+        {
+            const ScanPolygon* polygon = &polygons[activePolygons[i]];
+            float depth = polygon->rowDepth + polygon->depthDx * centerX;
+            if (depth > bestDepth)
+            {
+                best = activePolygons[i];
+                bestDepth = depth;
+            }
+        }
+
+        // Stop where another polygon comes in front of it
+        int spanEnd = end;
+        const ScanPolygon* nearest = &polygons[best];
+        for (int i = 0; i < activeCount; i++)
+        {
+            const ScanPolygon* polygon = &polygons[activePolygons[i]];
+            float slope = polygon->depthDx - nearest->depthDx;
+            if (activePolygons[i] == best || slope <= 0.0f)
+            {
+                continue;
+            }
+
+            float crossing = (nearest->rowDepth - polygon->rowDepth) / slope;
+            int crossingPixel = (int)ceilf(crossing - 0.5f);
+            if (crossingPixel - 1 < spanEnd)
+            {
+                spanEnd = crossingPixel - 1 > start ? crossingPixel - 1 : start;
+            }
+        }
+
+        emitSpan(y, start, spanEnd, best, outline);
+        start = spanEnd + 1;
+    }
+}
+
+/* Add a polygon to the active set, or remove it when its second edge is crossed */
+static void togglePolygon(int polygonIndex)
+{
+    ScanPolygon* polygon = &polygons[polygonIndex];
+    polygon->inside = !polygon->inside;
+
+    if (polygon->inside)
+    {
+        activePolygons[activePolygonCount++] = polygonIndex;
+        return;
+    }
+
+    for (int i = 0; i < activePolygonCount; i++)
+    {
+        if (activePolygons[i] == polygonIndex)
+        {
+            activePolygons[i] = activePolygons[--activePolygonCount];
+            break;
+        }
+    }
+}
+
+/* Store the pixels the edge covers on a scanline as an outline band of its polygon */
+static void addEdgeBand(const ScanEdge* edge, int y)
+{
+    ScanPolygon* polygon = &polygons[edge->polygon];
+    if (polygon->bandCount >= 2)
+    {
+        return;
+    }
+
+    // The edge crosses the row between its top and bottom, clamped to its own extent
+    float top = fmaxf((float)y, edge->yTop);
+    float bottom = fminf(y + 1.0f, edge->yBottom);
+    float xTop = edge->x + (top - (y + 0.5f)) * edge->dxdy;
+    float xBottom = edge->x + (bottom - (y + 0.5f)) * edge->dxdy;
+
+    int start = (int)floorf(fminf(xTop, xBottom));
+    int end = (int)floorf(fmaxf(xTop, xBottom));
+    polygon->bandStart[polygon->bandCount] = start < 0 ? 0 : start;
+    polygon->bandEnd[polygon->bandCount] = end >= LCD_COLUMNS ? LCD_COLUMNS - 1 : end;
+    polygon->bandCount++;
+}
+
+size_t scanlineFrameBytes(int count)
+{
+    // Same four tables as drawScanlineTriangles, each padded to the arena alignment
+    return 3 * count * sizeof(ScanEdge) + count * sizeof(ScanPolygon) + 4 * count * sizeof(int) +
+        4 * MEMORY_ARENA_ALIGNMENT;
+}
+
+void drawScanlineTriangles(const Triangle2D* triangles, int count, int outline)
+{
+    // Every triangle adds at most three edges, all of them may be active on a scanline
+    edges = (ScanEdge*)arenaAlloc(&frameArena, 3 * count * sizeof(ScanEdge));
+    polygons = (ScanPolygon*)arenaAlloc(&frameArena, count * sizeof(ScanPolygon));
+    activeEdges = (int*)arenaAlloc(&frameArena, 3 * count * sizeof(int));
+    activePolygons = (int*)arenaAlloc(&frameArena, count * sizeof(int));
+    if (count == 0 || !edges || !polygons || !activeEdges || !activePolygons)
+    {
+        return;
+    }
+
+    buildEdgeTable(triangles, count);
+    activeEdgeCount = 0;
+
+    for (int y = 0; y < LCD_ROWS; y++)
+    {
+        // Move the edges starting on this scanline into the active edge list
+        for (int e = edgeTable[y]; e >= 0; e = edges[e].next)
+        {
+            activeEdges[activeEdgeCount++] = e;
+        }
+
+        int activeCount = activeEdgeCount;
+        if (activeCount == 0)
+        {
+            continue;
+        }
+
+        // Keep the list sorted by x, it is nearly sorted from the previous scanline
+        for (int i = 1; i < activeCount; i++)
+        {
+            int edge = activeEdges[i];
+            int j = i - 1;
+            while (j >= 0 && edges[activeEdges[j]].x > edges[edge].x)
+            {
+                activeEdges[j + 1] = activeEdges[j];
+                j--;
+            }
+            activeEdges[j + 1] = edge;
+        }
+
+        memset(rowMask, 0, sizeof(rowMask));
+        memset(rowOutline, 0, sizeof(rowOutline));
+        pendingStart = 0;
+        pendingEnd = -1;
+        pendingPolygon = 0;
+        activePolygonCount = 0;
+
+        for (int i = 0; i < activeCount; i++)
+        {
+            ScanPolygon* polygon = &polygons[edges[activeEdges[i]].polygon];
+            polygon->rowDepth = polygon->depth0 + polygon->depthDy * (y + 0.5f);
+            polygon->rowLevel = polygon->level0 + polygon->levelDy * (y + 0.5f);
+            for (int j = 0; j < 3; j++)
+            {
+                polygon->rowUvw[j] = polygon->uvw0[j] + polygon->uvwDy[j] * (y + 0.5f);
+            }
+            polygon->bandCount = 0;
+            polygon->inside = 0;
+        }
+        if (outline)
+        {
+            for (int i = 0; i < activeCount; i++)
+            {
+                addEdgeBand(&edges[activeEdges[i]], y);
+            }
+        }
+
+        // Walk the edges left to right, the covered pixels between two edges are resolved by depth
+        for (int i = 0; i < activeCount; i++)
+        {
+            const ScanEdge* edge = &edges[activeEdges[i]];
+            if (i > 0 && activePolygonCount > 0)
+            {
+                int start = (int)ceilf(edges[activeEdges[i - 1]].x - 0.5f);
+                int end = (int)ceilf(edge->x - 0.5f) - 1;
+                if (start < 0) start = 0;
+                if (end >= LCD_COLUMNS) end = LCD_COLUMNS - 1;
+                if (start <= end)
+                {
+                    resolveSpan(y, start, end, outline);
+                }
+            }
+            togglePolygon(edge->polygon);
+        }
+        flushPendingSpan(y);
+
+        if (outline)
+        {
+            for (int i = 0; i < LCD_ROWSIZE; i++)
+            {
+                rowData[i] &= ~rowOutline[i];
+            }
+        }
+        drawRowMasked(y, rowData, rowMask);
+
+        // Step the edges to the next scanline and drop the finished ones
+        int kept = 0;
+        for (int i = 0; i < activeCount; i++)
+        {
+            ScanEdge* edge = &edges[activeEdges[i]];
+            if (edge->yLast > y)
+            {
+                edge->x += edge->dxdy;
+                activeEdges[kept++] = activeEdges[i];
+            }
+        }
+        activeEdgeCount = kept;
+    }
+}
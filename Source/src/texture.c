@@ -0,0 +1,182 @@
+#include "global.h"
+#include "texture.h"
+#include "logging.h"
+#include "memory.h"
+#include "utils.h"
+
+/* Get the base-2 logarithm of a power of two, -1 if the value is not one */
+static int powerOfTwoShift(int value)
+{
+    if (value <= 0 || (value & (value - 1)) != 0)
+    {
+        return -1;
+    }
+
+    int shift = 0;
+    while ((1 << shift) < value)
+    {
+        shift++;
+    }
+    return shift;
+}
+
+/* Get the number of bytes of the texels of a texture */
+static int textureDataSize(int width, int height, TextureFormat format)
+{
+    return format == kTextureFormat1Bit ? width * height / 8 : width * height / 2;
+}
+
+Texture* createTexture(int width, int height, TextureFormat format)
+{
+    int widthShift = powerOfTwoShift(width);
+    if (widthShift < TEXTURE_TILE_SHIFT || width > TEXTURE_MAX_SIZE ||
+        powerOfTwoShift(height) < TEXTURE_TILE_SHIFT || height > TEXTURE_MAX_SIZE)
+    {
+        LOG_ERROR("Texture size %dx%d is not a power of two from 8 to %d", width, height, TEXTURE_MAX_SIZE);
+        return NULL;
+    }
+
+    memoryPushTag(kMemoryTagAsset);
+    Texture* texture = (Texture*)pdMalloc(sizeof(Texture));
+    uint8_t* data = (uint8_t*)pdCalloc(textureDataSize(width, height, format), 1);
+    memoryPopTag();
+    if (!texture || !data)
+    {
+        LOG_ERROR("Failed to allocate a %dx%d texture", width, height);
+        pdFree(texture);
+        pdFree(data);
+        return NULL;
+    }
+
+    texture->data = data;
+    texture->width = width;
+    texture->height = height;
+    texture->tileColumnShift = widthShift - TEXTURE_TILE_SHIFT;
+    texture->format = format;
+    texture->next = NULL;
+    return texture;
+}
+
+Texture* loadTexture(const char* path)
+{
+    const char* error = NULL;
+    LCDBitmap* bitmap = pd->graphics->loadBitmap(path, &error);
+    if (!bitmap)
+    {
+        LOG_ERROR("Failed to load texture %s: %s", path, error ? error : "unknown error");
+        return NULL;
+    }
+
+    int width, height, rowBytes;
+    uint8_t* mask = NULL;
+    uint8_t* data = NULL;
+    pd->graphics->getBitmapData(bitmap, &width, &height, &rowBytes, &mask, &data);
+
+    Texture* texture = createTexture(width, height, kTextureFormat1Bit);
+    if (texture)
+    {
+        // Bitmap rows are already packed high bit first, each tile row is one byte of them
+        for (int y = 0; y < height; y++)
+        {
+            for (int tileX = 0; tileX < width >> TEXTURE_TILE_SHIFT; tileX++)
+            {
+                uint8_t bits = data[y * rowBytes + tileX];
+                if (mask)
+                {
+                    bits &= mask[y * rowBytes + tileX];
+                }
+                int tile = ((y >> TEXTURE_TILE_SHIFT) << texture->tileColumnShift) + tileX;
+                texture->data[(tile << 3) + (y & 7)] = bits;
+            }
+        }
+    }
+
+    pd->graphics->freeBitmap(bitmap);
+    if (texture && buildTextureMipmaps(texture) != 0)
+    {
+        freeTexture(texture);
+        return NULL;
+    }
+    return texture;
+}
+
+/* Get a texel as a 4-bit intensity whatever the format */
+static int texelIntensity(const Texture* texture, int x, int y)
+{
+    uint8_t texel = textureGetTexel(texture, x, y);
+    return texture->format == kTextureFormat1Bit ? texel * (TEXTURE_4BIT_LEVELS - 1) : texel;
+}
+
+int buildTextureMipmaps(Texture* texture)
+{
+    freeTexture(texture->next);
+    texture->next = NULL;
+
+    Texture* level = texture;
+    while (level->width > (1 << TEXTURE_TILE_SHIFT) && level->height > (1 << TEXTURE_TILE_SHIFT))
+    {
+        Texture* next = createTexture(level->width >> 1, level->height >> 1, kTextureFormat4Bit);
+        if (!next)
+        {
+            return 1;
+        }
+
+        // Box filter, rounded to the nearest intensity
+        for (int y = 0; y < next->height; y++)
+        {
+            for (int x = 0; x < next->width; x++)
+            {
+                int sum = texelIntensity(level, 2 * x, 2 * y) + texelIntensity(level, 2 * x + 1, 2 * y) +
+                    texelIntensity(level, 2 * x, 2 * y + 1) + texelIntensity(level, 2 * x + 1, 2 * y + 1);
+                textureSetTexel(next, x, y, (uint8_t)((sum + 2) >> 2));
+            }
+        }
+
+        level->next = next;
+        level = next;
+    }
+    return 0;
+}
+
+const Texture* textureMipLevel(const Texture* texture, float texelArea, float pixelArea)
+{
+    // Each level quarters the texel area, stop at the level where a texel is nearest to a pixel
+    float ratio = fabsf(texelArea) / fabsf(pixelArea);
+    while (texture->next && ratio > TEXTURE_MIP_THRESHOLD)
+    {
+        texture = texture->next;
+        ratio *= 0.25f;
+    }
+    return texture;
+}
+
+void freeTexture(Texture* texture)
+{
+    while (texture)
+    {
+        Texture* next = texture->next;
+        pdFree(texture->data);
+        pdFree(texture);
+        texture = next;
+    }
+}
+
+void textureSetTexel(Texture* texture, int x, int y, uint8_t value)
+{
+    x &= texture->width - 1;
+    y &= texture->height - 1;
+    int tile = ((y >> TEXTURE_TILE_SHIFT) << texture->tileColumnShift) + (x >> TEXTURE_TILE_SHIFT);
+
+    if (texture->format == kTextureFormat1Bit)
+    {
+        uint8_t* byte = &texture->data[(tile << 3) + (y & 7)];
+        uint8_t bit = 0x80 >> (x & 7);
+        *byte = value ? *byte | bit : *byte & ~bit;
+    }
+    else
+    {
+        uint8_t* byte = &texture->data[(tile << 5) + ((y & 7) << 2) + ((x & 7) >> 1)];
+        int shift = (x & 1) ? 0 : 4;
+        *byte = (uint8_t)((*byte & ~(0x0F << shift)) | ((value & 0x0F) << shift));
+    }
+}
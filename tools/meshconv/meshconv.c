@@ -0,0 +1,280 @@
+/*
+ * Host-side mesh converter.
+ *
+ * Builds the renderer's own mesh.c, bsp.c, reader.c and memory.c against a
+ * minimal stdio-backed Playdate API, loads an OBJ file, builds its BSP tree,
+ * optionally bakes its lighting, and writes the binary format read on device
+ * by loadMeshBinary, or the compressed format read by loadMeshCompressed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pd_api.h"
+#include "memory.h"
+#include "mesh.h"
+#include "meshpack.h"
+#include "bsp.h"
+#include "bake.h"
+
+// The implementation must come after every header that includes stb_ds.h
+#define STB_DS_IMPLEMENTATION
+#include "stb_ds.h"
+
+PlaydateAPI* pd = NULL;
+MemoryArena frameArena;
+
+static void* shimRealloc(void* ptr, size_t size)
+{
+    if (size == 0)
+    {
+        free(ptr);
+        return NULL;
+    }
+    return realloc(ptr, size);
+}
+
+/* Set while timing, so repeated loads do not flood the log */
+static int shimQuiet = 0;
+
+static void shimLog(const char* format, ...)
+{
+    if (shimQuiet)
+    {
+        return;
+    }
+
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fputc('\n', stderr);
+}
+
+static void shimError(const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fputc('\n', stderr);
+    exit(1);
+}
+
+static unsigned int shimTimeMilliseconds(void)
+{
+    return (unsigned int)(clock() * 1000 / CLOCKS_PER_SEC);
+}
+
+static SDFile* shimOpen(const char* name, FileOptions mode)
+{
+    return (SDFile*)fopen(name, (mode & kFileWrite) ? "wb" : "rb");
+}
+
+static int shimClose(SDFile* file)
+{
+    return fclose((FILE*)file);
+}
+
+static int shimRead(SDFile* file, void* buffer, unsigned int length)
+{
+    size_t bytesRead = fread(buffer, 1, length, (FILE*)file);
+    return ferror((FILE*)file) ? -1 : (int)bytesRead;
+}
+
+static int shimWrite(SDFile* file, const void* buffer, unsigned int length)
+{
+    size_t bytesWritten = fwrite(buffer, 1, length, (FILE*)file);
+    return ferror((FILE*)file) ? -1 : (int)bytesWritten;
+}
+
+static int shimStat(const char* path, FileStat* stat)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file)
+    {
+        return -1;
+    }
+    fseek(file, 0, SEEK_END);
+    memset(stat, 0, sizeof(*stat));
+    stat->size = (unsigned int)ftell(file);
+    fclose(file);
+    return 0;
+}
+
+static const struct playdate_sys shimSystem = {
+    .realloc = shimRealloc,
+    .logToConsole = shimLog,
+    .error = shimError,
+    .getCurrentTimeMilliseconds = shimTimeMilliseconds
+};
+
+static const struct playdate_file shimFile = {
+    .open = shimOpen,
+    .close = shimClose,
+    .read = shimRead,
+    .write = shimWrite,
+    .stat = shimStat
+};
+
+static PlaydateAPI shimApi = {
+    .system = &shimSystem,
+    .file = &shimFile
+};
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: meshconv [--no-bsp] [--optimize] [--bake] [--quantize] [--compress] input.obj output.pdm|output.pdz\n");
+}
+
+int main(int argc, char** argv)
+{
+    const char* input = NULL;
+    const char* output = NULL;
+    int buildBSP = 1;
+    int quantize = 0;
+    int compress = 0;
+    int bake = 0;
+    int loadFlags = kMeshLoadDefault;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--no-bsp") == 0)
+        {
+            buildBSP = 0;
+        }
+        else if (strcmp(argv[i], "--optimize") == 0)
+        {
+            loadFlags = kMeshLoadWeld | kMeshLoadOptimize;
+        }
+        else if (strcmp(argv[i], "--bake") == 0)
+        {
+            bake = 1;
+        }
+        else if (strcmp(argv[i], "--quantize") == 0)
+        {
+            quantize = 1;
+        }
+        else if (strcmp(argv[i], "--compress") == 0)
+        {
+            // The compressed format stores quantized positions
+            quantize = 1;
+            compress = 1;
+        }
+        else if (!input)
+        {
+            input = argv[i];
+        }
+        else if (!output)
+        {
+            output = argv[i];
+        }
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+    if (!input || !output)
+    {
+        usage();
+        return 1;
+    }
+
+    pd = &shimApi;
+
+    Mesh* mesh = loadOBJ(input, loadFlags);
+    if (!mesh)
+    {
+        return 1;
+    }
+    if (buildBSP && buildMeshBSP(mesh) != 0)
+    {
+        freeMesh(mesh);
+        return 1;
+    }
+    if (bake && bakeMeshLighting(mesh, NULL) != 0)
+    {
+        freeMesh(mesh);
+        return 1;
+    }
+    if (quantize && quantizeMesh(mesh) != 0)
+    {
+        freeMesh(mesh);
+        return 1;
+    }
+    if ((compress ? saveMeshCompressed(mesh, output) : saveMeshBinary(mesh, output)) != 0)
+    {
+        freeMesh(mesh);
+        return 1;
+    }
+
+    // Load the result back the way the device does to check it round-trips
+    Mesh* check = compress ? loadMeshCompressed(output) : loadMeshBinary(output);
+    int matches = check &&
+        meshVertexCount(check) == meshVertexCount(mesh) &&
+        meshFaceCount(check) == meshFaceCount(mesh) &&
+        arrlen(check->bspNodes) == arrlen(mesh->bspNodes) &&
+        arrlen(check->bakedLevels) == arrlen(mesh->bakedLevels);
+    for (int i = 0; matches && i < meshFaceCount(mesh); i++)
+    {
+        Face a = meshGetFace(mesh, i);
+        Face b = meshGetFace(check, i);
+        matches = memcmp(&a, &b, sizeof(Face)) == 0;
+    }
+    if (matches && mesh->quantizedVertices)
+    {
+        matches = memcmp(check->quantizedVertices, mesh->quantizedVertices,
+            meshVertexCount(mesh) * sizeof(QuantizedVertex)) == 0;
+    }
+    if (matches && mesh->bakedLevels)
+    {
+        matches = memcmp(check->bakedLevels, mesh->bakedLevels, arrlen(mesh->bakedLevels)) == 0;
+    }
+    if (matches && mesh->bspNodes)
+    {
+        matches = memcmp(check->bspNodes, mesh->bspNodes, arrlen(mesh->bspNodes) * sizeof(BSPNode)) == 0;
+    }
+    if (matches && !compress)
+    {
+        // Binary meshes carry their normals, compressed ones recompute them from the decoded positions
+        matches = arrlen(check->faceNormals) == arrlen(mesh->faceNormals) &&
+            arrlen(check->vertexNormals) == arrlen(mesh->vertexNormals) &&
+            memcmp(check->faceNormals, mesh->faceNormals, arrlen(mesh->faceNormals) * sizeof(Vector3D)) == 0 &&
+            memcmp(check->vertexNormals, mesh->vertexNormals, arrlen(mesh->vertexNormals) * sizeof(Vector3D)) == 0;
+    }
+
+    FileStat inputStat, outputStat;
+    shimStat(input, &inputStat);
+    shimStat(output, &outputStat);
+    printf("%s: %u bytes -> %s: %u bytes, %s\n", input, inputStat.size, output, outputStat.size,
+        matches ? "verified" : "VERIFICATION FAILED");
+
+    if (compress && matches)
+    {
+        // Decode repeatedly for long enough to time it with clock()
+        size_t meshSize = meshMemorySize(mesh);
+        int loads = 0;
+        clock_t start = clock();
+        clock_t elapsed;
+        shimQuiet = 1;
+        do
+        {
+            Mesh* decoded = loadMeshCompressed(output);
+            freeMesh(decoded);
+            loads++;
+            elapsed = clock() - start;
+        } while (elapsed < CLOCKS_PER_SEC / 4);
+        shimQuiet = 0;
+
+        double seconds = (double)elapsed / CLOCKS_PER_SEC / loads;
+        printf("compression ratio %.2f:1 over %zu bytes of mesh data, decode %.2f ms, %.1f MB/s\n",
+            (double)meshSize / outputStat.size, meshSize, seconds * 1000.0, meshSize / seconds / (1024.0 * 1024.0));
+    }
+
+    freeMesh(check);
+    freeMesh(mesh);
+    return matches ? 0 : 1;
+}